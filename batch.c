@@ -0,0 +1,188 @@
+/*
+ * fixdiff - fixing batches of patch files
+ *
+ * Copyright (C) 2025 Andy Green <andy@warmcat.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+#define _CRT_SECURE_NO_WARNINGS
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#if !defined(WIN32)
+#include <dirent.h>
+#endif
+
+#include "batch.h"
+
+typedef struct {
+	char		**paths;
+	int		count;
+	int		alloc;
+} pathlist_t;
+
+static int
+pathlist_add(pathlist_t *pl, const char *dir, const char *name, size_t len)
+{
+	size_t dl = dir ? strlen(dir) + 1 : 0;
+	char *p;
+
+	if (pl->count == pl->alloc) {
+		int na = pl->alloc ? pl->alloc * 2 : 256;
+		char **p1 = realloc(pl->paths, (size_t)na * sizeof(*p1));
+
+		if (!p1)
+			return 1;
+		pl->paths = p1;
+		pl->alloc = na;
+	}
+
+	p = malloc(dl + len + 1);
+	if (!p)
+		return 1;
+	if (dir) {
+		memcpy(p, dir, dl - 1);
+		p[dl - 1] = '/';
+	}
+	memcpy(p + dl, name, len);
+	p[dl + len] = '\0';
+	pl->paths[pl->count++] = p;
+
+	return 0;
+}
+
+static int
+pathcmp(const void *a, const void *b)
+{
+	return strcmp(*(char * const *)a, *(char * const *)b);
+}
+
+#if !defined(WIN32)
+static int
+pathlist_dir(pathlist_t *pl, const char *dir)
+{
+	struct dirent *de;
+	DIR *d = opendir(dir);
+
+	if (!d)
+		return 1;
+
+	while ((de = readdir(d))) {
+		size_t l = strlen(de->d_name);
+
+		if ((l > 6 && !strcmp(de->d_name + l - 6, ".patch")) ||
+		    (l > 5 && !strcmp(de->d_name + l - 5, ".diff")))
+			if (pathlist_add(pl, dir, de->d_name, l)) {
+				closedir(d);
+				return 1;
+			}
+	}
+
+	closedir(d);
+
+	/* readdir() order is arbitrary, but we want a stable summary */
+
+	if (pl->count)
+		qsort(pl->paths, (size_t)pl->count, sizeof(*pl->paths),
+		      pathcmp);
+
+	return 0;
+}
+#endif
+
+static int
+pathlist_file(pathlist_t *pl, const char *list)
+{
+	char line[1024];
+	FILE *f = fopen(list, "r");
+
+	if (!f)
+		return 1;
+
+	while (fgets(line, sizeof(line), f)) {
+		size_t l = strlen(line);
+
+		while (l && (line[l - 1] == '\n' || line[l - 1] == '\r'))
+			l--;
+		if (l && pathlist_add(pl, NULL, line, l)) {
+			fclose(f);
+			return 1;
+		}
+	}
+
+	fclose(f);
+
+	return 0;
+}
+
+int
+fixdiff_batch(fixdiff_t *ctx, const char *dir_or_list)
+{
+	fixdiff_result_t *res;
+	pathlist_t pl;
+	struct stat s;
+	int n, fails, r;
+
+	memset(&pl, 0, sizeof(pl));
+
+	if (stat(dir_or_list, &s)) {
+		fprintf(stderr, "Unable to find %s: %d\n", dir_or_list, errno);
+		return 1;
+	}
+
+#if !defined(WIN32)
+	if (S_ISDIR(s.st_mode))
+		r = pathlist_dir(&pl, dir_or_list);
+	else
+#endif
+		r = pathlist_file(&pl, dir_or_list);
+
+	res = calloc((size_t)pl.count + 1, sizeof(*res));
+	if (r || !res) {
+		fprintf(stderr, "Unable to list patches from %s: %d\n",
+			dir_or_list, errno);
+		fails = 1;
+		goto bail;
+	}
+
+	fails = fixdiff_fix_files(ctx, (const char * const *)pl.paths,
+				  pl.count, res);
+
+	for (n = 0; n < pl.count; n++)
+		if (res[n].ret)
+			printf("fail %d/%d %s: %s\n", res[n].repaired,
+			       res[n].stanzas, pl.paths[n], res[n].reason);
+		else
+			printf("ok %d/%d %s\n", res[n].repaired,
+			       res[n].stanzas, pl.paths[n]);
+
+	printf("%d / %d patches fixed\n", pl.count - fails, pl.count);
+
+bail:
+	for (n = 0; n < pl.count; n++)
+		free(pl.paths[n]);
+	free(pl.paths);
+	free(res);
+
+	return !!fails;
+}
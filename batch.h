@@ -0,0 +1,41 @@
+/*
+ * fixdiff - fixing batches of patch files
+ *
+ * Copyright (C) 2025 Andy Green <andy@warmcat.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ *
+ *
+ * --batch takes a directory, meaning every *.patch and *.diff file in it, or
+ * a file listing the patch files one per line.  Each one is fixed into a file
+ * of the same name plus .fixed, and a summary line for each is printed.
+ */
+
+#if !defined(__FIXDIFF_BATCH_H__)
+#define __FIXDIFF_BATCH_H__
+
+#include "fixdiff.h"
+
+/*
+ * Returns 0 if every patch was fixed
+ */
+int
+fixdiff_batch(fixdiff_t *ctx, const char *dir_or_list);
+
+#endif
@@ -0,0 +1,314 @@
+/*
+ * fixdiff - persistent cache of stanza placements
+ *
+ * Copyright (C) 2025 Andy Green <andy@warmcat.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include "cache.h"
+
+#define K1 0x9e3779b97f4a7c15ull
+#define K2 0xc2b2ae3d27d4eb4full
+#define ROTL(_x, _n) (((_x) << (_n)) | ((_x) >> (64 - (_n))))
+
+static uint64_t
+fmix(uint64_t x)
+{
+	x ^= x >> 33;
+	x *= 0xff51afd7ed558ccdull;
+	x ^= x >> 33;
+	x *= 0xc4ceb9fe1a85ec53ull;
+	x ^= x >> 33;
+
+	return x;
+}
+
+/*
+ * Two independent lanes over 8-byte words, so they run in parallel
+ */
+
+void
+fixdiff_cache_hash(uint64_t *h, const void *p, size_t len)
+{
+	uint64_t a = h[0] ^ len, b = h[1] ^ (len * K1), w;
+	const uint8_t *q = p;
+
+	while (len >= 8) {
+		memcpy(&w, q, 8);
+		a = ROTL(a ^ (w * K1), 31) * K2;
+		b = ROTL(b + w, 27) * K1 + 0x52dce729;
+		q += 8;
+		len -= 8;
+	}
+
+	w = 0;
+	memcpy(&w, q, len);
+	a = ROTL(a ^ (w * K1), 31) * K2;
+	b = ROTL(b + w, 27) * K1 + 0x52dce729;
+
+	h[0] = fmix(a + b);
+	h[1] = fmix(b ^ h[0]);
+}
+
+void
+fixdiff_cache_key(const uint64_t *h, char *key)
+{
+	snprintf(key, FIXDIFF_CACHE_KEY, "%016llx%016llx",
+		 (unsigned long long)h[0], (unsigned long long)h[1]);
+}
+
+#if defined(WIN32)
+
+/* the cache isn't supported on windows */
+
+int
+fixdiff_cache_mkdir(const char *dir)
+{
+	(void)dir;
+
+	return 1;
+}
+
+int
+fixdiff_cache_get(const char *dir, const char *key, char **buf, size_t *len)
+{
+	(void)dir;
+	(void)key;
+	(void)buf;
+	(void)len;
+
+	return 1;
+}
+
+int
+fixdiff_cache_put(const char *dir, const char *key, const char *buf,
+		  size_t len)
+{
+	(void)dir;
+	(void)key;
+	(void)buf;
+	(void)len;
+
+	return 1;
+}
+
+void
+fixdiff_cache_trim(const char *dir, uint64_t max)
+{
+	(void)dir;
+	(void)max;
+}
+
+#else
+
+#include <fcntl.h>
+#include <dirent.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+/* no entry is anywhere near this big */
+#define FIXDIFF_CACHE_MAX_ENTRY (1024 * 1024)
+
+int
+fixdiff_cache_mkdir(const char *dir)
+{
+	char path[1024], *p;
+	struct stat s;
+
+	if (!stat(dir, &s))
+		return !S_ISDIR(s.st_mode);
+
+	if (strlen(dir) >= sizeof(path))
+		return 1;
+	strcpy(path, dir);
+
+	for (p = path + 1; *p; p++)
+		if (*p == '/') {
+			*p = '\0';
+			mkdir(path, 0700);
+			*p = '/';
+		}
+
+	return mkdir(path, 0700) && errno != EEXIST;
+}
+
+int
+fixdiff_cache_get(const char *dir, const char *key, char **buf, size_t *len)
+{
+	char path[1024];
+	struct stat s;
+	ssize_t r;
+	int fd;
+
+	snprintf(path, sizeof(path), "%s/%s", dir, key);
+
+	fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return 1;
+
+	if (fstat(fd, &s) || s.st_size > FIXDIFF_CACHE_MAX_ENTRY)
+		goto bail;
+
+	*buf = malloc((size_t)s.st_size + 1);
+	if (!*buf)
+		goto bail;
+
+	*len = 0;
+	while (*len < (size_t)s.st_size) {
+		r = read(fd, *buf + *len, (size_t)s.st_size - *len);
+		if (r < 0 && errno == EINTR)
+			continue;
+		if (r <= 0) {
+			free(*buf);
+			goto bail;
+		}
+		*len += (size_t)r;
+	}
+
+	/* it's the most recently used now */
+	futimens(fd, NULL);
+	close(fd);
+
+	return 0;
+
+bail:
+	close(fd);
+
+	return 1;
+}
+
+int
+fixdiff_cache_put(const char *dir, const char *key, const char *buf,
+		  size_t len)
+{
+	char tmp[1024], path[1024];
+	ssize_t w;
+	int fd;
+
+	snprintf(tmp, sizeof(tmp), "%s/.%s.XXXXXX", dir, key);
+	snprintf(path, sizeof(path), "%s/%s", dir, key);
+
+	fd = mkstemp(tmp);
+	if (fd < 0)
+		return 1;
+
+	while (len) {
+		w = write(fd, buf, len);
+		if (w < 0 && errno == EINTR)
+			continue;
+		if (w <= 0)
+			break;
+		buf += w;
+		len -= (size_t)w;
+	}
+
+	if (close(fd) || len || rename(tmp, path)) {
+		unlink(tmp);
+		return 1;
+	}
+
+	return 0;
+}
+
+typedef struct {
+	time_t		mtime;
+	uint64_t	size;
+	char		name[FIXDIFF_CACHE_KEY];
+} ent_t;
+
+static int
+ent_cmp(const void *a, const void *b)
+{
+	const ent_t *e1 = a, *e2 = b;
+
+	return (e1->mtime > e2->mtime) - (e1->mtime < e2->mtime);
+}
+
+void
+fixdiff_cache_trim(const char *dir, uint64_t max)
+{
+	ent_t *e = NULL, *e1;
+	uint64_t total = 0;
+	size_t n = 0, alloc = 0, i;
+	time_t now = time(NULL);
+	struct dirent *de;
+	struct stat s;
+	DIR *d;
+	int dfd;
+
+	d = opendir(dir);
+	if (!d)
+		return;
+	dfd = dirfd(d);
+
+	while ((de = readdir(d))) {
+		size_t l = strlen(de->d_name);
+
+		if (fstatat(dfd, de->d_name, &s, AT_SYMLINK_NOFOLLOW) ||
+		    !S_ISREG(s.st_mode))
+			continue;
+
+		/* temp files left by a process that died an hour ago */
+
+		if (de->d_name[0] == '.') {
+			if (now - s.st_mtime > 3600)
+				unlinkat(dfd, de->d_name, 0);
+			continue;
+		}
+
+		if (l != FIXDIFF_CACHE_KEY - 1 ||
+		    strspn(de->d_name, "0123456789abcdef") != l)
+			continue;
+
+		if (n == alloc) {
+			alloc = alloc ? alloc * 2 : 256;
+			e1 = realloc(e, alloc * sizeof(*e));
+			if (!e1)
+				goto bail;
+			e = e1;
+		}
+
+		e[n].mtime = s.st_mtime;
+		e[n].size = (uint64_t)s.st_blocks * 512;
+		memcpy(e[n].name, de->d_name, l + 1);
+		total += e[n++].size;
+	}
+
+	if (total > max) {
+		qsort(e, n, sizeof(*e), ent_cmp);
+
+		for (i = 0; i < n && total > max / 4 * 3; i++)
+			if (!unlinkat(dfd, e[i].name, 0) || errno == ENOENT)
+				total -= e[i].size;
+	}
+
+bail:
+	free(e);
+	closedir(d);
+}
+
+#endif
@@ -0,0 +1,76 @@
+/*
+ * fixdiff - persistent cache of stanza placements
+ *
+ * Copyright (C) 2025 Andy Green <andy@warmcat.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ *
+ * Where each stanza was placed is kept in a directory, one small file per
+ * placement, named by a 128-bit hash of everything the placement depends on.
+ * Files are written to a temp name and renamed into place, so concurrent
+ * processes only ever see whole entries.  A hit updates the entry's mtime,
+ * so trimming the directory by oldest mtime drops the least recently used.
+ */
+
+#if !defined(__FIXDIFF_CACHE_H__)
+#define __FIXDIFF_CACHE_H__
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* the key as hex, and a NUL */
+#define FIXDIFF_CACHE_KEY 33
+
+/*
+ * Add len bytes at p to the 128-bit hash in h, which starts zeroed
+ */
+void
+fixdiff_cache_hash(uint64_t *h, const void *p, size_t len);
+
+void
+fixdiff_cache_key(const uint64_t *h, char *key);
+
+/*
+ * Make the cache dir, and any parents it needs.  Returns 0 if it exists.
+ */
+int
+fixdiff_cache_mkdir(const char *dir);
+
+/*
+ * Returns 0 with the entry in *buf, which has room for one more byte on the
+ * end and must be freed, or nonzero if there's no such entry
+ */
+int
+fixdiff_cache_get(const char *dir, const char *key, char **buf, size_t *len);
+
+/*
+ * Returns 0 if the entry was stored
+ */
+int
+fixdiff_cache_put(const char *dir, const char *key, const char *buf,
+		  size_t len);
+
+/*
+ * If the entries take up more than max bytes on disk, delete the least
+ * recently used until they take up three quarters of it
+ */
+void
+fixdiff_cache_trim(const char *dir, uint64_t max);
+
+#endif
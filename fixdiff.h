@@ -0,0 +1,241 @@
+/*
+ * libfixdiff - public api
+ *
+ * Copyright (C) 2025 Andy Green <andy@warmcat.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ *
+ * A fixdiff context holds everything about fixing patches, there is no global
+ * state.  A context may only be used by one thread at a time, but any number
+ * of contexts may be used at once on different threads.
+ */
+
+#if !defined(__FIXDIFF_H__)
+#define __FIXDIFF_H__
+
+#include <stddef.h>
+
+#if defined(__cplusplus)
+extern "C" {
+#endif
+
+#if defined(_WIN32) && defined(FIXDIFF_SHARED_BUILD)
+#define FIXDIFF_VISIBLE __declspec(dllexport)
+#elif defined(__GNUC__) || defined(__clang__)
+#define FIXDIFF_VISIBLE __attribute__((visibility("default")))
+#else
+#define FIXDIFF_VISIBLE
+#endif
+
+typedef struct fixdiff fixdiff_t;
+
+/*
+ * Called with each piece of the fixed patch, or of the diagnostics, in order.
+ * Return nonzero to fail the fix.
+ */
+
+typedef int (*fixdiff_cb_t)(void *opaque, const char *buf, size_t len);
+
+/* fixdiff_info_t.flags */
+
+enum {
+	FIXDIFF_FLAG_NEAREST		= (1 << 0),
+	/* pick the match nearest the header line, not the first in the file */
+	FIXDIFF_FLAG_STDOUT		= (1 << 1),
+	/* write the fixed patch to stdout instead of using out */
+	FIXDIFF_FLAG_STDERR		= (1 << 2),
+	/* write the diagnostics to stderr instead of using diag */
+	FIXDIFF_FLAG_KEEP_SOURCES	= (1 << 3),
+	/* keep sources loaded between fixes, reloading any that changed */
+	FIXDIFF_FLAG_STATS		= (1 << 4),
+	/* collect counters and timings for fixdiff_stats() */
+	FIXDIFF_FLAG_PIPELINE		= (1 << 5),
+	/* parse, place and emit stanzas on their own threads as they arrive */
+	FIXDIFF_FLAG_APPLY		= (1 << 6),
+	/* also apply the fixed patch to the sources, see fixdiff_fix_buf() */
+	FIXDIFF_FLAG_VERIFY		= (1 << 7),
+	/* with APPLY, each patched file must have the blob id its index line
+	 * gives, as "index <old>..<new>" in a git diff */
+	FIXDIFF_FLAG_CHECK		= (1 << 8),
+	/* only find where each stanza goes, see fixdiff_fix_buf() */
+	FIXDIFF_FLAG_CHECK_ALL		= (1 << 9),
+	/* check, but carry on past stanzas that can't be placed */
+	FIXDIFF_FLAG_PLACEMENTS		= (1 << 10),
+	/* record where each stanza was placed for fixdiff_placements() */
+};
+
+/*
+ * Zero this and set what you need, zero means the default
+ */
+
+typedef struct fixdiff_info {
+	const char	*root;
+	/* dir the paths in the patch are relative to, NULL for cwd */
+	fixdiff_cb_t	out;
+	/* gets the fixed patch, NULL to collect it for fixdiff_output() */
+	fixdiff_cb_t	diag;
+	/* gets diagnostics, NULL to collect them for fixdiff_diagnostics() */
+	void		*opaque;
+	/* passed to the callbacks */
+	unsigned int	flags;
+	/* FIXDIFF_FLAG_... */
+	int		jobs;
+	/*
+	 * threads to fix the files in a patch with, 0 or 1 for just this one...
+	 * with FIXDIFF_FLAG_PIPELINE, threads to place the stanzas with
+	 */
+	int		fuzz;
+	/* if no exact placement, edits allowed per stanza to place it, 0 none */
+	const char	*git_rev;
+	/*
+	 * read the sources from this revision in the git repo at root, or the
+	 * blob a file's index line names, instead of the files, NULL for files
+	 */
+	const char	*cache_dir;
+	/*
+	 * keep where stanzas were placed in this dir, created if needed, and
+	 * skip the search next time the same stanza is fixed against the same
+	 * source, NULL for no cache.  It can be shared by any number of
+	 * processes.  Not on windows.
+	 */
+	size_t		cache_max;
+	/* bytes on disk the cache may use, 0 for FIXDIFF_CACHE_DEFAULT_MAX */
+	size_t		max_mem;
+	/*
+	 * bytes a search may use, 0 for no limit.  A source file bigger than
+	 * half this is not loaded, each stanza streams through it once instead,
+	 * holding about this much at most.  Such a file can't be applied to,
+	 * and it isn't searched with fuzz, cached placements or previous ones.
+	 */
+} fixdiff_info_t;
+
+#define FIXDIFF_CACHE_DEFAULT_MAX (16 * 1024 * 1024)
+
+typedef struct fixdiff_result {
+	const char	*reason;
+	/* if it failed, a short description of why */
+	int		ret;
+	/* 0 if the patch was fixed OK */
+	int		stanzas;
+	/* stanzas we saw */
+	int		repaired;
+	/* stanzas whose header we had to change */
+	int		failed;
+	/* with FIXDIFF_FLAG_CHECK..., stanzas that couldn't be placed */
+} fixdiff_result_t;
+
+/*
+ * Returns a new context, or NULL if OOM.  info is copied, but root, git_rev
+ * and cache_dir must stay valid until the context is destroyed.
+ */
+FIXDIFF_VISIBLE fixdiff_t *
+fixdiff_create(const fixdiff_info_t *info);
+
+FIXDIFF_VISIBLE void
+fixdiff_destroy(fixdiff_t **ctx);
+
+/*
+ * Fix the patch in buf, or read from fd until EOF.  Returns 0 if OK, or
+ * nonzero if the patch couldn't be fixed, in which case the output stops where
+ * the problem is and the diagnostics say why.  res may be NULL.
+ *
+ * The source files are read fresh for each call, unless the context has
+ * FIXDIFF_FLAG_KEEP_SOURCES.  Then they are kept loaded and indexed between
+ * calls, and only reloaded if they changed on disk.  On Linux, inotify tells
+ * us about changes, elsewhere we stat each kept file at the start of a call.
+ *
+ * With FIXDIFF_FLAG_APPLY, the fixed patch is also applied, using the
+ * placements we found rather than searching again like patch would.  Only if
+ * the whole patch was fixed, each patched file is written to a temp file
+ * beside it, which is then renamed over it.  Otherwise nothing is changed.
+ * The originals are hard linked beside them until every file is replaced, so
+ * if replacing one fails, the ones already replaced are put back.  A patch
+ * changing the same file twice can't be applied like this.
+ *
+ * With FIXDIFF_FLAG_CHECK, nothing is output, and only what is needed to place
+ * each stanza is done.  The diagnostics are just a line for each stanza,
+ * saying where it goes or that it can't be placed, and a summary.  It stops at
+ * the first stanza that can't be placed, unless FIXDIFF_FLAG_CHECK_ALL.  The
+ * return is 0 only if every stanza could be placed.
+ */
+FIXDIFF_VISIBLE int
+fixdiff_fix_buf(fixdiff_t *ctx, const char *buf, size_t len,
+		fixdiff_result_t *res);
+
+FIXDIFF_VISIBLE int
+fixdiff_fix_fd(fixdiff_t *ctx, int fd, fixdiff_result_t *res);
+
+/*
+ * Fix each of the count patch files in paths into a file with the same name
+ * plus ".fixed", filling in res[] for each.  The files are fixed on up to
+ * info.jobs threads, sharing the loaded sources.  The fixed patches don't go
+ * to the out callback, the diagnostics for any that failed go to the diag
+ * callback afterwards, in order.  Returns how many failed.
+ */
+FIXDIFF_VISIBLE int
+fixdiff_fix_files(fixdiff_t *ctx, const char * const *paths, int count,
+		  fixdiff_result_t *res);
+
+/*
+ * If there is no out or diag callback, what the last fix produced is held
+ * in the context until the next fix
+ */
+FIXDIFF_VISIBLE const char *
+fixdiff_output(fixdiff_t *ctx, size_t *len);
+
+FIXDIFF_VISIBLE const char *
+fixdiff_diagnostics(fixdiff_t *ctx, size_t *len);
+
+/*
+ * With FIXDIFF_FLAG_STATS, JSON describing what the last fixdiff_fix_buf() or
+ * fixdiff_fix_fd() cost.  "stanzas" has an object per stanza with the
+ * placements tried, line compares, lines placed with whitespace fuzz, bytes
+ * read from the patch and sources, syscalls, and microseconds spent searching
+ * for the placement and emitting the stanza.  "placed" is the 1-based source
+ * line it was placed at, or 0 if it couldn't be.  "totals" has the same
+ * counts for the whole fix, along with the result, the wall time, and the
+ * peak memory of the process so far.
+ */
+FIXDIFF_VISIBLE const char *
+fixdiff_stats(fixdiff_t *ctx, size_t *len);
+
+/*
+ * With FIXDIFF_FLAG_PLACEMENTS, where each stanza the last fixdiff_fix_buf()
+ * or fixdiff_fix_fd() placed went, as text to give to fixdiff_previous() for
+ * another try at the same patch.
+ */
+FIXDIFF_VISIBLE const char *
+fixdiff_placements(fixdiff_t *ctx, size_t *len);
+
+/*
+ * Give the context what fixdiff_placements() said about an earlier fix, and
+ * each stanza in later fixes is first tried where it went then.  A stanza
+ * with the same ' ' and '-' lines, ignoring whitespace, is tried where it was
+ * placed and then near there, one that changed is searched for as usual, so
+ * only the stanzas that changed cost a search.  buf is copied, len 0 forgets
+ * it.  Returns 0, or nonzero if buf isn't usable, when it is ignored.
+ */
+FIXDIFF_VISIBLE int
+fixdiff_previous(fixdiff_t *ctx, const char *buf, size_t len);
+
+#if defined(__cplusplus)
+}
+#endif
+
+#endif
@@ -0,0 +1,488 @@
+/*
+ * fixdiff - sources from a git object database
+ *
+ * Copyright (C) 2025 Andy Green <andy@warmcat.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ *
+ * Requests are one object name per line, and the answer is either
+ * "<id> <type> <size>\n" followed by the contents and a '\n', or
+ * "<name> missing\n" and similar.  git's stdin and stdout are one end of a
+ * socketpair, so if git dies, writing to it fails rather than raising SIGPIPE.
+ * The caller must serialize the requests.
+ */
+
+#if defined(WIN32)
+
+#include <errno.h>
+
+#include "git.h"
+
+fixdiff_git_t *
+fixdiff_git_create(const char *dir)
+{
+	(void)dir;
+
+	return NULL;
+}
+
+void
+fixdiff_git_destroy(fixdiff_git_t **pg)
+{
+	*pg = NULL;
+}
+
+int
+fixdiff_git_dead(const fixdiff_git_t *g)
+{
+	(void)g;
+
+	return 1;
+}
+
+int
+fixdiff_git_commit(fixdiff_git_t *g, const char *rev, char *commit,
+		   size_t len)
+{
+	(void)g;
+	(void)rev;
+	(void)commit;
+	(void)len;
+
+	return 1;
+}
+
+int
+fixdiff_git_blob(fixdiff_git_t *g, const char *obj, char **buf, size_t *len)
+{
+	(void)g;
+	(void)obj;
+	(void)buf;
+	(void)len;
+
+	return EIO;
+}
+
+#else
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <spawn.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+
+#include "git.h"
+
+#if !defined(MSG_NOSIGNAL)
+#define MSG_NOSIGNAL 0 /* we set SO_NOSIGPIPE instead */
+#endif
+
+extern char **environ;
+
+struct fixdiff_git {
+	char		rx[16384];
+	size_t		rx_pos;
+	size_t		rx_len;
+	pid_t		pid;
+	int		fd;
+	char		dead;
+};
+
+fixdiff_git_t *
+fixdiff_git_create(const char *dir)
+{
+	char *argv[] = { (char *)"git", (char *)"-C", (char *)(dir ? dir : "."),
+			 (char *)"cat-file", (char *)"--batch", NULL };
+	posix_spawn_file_actions_t fa;
+	fixdiff_git_t *g;
+	int sv[2], r, ty = SOCK_STREAM;
+
+	g = calloc(1, sizeof(*g));
+	if (!g)
+		return NULL;
+
+#if defined(SOCK_CLOEXEC)
+	ty |= SOCK_CLOEXEC;
+#endif
+	if (socketpair(AF_UNIX, ty, 0, sv)) {
+		free(g);
+		return NULL;
+	}
+
+	/* in case some other thread forks before we can set it */
+
+	fcntl(sv[0], F_SETFD, FD_CLOEXEC);
+	fcntl(sv[1], F_SETFD, FD_CLOEXEC);
+#if defined(SO_NOSIGPIPE)
+	{
+		int one = 1;
+
+		setsockopt(sv[0], SOL_SOCKET, SO_NOSIGPIPE, &one, sizeof(one));
+	}
+#endif
+
+	/* git complains on stderr, we say what went wrong ourselves */
+
+	posix_spawn_file_actions_init(&fa);
+	posix_spawn_file_actions_adddup2(&fa, sv[1], 0);
+	posix_spawn_file_actions_adddup2(&fa, sv[1], 1);
+	posix_spawn_file_actions_addopen(&fa, 2, "/dev/null", O_WRONLY, 0);
+
+	r = posix_spawnp(&g->pid, "git", &fa, NULL, argv, environ);
+	posix_spawn_file_actions_destroy(&fa);
+	close(sv[1]);
+
+	if (r) {
+		close(sv[0]);
+		free(g);
+		errno = r;
+		return NULL;
+	}
+
+	g->fd = sv[0];
+
+	return g;
+}
+
+void
+fixdiff_git_destroy(fixdiff_git_t **pg)
+{
+	fixdiff_git_t *g = *pg;
+
+	if (!g)
+		return;
+
+	/* git exits when it sees EOF on its stdin */
+
+	close(g->fd);
+	while (waitpid(g->pid, NULL, 0) < 0 && errno == EINTR)
+		;
+	free(g);
+
+	*pg = NULL;
+}
+
+int
+fixdiff_git_dead(const fixdiff_git_t *g)
+{
+	return g->dead;
+}
+
+static int
+fixdiff_git_fill(fixdiff_git_t *g)
+{
+	ssize_t r;
+
+	do {
+		r = read(g->fd, g->rx, sizeof(g->rx));
+	} while (r < 0 && errno == EINTR);
+
+	if (r <= 0) {
+		g->dead = 1;
+		return 1;
+	}
+
+	g->rx_pos = 0;
+	g->rx_len = (size_t)r;
+
+	return 0;
+}
+
+/*
+ * Copy the next len bytes of the answer to dst, or discard them if NULL
+ */
+
+static int
+fixdiff_git_read(fixdiff_git_t *g, char *dst, size_t len)
+{
+	while (len) {
+		size_t n;
+
+		if (g->rx_pos == g->rx_len && fixdiff_git_fill(g))
+			return 1;
+
+		n = g->rx_len - g->rx_pos;
+		if (n > len)
+			n = len;
+		if (dst) {
+			memcpy(dst, g->rx + g->rx_pos, n);
+			dst += n;
+		}
+		g->rx_pos += n;
+		len -= n;
+	}
+
+	return 0;
+}
+
+/*
+ * Ask for obj and read the header line of the answer.  Returns 0 with the
+ * type and size if it exists, ENOENT if not, or EIO.
+ */
+
+static int
+fixdiff_git_ask(fixdiff_git_t *g, const char *obj, char *id, char *type,
+		size_t *size)
+{
+	char line[1024], *sp;
+	size_t n = 0, ol = strlen(obj);
+
+	if (g->dead || !ol || ol > sizeof(line) - 2 || strchr(obj, '\n'))
+		return g->dead ? EIO : ENOENT;
+
+	memcpy(line, obj, ol);
+	line[ol++] = '\n';
+
+	for (sp = line; ol; ) {
+		ssize_t w = send(g->fd, sp, ol, MSG_NOSIGNAL);
+
+		if (w < 0) {
+			if (errno == EINTR)
+				continue;
+			g->dead = 1;
+			return EIO;
+		}
+		sp += w;
+		ol -= (size_t)w;
+	}
+
+	while (1) {
+		if (fixdiff_git_read(g, line + n, 1))
+			return EIO;
+		if (line[n] == '\n')
+			break;
+		if (++n == sizeof(line) - 1) {
+			/* we can't be in step with it any more */
+			g->dead = 1;
+			return EIO;
+		}
+	}
+	line[n] = '\0';
+
+	/* "<name> missing", "<name> ambiguous" etc have no size on the end */
+
+	sp = strrchr(line, ' ');
+	if (!sp || !sp[1] || strspn(sp + 1, "0123456789") != strlen(sp + 1))
+		return ENOENT;
+
+	*size = (size_t)strtoull(sp + 1, NULL, 10);
+	*sp = '\0';
+
+	sp = strchr(line, ' ');
+	if (!sp || sp - line >= FIXDIFF_GIT_HEX || strlen(sp + 1) > 15) {
+		g->dead = 1;
+		return EIO;
+	}
+
+	memcpy(id, line, (size_t)(sp - line));
+	id[sp - line] = '\0';
+	strcpy(type, sp + 1);
+
+	return 0;
+}
+
+int
+fixdiff_git_commit(fixdiff_git_t *g, const char *rev, char *commit,
+		   size_t len)
+{
+	char obj[1024], id[FIXDIFF_GIT_HEX], type[16];
+	size_t size;
+
+	snprintf(obj, sizeof(obj), "%s^{commit}", rev);
+
+	if (fixdiff_git_ask(g, obj, id, type, &size) ||
+	    fixdiff_git_read(g, NULL, size + 1) || strlen(id) >= len)
+		return 1;
+
+	strcpy(commit, id);
+
+	return 0;
+}
+
+int
+fixdiff_git_blob(fixdiff_git_t *g, const char *obj, char **buf, size_t *len)
+{
+	char id[FIXDIFF_GIT_HEX], type[16];
+	size_t size;
+	int r;
+
+	r = fixdiff_git_ask(g, obj, id, type, &size);
+	if (r)
+		return r;
+
+	if (strcmp(type, "blob")) {
+		/* a tree, or something, we still have to eat it */
+		if (fixdiff_git_read(g, NULL, size + 1))
+			return EIO;
+
+		return ENOENT;
+	}
+
+	*buf = malloc(size + 2);
+	if (!*buf) {
+		/* we have to eat it anyway */
+		if (fixdiff_git_read(g, NULL, size + 1))
+			return EIO;
+
+		return ENOMEM;
+	}
+
+	if (fixdiff_git_read(g, *buf, size) ||
+	    fixdiff_git_read(g, NULL, 1)) {
+		free(*buf);
+		*buf = NULL;
+
+		return EIO;
+	}
+
+	*len = size;
+
+	return 0;
+}
+
+#endif
+
+/*
+ * The blob id is the SHA-1 of "blob <len>\0" and the contents, so we can
+ * work it out without git
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+
+#include "git.h"
+
+typedef struct {
+	uint32_t	h[5];
+	uint8_t		blk[64];
+	uint64_t	len;
+	size_t		fill;
+} sha1_t;
+
+#define ROL(_x, _n) (((_x) << (_n)) | ((_x) >> (32 - (_n))))
+
+static void
+sha1_block(sha1_t *s)
+{
+	uint32_t w[80], a = s->h[0], b = s->h[1], c = s->h[2], d = s->h[3],
+		 e = s->h[4], f, k, t;
+	int n;
+
+	for (n = 0; n < 16; n++)
+		w[n] = (uint32_t)s->blk[n * 4] << 24 |
+		       (uint32_t)s->blk[n * 4 + 1] << 16 |
+		       (uint32_t)s->blk[n * 4 + 2] << 8 | s->blk[n * 4 + 3];
+	for (; n < 80; n++)
+		w[n] = ROL(w[n - 3] ^ w[n - 8] ^ w[n - 14] ^ w[n - 16], 1);
+
+	for (n = 0; n < 80; n++) {
+		if (n < 20) {
+			f = (b & c) | (~b & d);
+			k = 0x5a827999;
+		} else if (n < 40) {
+			f = b ^ c ^ d;
+			k = 0x6ed9eba1;
+		} else if (n < 60) {
+			f = (b & c) | (b & d) | (c & d);
+			k = 0x8f1bbcdc;
+		} else {
+			f = b ^ c ^ d;
+			k = 0xca62c1d6;
+		}
+
+		t = ROL(a, 5) + f + e + k + w[n];
+		e = d;
+		d = c;
+		c = ROL(b, 30);
+		b = a;
+		a = t;
+	}
+
+	s->h[0] += a;
+	s->h[1] += b;
+	s->h[2] += c;
+	s->h[3] += d;
+	s->h[4] += e;
+}
+
+static void
+sha1_add(sha1_t *s, const void *buf, size_t len)
+{
+	const uint8_t *p = buf;
+
+	s->len += len;
+
+	while (len) {
+		size_t n = sizeof(s->blk) - s->fill;
+
+		if (n > len)
+			n = len;
+		memcpy(s->blk + s->fill, p, n);
+		s->fill += n;
+		p += n;
+		len -= n;
+
+		if (s->fill == sizeof(s->blk)) {
+			sha1_block(s);
+			s->fill = 0;
+		}
+	}
+}
+
+void
+fixdiff_git_blob_id(const char *buf, size_t len, char *hex)
+{
+	uint8_t pad[72];
+	uint64_t bits;
+	char hdr[32];
+	size_t pl;
+	sha1_t s;
+	int n;
+
+	memset(&s, 0, sizeof(s));
+	s.h[0] = 0x67452301;
+	s.h[1] = 0xefcdab89;
+	s.h[2] = 0x98badcfe;
+	s.h[3] = 0x10325476;
+	s.h[4] = 0xc3d2e1f0;
+
+	n = snprintf(hdr, sizeof(hdr), "blob %llu", (unsigned long long)len);
+	sha1_add(&s, hdr, (size_t)n + 1);
+	sha1_add(&s, buf, len);
+
+	/* 0x80, then zeros to 56 mod 64, then the length in bits */
+
+	bits = s.len * 8;
+	pl = (s.fill < 56 ? 56 : 120) - s.fill;
+	memset(pad, 0, sizeof(pad));
+	pad[0] = 0x80;
+	for (n = 0; n < 8; n++)
+		pad[pl + (size_t)n] = (uint8_t)(bits >> (56 - n * 8));
+	sha1_add(&s, pad, pl + 8);
+
+	for (n = 0; n < 20; n++)
+		sprintf(hex + n * 2, "%02x",
+			(unsigned int)(s.h[n / 4] >> (24 - (n % 4) * 8)) & 0xff);
+}
@@ -0,0 +1,79 @@
+/*
+ * fixdiff - sources from a git object database
+ *
+ * Copyright (C) 2025 Andy Green <andy@warmcat.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ *
+ * With --git-rev, the sources come from the local git object database rather
+ * than the files.  We keep one "git cat-file --batch" running and ask it for
+ * each source we need, either by the blob id from the patch's index line, or
+ * as the path at a commit.
+ */
+
+#if !defined(__FIXDIFF_GIT_H__)
+#define __FIXDIFF_GIT_H__
+
+#include <stddef.h>
+
+/* enough for a sha256 object id in hex */
+#define FIXDIFF_GIT_HEX 72
+
+typedef struct fixdiff_git fixdiff_git_t;
+
+/*
+ * Start git cat-file in dir, NULL for the cwd.  Returns NULL if it can't be
+ * started.
+ */
+fixdiff_git_t *
+fixdiff_git_create(const char *dir);
+
+void
+fixdiff_git_destroy(fixdiff_git_t **pg);
+
+/*
+ * Nonzero if git went away, it needs creating again
+ */
+int
+fixdiff_git_dead(const fixdiff_git_t *g);
+
+/*
+ * Find the commit rev means right now, as hex into commit.  Returns 0 if OK.
+ */
+int
+fixdiff_git_commit(fixdiff_git_t *g, const char *rev, char *commit,
+		   size_t len);
+
+/*
+ * Fetch the blob named by obj, a blob id or <commit>:./<path>, with paths
+ * relative to dir.  Returns 0 with the contents in *buf, which has room for
+ * one more byte on the end and must be freed.  Otherwise returns ENOENT if
+ * there's no such blob, ENOMEM, or EIO if git went away.
+ */
+int
+fixdiff_git_blob(fixdiff_git_t *g, const char *obj, char **buf, size_t *len);
+
+/*
+ * The SHA-1 blob id git would give contents buf, as 40 hex chars and a NUL
+ * into hex.  This doesn't need git, so it works everywhere.
+ */
+void
+fixdiff_git_blob_id(const char *buf, size_t len, char *hex);
+
+#endif
@@ -0,0 +1,6033 @@
+/*
+ * libfixdiff
+ *
+ * Copyright (C) 2025 Andy Green <andy@warmcat.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ *
+ * See ./README.md for build and usage information.
+ *
+ */
+#define _CRT_SECURE_NO_WARNINGS
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#if !defined(WIN32)
+#include <unistd.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include <sys/resource.h>
+#define TO_POSLEN(x) (x)
+#define OFLAGS(x) (x)
+#else
+#include <windows.h>
+#include <processthreadsapi.h>
+#include <psapi.h>
+#include <BaseTsd.h>
+#include <io.h>
+#include <direct.h>
+#define ssize_t SSIZE_T
+#define open _open
+#define read _read
+#define lseek _lseek
+#define close _close
+#define write _write
+#define TO_POSLEN(x) (unsigned int)(x)
+#define OFLAGS(x) (_O_BINARY | (x))
+struct iovec {
+	void		*iov_base;
+	size_t		iov_len;
+};
+#endif
+#include <fcntl.h>
+#include <errno.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <limits.h>
+
+#include <stdarg.h>
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#if defined(__linux__)
+#include <sys/inotify.h>
+#endif
+
+#include "fixdiff.h"
+#include "simd.h"
+#include "git.h"
+#include "cache.h"
+
+#if defined(FIXDIFF_WITH_PTHREADS)
+#include <pthread.h>
+typedef pthread_mutex_t lock_t;
+#define LOCK_INIT(x) pthread_mutex_init(x, NULL)
+#define LOCK_DESTROY(x) pthread_mutex_destroy(x)
+#define LOCK(x) pthread_mutex_lock(x)
+#define UNLOCK(x) pthread_mutex_unlock(x)
+#else
+typedef char lock_t;
+#define LOCK_INIT(x) (void)(x)
+#define LOCK_DESTROY(x) (void)(x)
+#define LOCK(x) (void)(x)
+#define UNLOCK(x) (void)(x)
+#endif
+
+#if defined(IOV_MAX) && IOV_MAX < 256
+#define FIXDIFF_IOV IOV_MAX
+#else
+#define FIXDIFF_IOV 256
+#endif
+
+#define elog(pdp, ...) fixdiff_log((pdp)->ctx, pdp, 0, __VA_ARGS__)
+#define ctxlog(ctx, ...) fixdiff_log(ctx, NULL, 0, __VA_ARGS__)
+/* the results of a check, which is all that a check logs */
+#define chklog(ctx, pdp, ...) fixdiff_log(ctx, pdp, 1, __VA_ARGS__)
+
+typedef enum {
+	DSS_WAIT_MMM,
+	DSS_MUST_PPP,
+	DSS_MUST_AA,
+	DSS_AA_OR_MMM,
+	DSS_PMSAD,
+} dss_t;
+
+/*
+ * Line reader that hands out views of the input, rather than copying it.
+ *
+ * If the whole input is in memory (a job's share of stdin, or stdin mapped
+ * because it's a regular file), the views point straight into that.
+ * Otherwise we read() into a window, and only the partial line at the end of
+ * it is moved down when we read more.  The window grows to hold the longest
+ * line, however long, and is reused for the rest.
+ */
+
+typedef struct {
+	char		*tail; /* last line given an EOL */
+	size_t		tail_alloc;
+	const char	*name;
+	char		*buf; /* read() window */
+	size_t		alloc;
+	const char	*p; /* the input we are handing out views of */
+	size_t		len; /* valid length at p */
+	size_t		pos; /* start of the next line at p */
+	size_t		scanned; /* bytes after pos we know have no EOL */
+	const char	*map; /* mapping, if we made one */
+	size_t		map_len;
+	off_t		ro; /* input offset of p */
+	off_t		bls; /* input offset of the last line we handed out */
+	int		fd;
+	int		li;
+	int		err; /* errno if reading failed */
+	unsigned long	nsys; /* syscalls we made */
+	char		eof;
+} lbuf_t;
+
+/*
+ * A source file the patch refers to, loaded once per run along with a table
+ * of where each line starts, so matching needs no further file access
+ */
+
+typedef struct srcfile {
+	struct srcfile		*next;
+	char			*buf;
+	size_t			len;
+	size_t			*lo; /* line n is buf + lo[n] to buf + lo[n + 1] */
+	uint32_t		*lh; /* whitespace-normalized hash of each line */
+	int			*hb; /* first line in each hash bucket, or -1 */
+	int			*hn; /* next line in the same bucket, ascending */
+	int			*hc; /* lines from this one on with its hash */
+	uint32_t		hmask;
+	lock_t			lock;
+	int			lines;
+	int			err; /* errno if loading failed */
+	char			loaded;
+	char			mapped;
+	char			stale; /* changed on disk since we loaded it */
+	char			git; /* name is a git object */
+	char			stream; /* see fixdiff_stream_find() */
+	char			hashed; /* ch is valid */
+	uint64_t		ch[2]; /* content hash, for the placement cache */
+	const char		*root; /* NULL for cwd */
+	int			wd; /* inotify watch, or -1 */
+	time_t			mtime; /* how it was on disk when we loaded it */
+	off_t			size;
+	ino_t			ino;
+	char			name[640];
+} srcfile_t;
+
+/*
+ * The source files are shared between all the jobs in a run
+ */
+
+typedef struct {
+	srcfile_t		*head;
+	const char		*root; /* NULL for cwd */
+	const char		*git_rev; /* sources come from here, or NULL */
+	fixdiff_git_t		*git;
+	lock_t			lock;
+	lock_t			git_lock; /* one request to git at a time */
+	int			ifd; /* inotify fd when keeping sources, or -1 */
+	char			keep; /* keep sources between fixes */
+	char			repinned; /* git_rev means a different commit now */
+	char			cache_put; /* we added to the placement cache */
+	uint64_t		max_mem; /* stream files over half this, or 0 */
+	char			commit[FIXDIFF_GIT_HEX]; /* what git_rev means */
+} srccache_t;
+
+typedef struct {
+	char			nearest;
+	char			stats;
+	char			pipeline;
+	char			apply;
+	char			verify; /* applied files must match their index line */
+	char			check; /* place the stanzas, but emit nothing */
+	char			check_all; /* and carry on past ones that fail */
+	int			jobs;
+	int			fuzz; /* edits allowed per stanza, 0 for none */
+	const char		*cache; /* placement cache dir, or NULL */
+	uint64_t		cache_max;
+	char			placements; /* record where the stanzas went */
+	uint64_t		max_mem; /* memory budget for a search, or 0 */
+} opts_t;
+
+/*
+ * What the work cost, with FIXDIFF_FLAG_STATS.  Each dp keeps running totals
+ * and a stanza's share is the difference across it.
+ */
+
+typedef struct {
+	uint64_t		candidates; /* placements tried */
+	uint64_t		compared; /* line compares */
+	uint64_t		ws_fuzz; /* lines placed with whitespace fuzz */
+	uint64_t		bytes; /* read from the patch and the sources */
+	uint64_t		syscalls;
+	uint64_t		search_ns;
+	uint64_t		emit_ns;
+} stats_t;
+
+/*
+ * Lines of the stanza we are collecting, held in a growable arena that is
+ * reused for each stanza
+ */
+
+typedef struct {
+	size_t			ofs;
+	size_t			len;
+} sline_t;
+
+typedef struct {
+	char			*buf;
+	size_t			len;
+	size_t			alloc;
+	sline_t			*sl;
+	int			count;
+	int			alloc_lines;
+} stanza_t;
+
+/*
+ * Output is gathered into an iovec batch and flushed with writev() at the end
+ * of each stanza, when the batch is full, or at exit.  Anything that won't
+ * stay put until the flush is copied into the staging buffer first.
+ */
+
+typedef struct {
+	char			*mem;
+	size_t			mem_len;
+	size_t			mem_alloc;
+} membuf_t;
+
+/*
+ * Where output or diagnostics go... an fd if not -1, otherwise the callback
+ * if any, otherwise appended to mb
+ */
+
+typedef struct {
+	fixdiff_cb_t		cb;
+	void			*opaque;
+	membuf_t		*mb;
+	int			fd;
+} sink_t;
+
+typedef struct {
+	struct iovec		iov[FIXDIFF_IOV];
+	char			stage[16384];
+	sink_t			sink;
+	size_t			stage_len;
+	unsigned long		nsys; /* syscalls we made */
+	int			niov;
+} outbuf_t;
+
+/*
+ * A stanza line that only matched the source with whitespace fuzz, or with
+ * edits when fuzzy, while we are still trying a candidate... we only keep
+ * where the source line is
+ */
+
+typedef struct {
+	int			line; /* stanza line */
+	int			sl; /* source line */
+} ws_fix_t;
+
+/*
+ * Once we have the match, the stanza lines to be replaced with the source
+ * line (without its EOL), indexed by stanza line
+ */
+
+typedef struct {
+	const char		*src; /* NULL if not rewritten */
+	size_t			len;
+} rewrite_t;
+
+/*
+ * With --nearest, candidate start lines are tried in order of distance from
+ * up to two seed lines, alternately after and before each seed
+ */
+
+typedef struct {
+	int			seed[2];
+	int			nseed;
+	int			d;
+	int			step;
+} probe_t;
+
+/*
+ * A match must have the stanza's first ' ' or '-' line at its start, and its
+ * k'th one k lines later.  If the first line is common in the source, we look
+ * for candidates by the rarest of them instead, so the work is bounded by how
+ * often that appears, not by how often a line like "}" does.
+ */
+
+typedef struct {
+	uint32_t		fh; /* first ' ' or '-' line */
+	uint32_t		ah; /* the anchor line */
+	int			k; /* how many lines after the start ah is */
+	int			x; /* anchor line of the current candidate */
+} anchor_t;
+
+/*
+ * If the first line appears at most this many times, we just use that
+ */
+
+#define FIXDIFF_ANCHOR_COMMON 16
+
+/*
+ * Where a stanza was placed by an earlier fix, from fixdiff_previous().  seq
+ * identifies the stanza by its ' ' and '-' lines, fh is the first of those.
+ */
+
+typedef struct {
+	uint64_t		seq;
+	uint32_t		fh;
+	int			line; /* 0-based source line */
+	const char		*pf;
+} prev_t;
+
+/*
+ * Up to this many lines either side of where a stanza with the same first line
+ * was placed last time are tried first
+ */
+
+#define FIXDIFF_PREV_SHIFT 16
+#define FIXDIFF_PREV_HINTS 64
+
+/*
+ * A line of a streamed source we still have in the window
+ */
+
+typedef struct {
+	size_t			o; /* where it is in the window */
+	size_t			len; /* including the EOL */
+	uint32_t		h;
+} rline_t;
+
+/*
+ * A stanza's part in a pass over a streamed source, see fixdiff_stream_scan()
+ */
+
+typedef enum {
+	SS_FIRST, /* the first match */
+	SS_BEST, /* the one nearest the seeds in pr */
+	SS_HITS, /* just note every match in hit */
+	SS_AT, /* the match at line at */
+} ssmode_t;
+
+typedef struct {
+	srcfile_t		win; /* the placement's lines, and three after */
+	size_t			win_alloc;
+	int			win_lo_alloc;
+	const stanza_t		*st; /* only for the pass */
+	int			*cl; /* the stanza lines we compare */
+	int			cl_alloc;
+	int			*hit; /* with SS_HITS, where it matches */
+	int			hits;
+	int			hit_alloc;
+	uint64_t		hs; /* rolling hash of the cl lines */
+	int64_t			br; /* SS_BEST's rank for the placement */
+	probe_t			pr;
+	int			m; /* how many cl lines */
+	int			at;
+	int			base; /* where the placement starts, or -1 */
+	int			cap; /* lines after it still to copy into win */
+	int			maxseed;
+	ssmode_t		mode;
+	char			done;
+	char			err; /* the pass failed */
+	char			big; /* its lines need more than --max-mem */
+} sscan_t;
+
+/*
+ * With FIXDIFF_FLAG_PIPELINE, the parser thread hands each stanza to the
+ * matcher threads, and then to the emitter, in one of these.  They are in a
+ * ring, so however big the patch is, memory stays flat.  The buffers are
+ * exchanged with the dp working on the stanza rather than copied, so both
+ * sides keep their allocations.  Stanzas held for a pass over a streamed
+ * source are kept in them too, see fixdiff_hold().
+ */
+
+typedef struct {
+	stanza_t	st;
+	membuf_t	out; /* the patch text before the stanza */
+	membuf_t	diag;
+	membuf_t	line; /* the line that ended the stanza */
+	rewrite_t	*rw;
+	const char	*reason;
+	stats_t		sts; /* what the stanza cost so far */
+	uint64_t	seq;
+	uint32_t	seq_fh;
+	int		rw_lines;
+	int		rw_alloc;
+	int		pre;
+	int		post;
+	int		lead_in;
+	int		lead_in_corrected;
+	int		sfirst;
+	int		stanzas;
+	int		file;
+	int		li;
+	int		orig; /* where the matcher placed it, or 0 */
+	int		ret;
+	char		cx_active;
+	char		last; /* no stanza, just the rest of the patch */
+	char		done; /* ready for the emitter */
+	char		osh[128];
+	char		pf[512];
+	char		blob[2][FIXDIFF_GIT_HEX];
+} prec_t;
+
+/*
+ * With FIXDIFF_FLAG_APPLY, each file the patch changes is built up in memory
+ * from the source and the stanzas, as they are emitted.  Nothing is written
+ * until the whole patch has been fixed.
+ */
+
+typedef struct apply {
+	struct apply		*next;
+	srcfile_t		*sf;
+	membuf_t		mb; /* the file as patched so far */
+	int			line; /* next source line to copy */
+	int			file; /* which file in the patch */
+	char			want[FIXDIFF_GIT_HEX]; /* blob id it should get */
+	char			pf[512];
+	char			path[1024]; /* pf from where the sources are */
+	char			tmp[1024 + 16]; /* written here, until renamed */
+	char			bak[1024 + 24]; /* the original, while replacing */
+	char			replaced;
+} apply_t;
+
+typedef struct {
+	stanza_t	st;
+
+	const char	*reason;
+
+	ws_fix_t	*wsf; /* whitespace fixes for the current candidate */
+	rewrite_t	*rw; /* rewrites for the match, by stanza line */
+	srccache_t	*sc;
+	const opts_t	*o;
+
+	dss_t		d;
+	int		pre;
+	int		post;
+	int		delta;
+	int		lead_in;
+	int		lead_out;
+	int		lead_in_corrected;
+
+	int		stanzas;
+	int		bad;
+	int		failed; /* stanzas a check couldn't place */
+
+	int		sfirst; /* first stanza line after extra lead-in */
+	int		prev_end; /* line after last match in this file, or -1 */
+	int		files; /* +++ lines we have seen */
+
+	int		li_out;
+
+	int		pending_empty_lines;
+
+	int		wsf_count;
+	int		wsf_alloc;
+	int		fuzz_lines; /* how many of the wsf are edits, not ws */
+	int		fuzz_edits;
+	uint64_t	seq; /* the stanza's ' ' and '-' lines, for prev_t */
+	uint32_t	seq_fh;
+	int		rw_lines; /* stanza lines covered by rw */
+	int		rw_alloc;
+
+	char		ongoing;
+	char		skip_this_one;
+	char		lead_in_active;
+	char		cx_active;
+	char		have_seen_delta;
+	char		collect_diag;
+	char		apply; /* build the patched files in ap */
+
+	char		osh[128];
+	char		pf[512];
+	char		idx[2][FIXDIFF_GIT_HEX]; /* blob ids from an index line */
+	char		blob[2][FIXDIFF_GIT_HEX]; /* this file's before and after */
+
+	char		*fz; /* normalised lines for fuzzy compare */
+	size_t		fz_alloc;
+	uint64_t	*fzs; /* zeroed edit distance scratch */
+	size_t		fzs_alloc;
+
+	sscan_t		*ss; /* the stanzas in a pass over a streamed source */
+	int		ss_alloc;
+	sscan_t		*sscan; /* the stanza's, if a shared pass placed it */
+	char		*sbuf; /* the window we stream a source through */
+	size_t		sbuf_alloc;
+	rline_t		*ring; /* the latest lines in it */
+	int		ring_alloc;
+
+	prec_t		*hold; /* stanzas held for a streamed source */
+	int		holds;
+	int		hold_alloc;
+	sink_t		hold_sink; /* where the output goes after them */
+	membuf_t	hold_out; /* the output since the last one */
+	membuf_t	hold_diag; /* a job's diagnostics from before them */
+	char		hold_collect; /* collect_diag before them */
+
+	fixdiff_t	*ctx;
+	struct pipe	*pipe; /* if we are the pipeline's parser */
+	apply_t		*ap; /* files we are applying to, newest first */
+
+	stats_t		sts; /* running totals */
+	stats_t		sts0; /* totals when the stanza started */
+	membuf_t	stats; /* JSON for each stanza */
+	membuf_t	placed; /* where each stanza went */
+
+	lbuf_t		lb;
+	outbuf_t	out;
+	membuf_t	jout; /* a job's output */
+	membuf_t	diag; /* a job's diagnostics */
+} dp_t;
+
+struct fixdiff {
+	fixdiff_info_t	i;
+	opts_t		o;
+	srccache_t	sc;
+	sink_t		out;
+	sink_t		diag;
+	membuf_t	out_mb;
+	membuf_t	diag_mb;
+	membuf_t	stats_mb;
+	membuf_t	placed_mb; /* for fixdiff_placements() */
+	prev_t		*prev; /* from fixdiff_previous() */
+	char		*prev_buf; /* what prev points into */
+	int		prev_count;
+	apply_t		*applied; /* the patched files, in patch order */
+	apply_t		**applied_tail;
+	stats_t		sts; /* totals for the stats of this fix */
+	uint64_t	t0; /* when this fix started */
+	char		stats_any; /* some stanzas in stats_mb already */
+};
+
+/*
+ * A job is the part of the input dealing with one target file
+ */
+
+typedef struct {
+	const char	*in;
+	size_t		len;
+	int		line_base;
+	int		stanza_base;
+	int		ret;
+	dp_t		*pdp;
+	char		idx[2][FIXDIFF_GIT_HEX]; /* index line just before it */
+} job_t;
+
+typedef struct {
+	job_t		*jobs;
+	fixdiff_t	*ctx;
+	lock_t		lock;
+	int		count;
+	int		next;
+} jobq_t;
+
+#if defined(FIXDIFF_WITH_PTHREADS)
+
+#define FIXDIFF_PIPE_DEPTH 64
+
+typedef struct pipe {
+	prec_t		rec[FIXDIFF_PIPE_DEPTH];
+	fixdiff_t	*ctx;
+	stats_t		sts; /* the matchers' totals */
+	pthread_mutex_t	lock;
+	pthread_cond_t	cond;
+	unsigned int	parsed; /* records the parser has put */
+	unsigned int	matching; /* next record for a matcher */
+	unsigned int	emitted; /* next record for the emitter */
+	char		parse_done;
+	char		abort;
+} pipe_t;
+
+#endif
+
+static int
+fixdiff_membuf_add(membuf_t *mb, const void *buf, size_t len)
+{
+	if (mb->mem_len + len > mb->mem_alloc) {
+		size_t na = mb->mem_alloc ? mb->mem_alloc * 2 : 16384;
+		char *m1;
+
+		while (na < mb->mem_len + len)
+			na *= 2;
+		m1 = realloc(mb->mem, na);
+		if (!m1)
+			return 1;
+		mb->mem = m1;
+		mb->mem_alloc = na;
+	}
+
+	memcpy(mb->mem + mb->mem_len, buf, len);
+	mb->mem_len += len;
+
+	return 0;
+}
+
+static int
+fixdiff_write_all(int fd, const char *buf, size_t len)
+{
+	while (len) {
+		ssize_t w = write(fd, buf, TO_POSLEN(len));
+
+		if (w < 0) {
+			if (errno == EINTR)
+				continue;
+			return 1;
+		}
+		buf += w;
+		len -= (size_t)w;
+	}
+
+	return 0;
+}
+
+static int
+fixdiff_sink_write(const sink_t *s, const char *buf, size_t len)
+{
+	if (s->fd >= 0)
+		return fixdiff_write_all(s->fd, buf, len);
+
+	if (s->cb)
+		return s->cb(s->opaque, buf, len);
+
+	return fixdiff_membuf_add(s->mb, buf, len);
+}
+
+/*
+ * Diagnostics go to the context's diag sink, unless we are a job whose
+ * diagnostics are collected to be issued in order later
+ */
+
+static void
+fixdiff_log(fixdiff_t *ctx, dp_t *pdp, int result, const char *fmt, ...)
+{
+	char buf[1024];
+	va_list ap;
+	int n;
+
+	if (ctx->o.check && !result)
+		return;
+
+	va_start(ap, fmt);
+	n = vsnprintf(buf, sizeof(buf), fmt, ap);
+	va_end(ap);
+
+	if (n > (int)sizeof(buf) - 1)
+		n = (int)sizeof(buf) - 1;
+	if (n <= 0)
+		return;
+
+	if (pdp && pdp->collect_diag)
+		fixdiff_membuf_add(&pdp->diag, buf, (size_t)n);
+	else
+		fixdiff_sink_write(&ctx->diag, buf, (size_t)n);
+}
+
+static void
+fixdiff_mbprintf(membuf_t *mb, const char *fmt, ...)
+{
+	char buf[1024];
+	va_list ap;
+	int n;
+
+	va_start(ap, fmt);
+	n = vsnprintf(buf, sizeof(buf), fmt, ap);
+	va_end(ap);
+
+	if (n > (int)sizeof(buf) - 1)
+		n = (int)sizeof(buf) - 1;
+	if (n > 0)
+		fixdiff_membuf_add(mb, buf, (size_t)n);
+}
+
+static uint64_t
+fixdiff_now_ns(void)
+{
+#if defined(WIN32)
+	LARGE_INTEGER c, f;
+
+	QueryPerformanceCounter(&c);
+	QueryPerformanceFrequency(&f);
+
+	return (uint64_t)((double)c.QuadPart * 1e9 / (double)f.QuadPart);
+#else
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (uint64_t)ts.tv_sec * 1000000000u + (uint64_t)ts.tv_nsec;
+#endif
+}
+
+static unsigned long
+fixdiff_peak_rss_kb(void)
+{
+#if defined(WIN32)
+	PROCESS_MEMORY_COUNTERS pmc;
+
+	if (!GetProcessMemoryInfo(GetCurrentProcess(), &pmc, sizeof(pmc)))
+		return 0;
+
+	return (unsigned long)(pmc.PeakWorkingSetSize / 1024);
+#else
+	struct rusage ru;
+
+	if (getrusage(RUSAGE_SELF, &ru))
+		return 0;
+#if defined(__APPLE__)
+	return (unsigned long)ru.ru_maxrss / 1024; /* bytes there */
+#else
+	return (unsigned long)ru.ru_maxrss;
+#endif
+#endif
+}
+
+/*
+ * Our running totals, including the syscalls the line reader and output
+ * batch count for themselves
+ */
+
+static void
+fixdiff_stats_now(const dp_t *pdp, stats_t *st)
+{
+	*st = pdp->sts;
+	st->syscalls += pdp->lb.nsys + pdp->out.nsys;
+}
+
+/*
+ * Add s as a JSON string, escaped
+ */
+
+static void
+fixdiff_json_str(membuf_t *mb, const char *s)
+{
+	fixdiff_membuf_add(mb, "\"", 1);
+
+	while (*s) {
+		size_t n = 0;
+
+		while (s[n] && s[n] != '"' && s[n] != '\\' &&
+		       (unsigned char)s[n] >= 0x20)
+			n++;
+		fixdiff_membuf_add(mb, s, n);
+		s += n;
+
+		if (*s) {
+			if (*s == '"' || *s == '\\')
+				fixdiff_mbprintf(mb, "\\%c", *s);
+			else
+				fixdiff_mbprintf(mb, "\\u%04x",
+						 (unsigned char)*s);
+			s++;
+		}
+	}
+
+	fixdiff_membuf_add(mb, "\"", 1);
+}
+
+static void
+fixdiff_json_counts(membuf_t *mb, const stats_t *st)
+{
+	fixdiff_mbprintf(mb, "\"candidates\": %llu, \"compared\": %llu, "
+			 "\"ws_fuzz\": %llu, \"bytes\": %llu, "
+			 "\"syscalls\": %llu, \"search_us\": %llu, "
+			 "\"emit_us\": %llu",
+			 (unsigned long long)st->candidates,
+			 (unsigned long long)st->compared,
+			 (unsigned long long)st->ws_fuzz,
+			 (unsigned long long)st->bytes,
+			 (unsigned long long)st->syscalls,
+			 (unsigned long long)(st->search_ns / 1000),
+			 (unsigned long long)(st->emit_ns / 1000));
+}
+
+static void
+fixdiff_stats_sub(stats_t *t, const stats_t *st)
+{
+	t->candidates -= st->candidates;
+	t->compared -= st->compared;
+	t->ws_fuzz -= st->ws_fuzz;
+	t->bytes -= st->bytes;
+	t->syscalls -= st->syscalls;
+	t->search_ns -= st->search_ns;
+	t->emit_ns -= st->emit_ns;
+}
+
+/*
+ * Add the JSON for the stanza that just ended, placed at line (1-based), or
+ * 0 if we couldn't place it
+ */
+
+static void
+fixdiff_stats_stanza(dp_t *pdp, int line)
+{
+	stats_t now;
+
+	fixdiff_stats_now(pdp, &now);
+	fixdiff_stats_sub(&now, &pdp->sts0);
+
+	if (pdp->stats.mem_len)
+		fixdiff_membuf_add(&pdp->stats, ",\n", 2);
+	fixdiff_mbprintf(&pdp->stats, "  { \"stanza\": %d, \"file\": ",
+			 pdp->stanzas);
+	fixdiff_json_str(&pdp->stats, pdp->pf);
+	fixdiff_mbprintf(&pdp->stats, ", \"placed\": %d, ", line);
+	fixdiff_json_counts(&pdp->stats, &now);
+	fixdiff_membuf_add(&pdp->stats, " }", 2);
+}
+
+static void
+fixdiff_stats_add(stats_t *t, const stats_t *st)
+{
+	t->candidates += st->candidates;
+	t->compared += st->compared;
+	t->ws_fuzz += st->ws_fuzz;
+	t->bytes += st->bytes;
+	t->syscalls += st->syscalls;
+	t->search_ns += st->search_ns;
+	t->emit_ns += st->emit_ns;
+}
+
+/*
+ * The stats JSON for a fix is the stanzas from each dp in order, then the
+ * totals
+ */
+
+static void
+fixdiff_stats_begin(fixdiff_t *ctx)
+{
+	ctx->stats_mb.mem_len = 0;
+	ctx->stats_any = 0;
+	memset(&ctx->sts, 0, sizeof(ctx->sts));
+	ctx->t0 = fixdiff_now_ns();
+
+	fixdiff_mbprintf(&ctx->stats_mb, "{\n \"stanzas\": [\n");
+}
+
+static void
+fixdiff_stats_dp(fixdiff_t *ctx, const dp_t *pdp)
+{
+	stats_t st;
+
+	if (pdp->stats.mem_len) {
+		if (ctx->stats_any)
+			fixdiff_membuf_add(&ctx->stats_mb, ",\n", 2);
+		fixdiff_membuf_add(&ctx->stats_mb, pdp->stats.mem,
+				   pdp->stats.mem_len);
+		ctx->stats_any = 1;
+	}
+
+	fixdiff_stats_now(pdp, &st);
+	fixdiff_stats_add(&ctx->sts, &st);
+}
+
+static void
+fixdiff_stats_end(fixdiff_t *ctx, const fixdiff_result_t *res)
+{
+	fixdiff_mbprintf(&ctx->stats_mb, "\n ],\n \"totals\": { "
+			 "\"ret\": %d, \"stanzas\": %d, \"repaired\": %d, ",
+			 res->ret, res->stanzas, res->repaired);
+	fixdiff_json_counts(&ctx->stats_mb, &ctx->sts);
+	fixdiff_mbprintf(&ctx->stats_mb, ", \"wall_us\": %llu, "
+			 "\"peak_rss_kb\": %lu }\n}\n",
+			 (unsigned long long)
+				((fixdiff_now_ns() - ctx->t0) / 1000),
+			 fixdiff_peak_rss_kb());
+}
+
+static void
+init_lbuf(lbuf_t *plb, const char *name)
+{
+	plb->name = name;
+	plb->tail = NULL;
+	plb->tail_alloc = 0;
+	plb->buf = NULL;
+	plb->alloc = 0;
+	plb->p = NULL;
+	plb->len = 0;
+	plb->pos = 0;
+	plb->scanned = 0;
+	plb->map = NULL;
+	plb->map_len = 0;
+	plb->ro = 0;
+	plb->bls = 0;
+	plb->fd = -1;
+	plb->li = 0;
+	plb->err = 0;
+	plb->nsys = 0;
+	plb->eof = 0;
+}
+
+/*
+ * Read lines from memory that stays valid while we are using the lbuf
+ */
+
+static void
+fixdiff_lbuf_mem(lbuf_t *plb, const char *mem, size_t len)
+{
+	plb->p = mem;
+	plb->len = len;
+	plb->pos = 0;
+	plb->eof = 1;
+}
+
+/*
+ * Read lines from fd... if it's a regular file we just map the rest of it,
+ * otherwise we will read() it as we go
+ */
+
+static void
+fixdiff_lbuf_fd(lbuf_t *plb, int fd)
+{
+#if !defined(WIN32)
+	struct stat s;
+	off_t o;
+
+	plb->nsys++;
+	if (!fstat(fd, &s) && S_ISREG(s.st_mode) && s.st_size > 0 &&
+	    (o = lseek(fd, 0, SEEK_CUR)) >= 0 && o < s.st_size) {
+		void *m = mmap(NULL, (size_t)s.st_size, PROT_READ, MAP_PRIVATE,
+			       fd, 0);
+
+		plb->nsys += 2;
+
+		if (m != MAP_FAILED) {
+			plb->map = m;
+			plb->map_len = (size_t)s.st_size;
+			fixdiff_lbuf_mem(plb, plb->map, plb->map_len);
+			plb->pos = (size_t)o;
+
+			return;
+		}
+	}
+#endif
+
+	plb->fd = fd;
+}
+
+static void
+fixdiff_lbuf_destroy(lbuf_t *plb)
+{
+#if !defined(WIN32)
+	if (plb->map)
+		munmap((void *)plb->map, plb->map_len);
+#endif
+	free(plb->buf);
+	free(plb->tail);
+	plb->map = NULL;
+	plb->buf = NULL;
+	plb->tail = NULL;
+	plb->tail_alloc = 0;
+}
+
+#if 0
+
+static void
+hexdump(void *start, size_t len)
+{
+	static const char *hexchar = "0123456789abcdef";
+	int n = 0, a = 0, used = 0, us = 0;
+	uint8_t *p = (uint8_t *)start;
+	char str[50], asc[17];
+
+	memset(str, ' ', 48);
+	memset(asc, ' ', 16);
+	str[48] = '\0';
+	asc[16] = '\0';
+
+	while (len) {
+		len--;
+		if (a == 16) {
+			elog(pdp, "%04X: %s  %s\n", us, str, asc);
+			memset(str, ' ', 48);
+			memset(asc, ' ', 16);
+			a = 0;
+			us = used;
+		}
+
+		str[a * 3] = hexchar[(*p) >> 4];
+		str[(a * 3) + 1] = hexchar[(*p) & 15];
+
+		if (*p < 32)
+			asc[a] = '.';
+		else
+			asc[a] = (char)*p;
+
+		a++;
+		p++;
+		used++;
+	}
+	if (a)
+		elog(pdp, "%04X: %s  %s\n", us, str, asc);
+}
+
+#endif
+
+/*
+ * It's strcmp, but it is smart about matching a mixure of line endings
+ */
+
+typedef enum {
+	LE_ZERO,
+	LE_0A,
+	LE_0D0A
+} line_ending_t;
+
+static line_ending_t
+fixdiff_assess_eol(const char *a, size_t alen)
+{
+	if (alen >= 2 && a[alen - 2] == 0x0d && a[alen - 1] == 0x0a)
+		return LE_0D0A;
+
+	if (alen >= 1 && a[alen - 1] == 0x0a)
+		return LE_0A;
+
+	return LE_ZERO;
+}
+
+static int
+fixdiff_strcmp(const char *a, size_t alen, line_ending_t *lea, const char *b,
+	       size_t blen, line_ending_t *leb)
+{
+	*lea = fixdiff_assess_eol(a, alen);
+	*leb = fixdiff_assess_eol(b, blen);
+
+	if (alen - *lea != blen - *leb)
+		/* accounting for EOL type, size mismatch */
+		return 1;
+
+	if ((*lea == LE_ZERO && *leb != LE_ZERO) ||
+	    (*lea != LE_ZERO && *leb == LE_ZERO))
+		/* one (not both) thought we ended without any CR or CRLF */
+		return 1;
+
+	if (alen - *lea == 0)
+		/* both agree there is only some kind of CR / CRLF */
+		return 0;
+
+	return fixdiff_mismatch(a, b, alen - *lea) != alen - *lea;
+}
+
+/*
+ * Hash a line the same way the whitespace-fuzz compare in
+ * fixdiff_find_original() considers lines equal: the EOL and any trailing
+ * whitespace are ignored, and each run of spaces or tabs counts as a single
+ * whitespace token.  Lines that compare equal always have the same hash.
+ */
+
+static uint32_t
+fixdiff_hash_line(const char *p, size_t len)
+{
+	const char *end = p + len - (size_t)fixdiff_assess_eol(p, len);
+	uint32_t h = 2166136261u; /* FNV-1a */
+	char ws = 0;
+
+	while (end > p && (end[-1] == ' ' || end[-1] == '\t'))
+		end--;
+
+	while (p < end) {
+		if (*p == ' ' || *p == '\t') {
+			ws = 1;
+			p++;
+			continue;
+		}
+
+		if (ws) {
+			h = (h ^ (uint8_t)' ') * 16777619u;
+			ws = 0;
+		}
+
+		h = (h ^ (uint8_t)*p++) * 16777619u;
+	}
+
+	return h;
+}
+
+/*
+ * Move the partial line at the end of the read() window down to the start,
+ * and read more after it
+ */
+
+static void
+fixdiff_lbuf_fill(lbuf_t *plb)
+{
+	ssize_t r;
+
+	if (plb->pos) {
+		memmove(plb->buf, plb->buf + plb->pos, plb->len - plb->pos);
+		plb->ro += (off_t)plb->pos;
+		plb->len -= plb->pos;
+		plb->pos = 0;
+	}
+
+	if (plb->len == plb->alloc) {
+		size_t a = plb->alloc ? plb->alloc * 2 : 65536;
+		char *b1 = realloc(plb->buf, a);
+
+		if (!b1) {
+			plb->err = ENOMEM;
+			plb->eof = 1;
+			return;
+		}
+		plb->buf = b1;
+		plb->alloc = a;
+	}
+
+	plb->p = plb->buf;
+
+	do {
+		r = read(plb->fd, plb->buf + plb->len,
+			 TO_POSLEN(plb->alloc - plb->len));
+		plb->nsys++;
+	} while (r < 0 && errno == EINTR);
+
+	if (r <= 0) {
+		if (r < 0)
+			plb->err = errno;
+		plb->eof = 1;
+		return;
+	}
+
+	plb->len += (size_t)r;
+}
+
+/*
+ * Returns a view of the next line including its EOL, with its length in *len,
+ * or *len = 0 at the end of the input.  The view is valid until the next call.
+ *
+ * A last line with no EOL is given one.
+ */
+
+static const char *
+fixdiff_get_line(lbuf_t *plb, size_t *len)
+{
+	const char *p, *nl;
+	size_t avail;
+
+	while (1) {
+		p = plb->p + plb->pos;
+		avail = plb->len - plb->pos;
+
+		/* a long line arrives over many reads, only scan what's new */
+
+		nl = fixdiff_scan_nl(p + plb->scanned, avail - plb->scanned);
+		if (nl || plb->eof)
+			break;
+
+		plb->scanned = avail;
+		fixdiff_lbuf_fill(plb);
+	}
+
+	plb->scanned = 0;
+	plb->bls = plb->ro + (off_t)plb->pos;
+	plb->li++;
+
+	if (!nl) {
+		*len = avail;
+		if (!avail)
+			return "";
+		plb->pos += avail;
+
+		if (avail + 1 > plb->tail_alloc) {
+			char *t = realloc(plb->tail, avail + 1);
+
+			if (!t) {
+				/* it'll have to do without */
+				plb->err = ENOMEM;
+				return p;
+			}
+			plb->tail = t;
+			plb->tail_alloc = avail + 1;
+		}
+
+		memcpy(plb->tail, p, avail);
+		plb->tail[(*len)++] = '\n';
+
+		return plb->tail;
+	}
+
+	*len = (size_t)(nl - p) + 1;
+	plb->pos += *len;
+
+	return p;
+}
+
+/*
+ * Reserve space for a new line at the end of the stanza arena, the caller
+ * fills it in
+ */
+
+static char *
+fixdiff_stanza_add(stanza_t *st, size_t len)
+{
+	if (st->count == st->alloc_lines) {
+		int na = st->alloc_lines ? st->alloc_lines * 2 : 64;
+		sline_t *sl1 = realloc(st->sl, (size_t)na * sizeof(*sl1));
+
+		if (!sl1)
+			return NULL;
+		st->sl = sl1;
+		st->alloc_lines = na;
+	}
+
+	if (st->len + len > st->alloc) {
+		size_t na = st->alloc ? st->alloc * 2 : 16384;
+		char *b1;
+
+		while (na < st->len + len)
+			na *= 2;
+		b1 = realloc(st->buf, na);
+		if (!b1)
+			return NULL;
+		st->buf = b1;
+		st->alloc = na;
+	}
+
+	st->sl[st->count].ofs = st->len;
+	st->sl[st->count++].len = len;
+	st->len += len;
+
+	return st->buf + st->len - len;
+}
+
+static const char *
+fixdiff_stanza_line(const stanza_t *st, int n, size_t *len)
+{
+	*len = st->sl[n].len;
+
+	return st->buf + st->sl[n].ofs;
+}
+
+static int
+fixdiff_out_flush(outbuf_t *ob)
+{
+	struct iovec *iov = ob->iov;
+	int n = ob->niov;
+
+	while (n && ob->sink.fd < 0) {
+		if (fixdiff_sink_write(&ob->sink, iov->iov_base, iov->iov_len)) {
+			ob->niov = 0;
+			ob->stage_len = 0;
+
+			return 1;
+		}
+		iov++;
+		n--;
+	}
+
+	while (n) {
+		ssize_t w;
+
+#if defined(WIN32)
+		w = write(ob->sink.fd, iov->iov_base, TO_POSLEN(iov->iov_len));
+#else
+		w = writev(ob->sink.fd, iov, n);
+#endif
+		ob->nsys++;
+		if (w < 0) {
+			if (errno == EINTR)
+				continue;
+			/* the batch is lost, don't leave it pointing anywhere */
+			ob->niov = 0;
+			ob->stage_len = 0;
+
+			return 1;
+		}
+
+		/* deal with partial writes */
+
+		while (n && (size_t)w >= iov->iov_len) {
+			w -= (ssize_t)iov->iov_len;
+			iov++;
+			n--;
+		}
+		if (n) {
+			iov->iov_base = (char *)iov->iov_base + w;
+			iov->iov_len -= (size_t)w;
+		}
+	}
+
+	ob->niov = 0;
+	ob->stage_len = 0;
+
+	return 0;
+}
+
+/*
+ * Add buf to the batch by reference, it must stay valid until the next flush
+ */
+
+static int
+fixdiff_out_ref(outbuf_t *ob, const void *buf, size_t len)
+{
+	if (ob->niov == FIXDIFF_IOV && fixdiff_out_flush(ob))
+		return 1;
+
+	ob->iov[ob->niov].iov_base = (void *)buf;
+	ob->iov[ob->niov++].iov_len = len;
+
+	return 0;
+}
+
+/*
+ * Add buf to the batch by copying it into the staging buffer, extending the
+ * last iovec if it already ends at the end of the staged data
+ */
+
+static int
+fixdiff_out_copy(outbuf_t *ob, const void *buf, size_t len)
+{
+	struct iovec *iov = ob->niov ? &ob->iov[ob->niov - 1] : NULL;
+
+	if (len > sizeof(ob->stage) - ob->stage_len) {
+		if (fixdiff_out_flush(ob))
+			return 1;
+		iov = NULL;
+
+		if (len > sizeof(ob->stage)) {
+			/* too big to stage, send it by itself */
+			if (fixdiff_out_ref(ob, buf, len))
+				return 1;
+
+			return fixdiff_out_flush(ob);
+		}
+	}
+
+	/*
+	 * If the batch is full, flush it now... adding the iovec would flush it
+	 * after we copied, emptying the staging buffer under us
+	 */
+
+	if (ob->niov == FIXDIFF_IOV) {
+		if (fixdiff_out_flush(ob))
+			return 1;
+		iov = NULL;
+	}
+
+	memcpy(ob->stage + ob->stage_len, buf, len);
+
+	if (iov && (char *)iov->iov_base + iov->iov_len ==
+					ob->stage + ob->stage_len)
+		iov->iov_len += len;
+	else
+		if (fixdiff_out_ref(ob, ob->stage + ob->stage_len, len))
+			return 1;
+
+	ob->stage_len += len;
+
+	return 0;
+}
+
+/*
+ * Lines go into the stanza arena while we are in a stanza, otherwise
+ * to stdout
+ */
+
+static int
+fixdiff_out(dp_t *pdp, const char *buf, size_t len)
+{
+	char *p;
+
+	if (!pdp->ongoing)
+		return pdp->o->check ? 0 : fixdiff_out_copy(&pdp->out, buf, len);
+
+	p = fixdiff_stanza_add(&pdp->st, len);
+	if (!p)
+		return 1;
+
+	memcpy(p, buf, len);
+
+	return 0;
+}
+
+static int
+fixdiff_stanza_start(dp_t *pdp, const char *sh, size_t len)
+{
+	pdp->pre			= 0;
+	pdp->post			= 0;
+	pdp->lead_in			= 0;
+	pdp->lead_in_active		= 1;
+	pdp->lead_out			= 0;
+	pdp->cx_active			= 1;
+	pdp->lead_in_corrected		= 0;
+	pdp->sfirst			= 0;
+	pdp->d				= DSS_PMSAD;
+	pdp->ongoing			= 1;
+	pdp->have_seen_delta		= 0;
+	pdp->pending_empty_lines	= 0;
+
+	pdp->stanzas++;
+	fixdiff_stats_now(pdp, &pdp->sts0);
+
+	pdp->st.len			= 0;
+	pdp->st.count			= 0;
+
+	if (len > sizeof(pdp->osh) - 1)
+		len = sizeof(pdp->osh) - 1;
+
+	memcpy(pdp->osh, sh, len);
+
+	pdp->osh[len] = '\0';
+	pdp->osh[sizeof(pdp->osh) - 1] = '\0';
+
+	/*
+	 * While in the stanza, we will collect stdin in the stanza arena.
+	 *
+	 * At the end of the stanza, we will issue a corrected header and then
+	 * dump the arena into stdout.  This way, we handle stdin in a single
+	 * pass and don't care if the length of the header string was changed
+	 * from the original.
+	 */
+
+	pdp->skip_this_one = 1;
+
+	return 0;
+}
+
+static void
+stain_copy(char *dest, const char *in, size_t inlen, size_t len)
+{
+	char *p = dest;
+
+	if (inlen > len - 1)
+		inlen = len - 1;
+
+	memcpy(dest, in, inlen);
+	dest[inlen] = '\0';
+	do {
+		p = strchr(p, '\t');
+		if (!p)
+			break;
+		*p = '>';
+		p++;
+	} while (1);
+}
+
+/*
+ * Build the line start table for a loaded source file in a single pass
+ */
+
+static int
+fixdiff_srcfile_index(srcfile_t *sf)
+{
+	size_t alloc = 256, pos = 0;
+	const char *p;
+
+	sf->lo = malloc(alloc * sizeof(*sf->lo));
+	if (!sf->lo)
+		return 1;
+
+	sf->lines = 0;
+	while (pos < sf->len) {
+		if ((size_t)sf->lines + 2 > alloc) {
+			size_t *lo1;
+
+			alloc *= 2;
+			lo1 = realloc(sf->lo, alloc * sizeof(*sf->lo));
+			if (!lo1)
+				return 1;
+			sf->lo = lo1;
+		}
+
+		sf->lo[sf->lines++] = pos;
+		p = fixdiff_scan_nl(sf->buf + pos, sf->len - pos);
+		pos = p ? (size_t)(p - sf->buf) + 1 : sf->len;
+	}
+
+	sf->lo[sf->lines] = sf->len;
+
+	return 0;
+}
+
+/*
+ * Build the hashed line index for a source file, chaining lines in each
+ * bucket in ascending order
+ */
+
+static int
+fixdiff_srcfile_hash(srcfile_t *sf)
+{
+	uint32_t nb = 16;
+	int n;
+
+	while (nb < (uint32_t)sf->lines * 2)
+		nb <<= 1;
+
+	sf->lh = malloc(((size_t)sf->lines + 1) * sizeof(*sf->lh));
+	sf->hn = malloc(((size_t)sf->lines + 1) * sizeof(*sf->hn));
+	sf->hc = malloc(((size_t)sf->lines + 1) * sizeof(*sf->hc));
+	sf->hb = malloc(nb * sizeof(*sf->hb));
+	if (!sf->lh || !sf->hn || !sf->hc || !sf->hb) {
+		free(sf->lh);
+		free(sf->hn);
+		free(sf->hc);
+		free(sf->hb);
+		sf->lh = NULL;
+		sf->hn = NULL;
+		sf->hc = NULL;
+		sf->hb = NULL;
+		return 1;
+	}
+
+	sf->hmask = nb - 1;
+	memset(sf->hb, 0xff, nb * sizeof(*sf->hb));
+
+	for (n = sf->lines - 1; n >= 0; n--) {
+		uint32_t b;
+		int m;
+
+		sf->lh[n] = fixdiff_hash_line(sf->buf + sf->lo[n],
+					      sf->lo[n + 1] - sf->lo[n]);
+		b = sf->lh[n] & sf->hmask;
+
+		/*
+		 * Any later line with the same hash is already in the bucket,
+		 * so we can count them as we go, and nobody has to walk the
+		 * chain of a common line to find out how common it is
+		 */
+
+		m = sf->hb[b];
+		while (m >= 0 && sf->lh[m] != sf->lh[n])
+			m = sf->hn[m];
+		sf->hc[n] = m >= 0 ? sf->hc[m] + 1 : 1;
+
+		sf->hn[n] = sf->hb[b];
+		sf->hb[b] = n;
+	}
+
+	return 0;
+}
+
+/*
+ * Return the first line with hash h, or -1
+ */
+
+static int
+fixdiff_srcfile_lookup(const srcfile_t *sf, uint32_t h)
+{
+	int n = sf->hb[h & sf->hmask];
+
+	while (n >= 0 && sf->lh[n] != h)
+		n = sf->hn[n];
+
+	return n;
+}
+
+/*
+ * Return the next line after line n with the same hash, or -1.  The chain is
+ * ascending, so we carry on from n rather than walk it again from the start,
+ * which on a big file full of blank lines or closing braces is quadratic.
+ */
+
+static int
+fixdiff_srcfile_next(const srcfile_t *sf, int n)
+{
+	uint32_t h = sf->lh[n];
+
+	do
+		n = sf->hn[n];
+	while (n >= 0 && sf->lh[n] != h);
+
+	return n;
+}
+
+/*
+ * How many lines have hash h
+ */
+
+static int
+fixdiff_srcfile_count(const srcfile_t *sf, uint32_t h)
+{
+	int n = fixdiff_srcfile_lookup(sf, h);
+
+	return n < 0 ? 0 : sf->hc[n];
+}
+
+/*
+ * With --nearest, the lines a search works outwards from: where the @@ header
+ * says the stanza is, and where the last stanza in this file ended
+ */
+
+static void
+fixdiff_probe_seeds(probe_t *pr, const srcfile_t *sf, const char *osh,
+		    int sfirst, int prev_end)
+{
+	const char *p = osh + 4;
+	char *e;
+	long hl = strtol(p, &e, 10);
+
+	memset(pr, 0, sizeof(*pr));
+
+	/* the header line counts any extra lead-in we have removed */
+
+	if (!strncmp(osh, "@@ -", 4) && e != p && hl > 0 &&
+	    (sf->stream || hl - 1 + sfirst < sf->lines))
+		pr->seed[pr->nseed++] = (int)hl - 1 + sfirst;
+	if (prev_end >= 0 && (sf->stream || prev_end < sf->lines) &&
+	    (!pr->nseed || pr->seed[0] != prev_end))
+		pr->seed[pr->nseed++] = prev_end;
+	if (!pr->nseed)
+		pr->nseed = 1; /* start of file */
+}
+
+/*
+ * Return the next line in nearest-first order from the probe seeds that has
+ * hash h, or -1 when we have gone past both ends of the file from every seed
+ */
+
+static int
+fixdiff_probe_next(probe_t *pr, const srcfile_t *sf, uint32_t h)
+{
+	while (1) {
+		int s, k, x, dup = 0;
+
+		if (pr->step == pr->nseed * 2) {
+			pr->step = 0;
+			pr->d++;
+		}
+
+		if (!pr->step) {
+			for (k = 0; k < pr->nseed; k++)
+				if (pr->seed[k] - pr->d >= 0 ||
+				    pr->seed[k] + pr->d < sf->lines)
+					break;
+			if (k == pr->nseed)
+				return -1;
+		}
+
+		s = pr->step >> 1;
+		x = pr->seed[s] + ((pr->step++ & 1) ? -pr->d : pr->d);
+
+		if ((pr->step & 1) == 0 && !pr->d)
+			continue; /* no "before" at distance 0 */
+
+		/* skip lines a different seed already got to first */
+
+		for (k = 0; k < pr->nseed; k++)
+			if (k != s && (abs(x - pr->seed[k]) < pr->d ||
+				       (abs(x - pr->seed[k]) == pr->d && k < s)))
+				dup = 1;
+
+		if (!dup && x >= 0 && x < sf->lines && sf->lh[x] == h)
+			return x;
+	}
+}
+
+/*
+ * Drop the loaded contents of a source file, leaving it ready to load again
+ */
+
+static void
+fixdiff_srcfile_unload(srcfile_t *sf)
+{
+#if !defined(WIN32)
+	if (sf->mapped)
+		munmap(sf->buf, sf->len);
+	else
+#endif
+		free(sf->buf);
+	free(sf->lo);
+	free(sf->lh);
+	free(sf->hb);
+	free(sf->hn);
+	free(sf->hc);
+
+	sf->buf = NULL;
+	sf->lo = NULL;
+	sf->lh = NULL;
+	sf->hb = NULL;
+	sf->hn = NULL;
+	sf->hc = NULL;
+	sf->len = 0;
+	sf->lines = 0;
+	sf->mapped = 0;
+	sf->loaded = 0;
+	sf->stream = 0;
+	sf->hashed = 0;
+}
+
+static void
+fixdiff_srcfile_path(const srcfile_t *sf, char *path, size_t len)
+{
+	if (sf->root)
+		snprintf(path, len, "%s/%s", sf->root, sf->name);
+	else
+		snprintf(path, len, "%s", sf->name);
+}
+
+static void
+fixdiff_srcfiles_destroy(srccache_t *sc)
+{
+	srcfile_t *sf = sc->head, *sf1;
+
+	while (sf) {
+		sf1 = sf->next;
+		fixdiff_srcfile_unload(sf);
+		LOCK_DESTROY(&sf->lock);
+		free(sf);
+		sf = sf1;
+	}
+
+	sc->head = NULL;
+}
+
+/*
+ * When we keep the sources between fixes, before each fix we drop any that
+ * changed on disk, or that we couldn't load last time.  With inotify we were
+ * told which changed, otherwise we have to stat them.
+ */
+
+static void
+fixdiff_srcfiles_validate(srccache_t *sc)
+{
+	srcfile_t **psf = &sc->head, *sf;
+	char path[1024];
+
+	/* blobs never change, but what the revision means might have */
+
+	for (sf = sc->head; sf; sf = sf->next)
+		if (sf->git && sc->repinned && strchr(sf->name, ':'))
+			sf->stale = 1;
+	sc->repinned = 0;
+
+#if defined(__linux__)
+	if (sc->ifd >= 0) {
+		union {
+			struct inotify_event	ev;
+			char			buf[4096];
+		} u;
+		ssize_t r;
+
+		while ((r = read(sc->ifd, u.buf, sizeof(u.buf))) > 0) {
+			const char *p = u.buf;
+
+			while (p < u.buf + r) {
+				const struct inotify_event *ev =
+					(const struct inotify_event *)p;
+
+				for (sf = sc->head; sf; sf = sf->next)
+					if (ev->mask & IN_Q_OVERFLOW ||
+					    sf->wd == ev->wd)
+						sf->stale = 1;
+
+				p += sizeof(*ev) + ev->len;
+			}
+		}
+	} else
+#endif
+	for (sf = sc->head; sf; sf = sf->next) {
+		struct stat s;
+
+		if (sf->git)
+			continue;
+
+		fixdiff_srcfile_path(sf, path, sizeof(path));
+		if (sf->loaded && (stat(path, &s) || s.st_mtime != sf->mtime ||
+		    s.st_size != sf->size || s.st_ino != sf->ino))
+			sf->stale = 1;
+	}
+
+	while (*psf) {
+		sf = *psf;
+
+		if (sf->loaded && !sf->stale) {
+			psf = &sf->next;
+			continue;
+		}
+
+		*psf = sf->next;
+
+#if defined(__linux__)
+		if (sf->wd >= 0) {
+			srcfile_t *sf1;
+
+			/* several names may be the same file */
+
+			for (sf1 = sc->head; sf1; sf1 = sf1->next)
+				if (sf1->wd == sf->wd)
+					break;
+			if (!sf1)
+				inotify_rm_watch(sc->ifd, sf->wd);
+		}
+#endif
+
+		fixdiff_srcfile_unload(sf);
+		LOCK_DESTROY(&sf->lock);
+		free(sf);
+	}
+}
+
+/*
+ * Fetch the source from git instead, it's already in the heap
+ */
+
+static int
+fixdiff_srcfile_git(srcfile_t *sf, srccache_t *sc, stats_t *st)
+{
+	int e;
+
+	LOCK(&sc->git_lock);
+	e = sc->git ? fixdiff_git_blob(sc->git, sf->name, &sf->buf, &sf->len) :
+		      EIO;
+	UNLOCK(&sc->git_lock);
+
+	if (e) {
+		sf->err = e;
+		return 1;
+	}
+
+	if (sf->len && sf->buf[sf->len - 1] != '\n')
+		sf->buf[sf->len++] = '\n';
+	st->bytes += sf->len;
+
+	if (fixdiff_srcfile_index(sf) || fixdiff_srcfile_hash(sf)) {
+		sf->err = ENOMEM;
+		fixdiff_srcfile_unload(sf);
+		return 1;
+	}
+
+	sf->loaded = 1;
+
+	return 0;
+}
+
+/*
+ * With a git revision, make sure git is running, and find which commit the
+ * revision means for this fix.  If that moved since we last looked, kept
+ * sources from the old commit are stale.
+ */
+
+static int
+fixdiff_git_pin(fixdiff_t *ctx)
+{
+	srccache_t *sc = &ctx->sc;
+	char commit[FIXDIFF_GIT_HEX];
+	int r;
+
+	if (sc->git && fixdiff_git_dead(sc->git))
+		fixdiff_git_destroy(&sc->git);
+
+	if (!sc->git) {
+		sc->git = fixdiff_git_create(sc->root);
+		if (!sc->git) {
+			ctxlog(ctx, "Unable to start git: %d\n", errno);
+			return 1;
+		}
+	}
+
+	LOCK(&sc->git_lock);
+	r = fixdiff_git_commit(sc->git, sc->git_rev, commit, sizeof(commit));
+	UNLOCK(&sc->git_lock);
+
+	if (r) {
+		ctxlog(ctx, "Unable to find git revision %s\n", sc->git_rev);
+		return 1;
+	}
+
+	if (strcmp(commit, sc->commit)) {
+		strcpy(sc->commit, commit);
+		sc->repinned = 1;
+	}
+
+	return 0;
+}
+
+/*
+ * Load the source file contents and index them.
+ *
+ * If possible, the file is mmap'd.  But like the line reader, we want the last
+ * line to always end with a '\n', if the file doesn't already end like that we
+ * read it into the heap instead, and add one.
+ */
+
+static int
+fixdiff_srcfile_load(srcfile_t *sf, srccache_t *sc, stats_t *st)
+{
+	char path[1024];
+	size_t alloc = 0;
+	struct stat s;
+	off_t fl;
+	int fd;
+
+	if (sf->git)
+		return fixdiff_srcfile_git(sf, sc, st);
+
+	fixdiff_srcfile_path(sf, path, sizeof(path));
+
+	fd = open(path, OFLAGS(O_RDONLY));
+	st->syscalls++;
+	if (fd < 0) {
+		sf->err = errno;
+		return 1;
+	}
+
+	/*
+	 * If we keep it, we want to hear if it changes from now on... we
+	 * also note how it is now in case we can't be told
+	 */
+
+#if defined(__linux__)
+	if (sc->ifd >= 0) {
+		sf->wd = inotify_add_watch(sc->ifd, path, IN_MODIFY | IN_ATTRIB |
+				IN_CLOSE_WRITE | IN_MOVE_SELF | IN_DELETE_SELF);
+		st->syscalls++;
+	}
+#endif
+	st->syscalls += 2; /* fstat and lseek */
+	if (!fstat(fd, &s)) {
+		sf->mtime = s.st_mtime;
+		sf->size = s.st_size;
+		sf->ino = s.st_ino;
+	}
+
+	fl = lseek(fd, 0, SEEK_END);
+
+	/*
+	 * Loading and indexing it would cost more than we are allowed, each
+	 * stanza will stream it instead
+	 */
+
+	if (sc->max_mem && fl > 0 && (uint64_t)fl > sc->max_mem / 2) {
+		close(fd);
+		st->syscalls++;
+		sf->stream = 1;
+		sf->loaded = 1;
+
+		return 0;
+	}
+
+#if !defined(WIN32)
+	if (fl > 0) {
+		char c;
+
+		st->syscalls += 2;
+		if (lseek(fd, fl - 1, SEEK_SET) == fl - 1 &&
+		    read(fd, &c, 1) == 1 && c == '\n') {
+			sf->buf = mmap(NULL, (size_t)fl, PROT_READ, MAP_PRIVATE,
+				       fd, 0);
+			st->syscalls++;
+			if (sf->buf != MAP_FAILED) {
+				sf->len = (size_t)fl;
+				sf->mapped = 1;
+			} else
+				sf->buf = NULL;
+		}
+	}
+#endif
+
+	if (!sf->mapped) {
+		lseek(fd, 0, SEEK_SET);
+		st->syscalls++;
+
+		while (1) {
+			ssize_t r;
+
+			if (sf->len + 1 >= alloc) {
+				char *b1;
+
+				alloc = alloc ? alloc * 2 :
+					(fl > 0 ? (size_t)fl + 2 : 4096);
+				b1 = realloc(sf->buf, alloc);
+				if (!b1)
+					goto bail;
+				sf->buf = b1;
+			}
+
+			r = read(fd, sf->buf + sf->len,
+				 TO_POSLEN(alloc - 1 - sf->len));
+			st->syscalls++;
+			if (r < 0)
+				goto bail;
+			if (!r)
+				break;
+			sf->len += (size_t)r;
+		}
+
+		if (sf->len && sf->buf[sf->len - 1] != '\n')
+			sf->buf[sf->len++] = '\n';
+	}
+
+	close(fd);
+	st->syscalls++;
+	st->bytes += sf->len;
+
+	if (fixdiff_srcfile_index(sf) || fixdiff_srcfile_hash(sf)) {
+		sf->err = ENOMEM;
+		fixdiff_srcfile_unload(sf);
+		return 1;
+	}
+
+	sf->loaded = 1;
+
+	return 0;
+
+bail:
+	sf->err = errno;
+	close(fd);
+	fixdiff_srcfile_unload(sf);
+
+	return 1;
+}
+
+/*
+ * Find the source file in the cache, or load it into the cache.  Jobs on
+ * other threads may be looking for the same or different files, the cache
+ * lock only covers the list, each file has its own lock covering its loading.
+ * If we load it, what it cost is added to st.
+ */
+
+static srcfile_t *
+fixdiff_srcfile_get(srccache_t *sc, const char *name, stats_t *st)
+{
+	srcfile_t *sf;
+
+	LOCK(&sc->lock);
+
+	for (sf = sc->head; sf; sf = sf->next)
+		if (!strcmp(sf->name, name))
+			break;
+
+	if (!sf) {
+		sf = calloc(1, sizeof(*sf));
+		if (!sf) {
+			UNLOCK(&sc->lock);
+			errno = ENOMEM;
+			return NULL;
+		}
+
+		strncpy(sf->name, name, sizeof(sf->name) - 1);
+		sf->root = sc->root;
+		sf->git = !!sc->git_rev;
+		sf->wd = -1;
+		LOCK_INIT(&sf->lock);
+		sf->next = sc->head;
+		sc->head = sf;
+	}
+
+	UNLOCK(&sc->lock);
+
+	LOCK(&sf->lock);
+	if (!sf->loaded && !sf->err)
+		fixdiff_srcfile_load(sf, sc, st);
+	UNLOCK(&sf->lock);
+
+	if (!sf->loaded) {
+		errno = sf->err;
+		return NULL;
+	}
+
+	return sf;
+}
+
+static int
+fixdiff_wsf_add(dp_t *pdp, int line, int sl)
+{
+	if (pdp->wsf_count == pdp->wsf_alloc) {
+		int na = pdp->wsf_alloc ? pdp->wsf_alloc * 2 : 64;
+		ws_fix_t *w1 = realloc(pdp->wsf, (size_t)na * sizeof(*w1));
+
+		if (!w1) {
+			elog(pdp, "OOM\n");
+			return 1;
+		}
+		pdp->wsf = w1;
+		pdp->wsf_alloc = na;
+	}
+
+	pdp->wsf[pdp->wsf_count].line = line;
+	pdp->wsf[pdp->wsf_count++].sl = sl;
+
+	return 0;
+}
+
+/*
+ * Copy a line without its EOL into dst the way fixdiff_wscmp() sees it, with
+ * no trailing whitespace and each run of spaces and tabs as one space
+ */
+
+static size_t
+fixdiff_ws_normalise(char *dst, const char *p, size_t len)
+{
+	const char *end = p + len - (size_t)fixdiff_assess_eol(p, len);
+	size_t n = 0;
+	char ws = 0;
+
+	while (end > p && (end[-1] == ' ' || end[-1] == '\t'))
+		end--;
+
+	while (p < end) {
+		if (*p == ' ' || *p == '\t') {
+			ws = 1;
+			p++;
+			continue;
+		}
+		if (ws) {
+			dst[n++] = ' ';
+			ws = 0;
+		}
+		dst[n++] = *p++;
+	}
+
+	return n;
+}
+
+/*
+ * The edits between a stanza and source line that aren't equal even with
+ * whitespace fuzz, or more than max if it's over max.  Whitespace differences
+ * don't count, and a line never matches if half of it or more was edited.
+ * Returns -1 for OOM.
+ */
+
+static int
+fixdiff_fuzzy_line(dp_t *pdp, const char *a, size_t la, const char *b,
+		   size_t lb, int max)
+{
+	size_t na, nb, sh;
+
+	if (la + lb > pdp->fz_alloc) {
+		char *p = realloc(pdp->fz, la + lb);
+
+		if (!p)
+			return -1;
+		pdp->fz = p;
+		pdp->fz_alloc = la + lb;
+	}
+
+	na = fixdiff_ws_normalise(pdp->fz, a, la);
+	nb = fixdiff_ws_normalise(pdp->fz + na, b, lb);
+
+	sh = FIXDIFF_EDIT_SCRATCH(na < nb ? na : nb);
+	if (sh > pdp->fzs_alloc) {
+		free(pdp->fzs);
+		pdp->fzs = calloc(sh, sizeof(*pdp->fzs));
+		if (!pdp->fzs) {
+			pdp->fzs_alloc = 0;
+			return -1;
+		}
+		pdp->fzs_alloc = sh;
+	}
+
+	if ((int)(((na > nb ? na : nb) - 1) / 2) < max)
+		max = (int)(((na > nb ? na : nb) - 1) / 2);
+
+	return fixdiff_edit_distance(pdp->fz, na, pdp->fz + na, nb, max,
+				     pdp->fzs);
+}
+
+/*
+ * Score the stanza placed at source line lis, allowing edits.  Returns the
+ * total edits, more than max if it doesn't fit in max, or -1 for OOM.  If
+ * record, the lines to take from the source are noted in pdp->wsf and
+ * *end is set to the source line after the match.  Exact and whitespace-
+ * equal lines cost nothing and never get as far as the edit distance.
+ */
+
+static int
+fixdiff_fuzzy_try(dp_t *pdp, const srcfile_t *sf, int lis, int max,
+		  int record, int *end)
+{
+	int tl, sl = lis, cost = 0, d;
+	line_ending_t let, les;
+	const char *stz, *src;
+	size_t lt, ls;
+
+	if (record) {
+		pdp->wsf_count = 0;
+		pdp->fuzz_lines = 0;
+	} else
+		pdp->sts.candidates++;
+
+	for (tl = pdp->sfirst; tl < pdp->st.count; tl++) {
+		stz = fixdiff_stanza_line(&pdp->st, tl, &lt);
+		if (stz[0] == '+')
+			continue;
+
+		if (sl >= sf->lines)
+			return max + 1;
+
+		src = sf->buf + sf->lo[sl];
+		ls = sf->lo[sl + 1] - sf->lo[sl];
+		pdp->sts.compared++;
+
+		if (fixdiff_strcmp(stz + 1, lt - 1, &let, src, ls, &les)) {
+			if (fixdiff_wscmp(stz + 1, lt - 1 - (size_t)let,
+					  src, ls - (size_t)les)) {
+				d = fixdiff_fuzzy_line(pdp, stz + 1, lt - 1,
+						       src, ls, max - cost);
+				if (d < 0)
+					return -1;
+				if (d > max - cost)
+					return max + 1;
+				cost += d;
+				if (record)
+					pdp->fuzz_lines++;
+			}
+
+			if (record && fixdiff_wsf_add(pdp, tl, sl))
+				return -1;
+		}
+
+		sl++;
+	}
+
+	if (record)
+		*end = sl;
+
+	return cost;
+}
+
+/*
+ * When nothing matched exactly, score every placement in one pass and take
+ * the one needing the fewest edits within the budget... with --nearest, ties
+ * go to the one nearest the seeds, otherwise to the first.  Returns 1 with
+ * *lis and *sl set like a normal hit, 0 if nothing fits or -1 for OOM.
+ */
+
+static int
+fixdiff_fuzzy_find(dp_t *pdp, const srcfile_t *sf, const probe_t *pr,
+		   int *lis, int *sl)
+{
+	int c, cost, best = -1, bc = pdp->o->fuzz + 1, bd = INT_MAX;
+
+	for (c = 0; c < sf->lines && bc; c++) {
+		int k, dist = INT_MAX, lim = bc - 1;
+
+		/* with --nearest, an equal cost may still be nearer */
+
+		if (pdp->o->nearest && bc <= pdp->o->fuzz)
+			lim = bc;
+
+		cost = fixdiff_fuzzy_try(pdp, sf, c, lim, 0, NULL);
+		if (cost < 0)
+			return -1;
+		if (cost > lim)
+			continue;
+
+		if (pdp->o->nearest)
+			for (k = 0; k < pr->nseed; k++)
+				if (abs(c - pr->seed[k]) < dist)
+					dist = abs(c - pr->seed[k]);
+
+		if (cost < bc || dist < bd) {
+			best = c;
+			bc = cost;
+			bd = dist;
+		}
+	}
+
+	if (best < 0 || fixdiff_fuzzy_try(pdp, sf, best, bc, 1, sl) < 0)
+		return best < 0 ? 0 : -1;
+
+	pdp->fuzz_edits = bc;
+	*lis = best;
+
+	return 1;
+}
+
+/*
+ * The source the stanza applies to.  From git, that's the blob the file's
+ * index line names if it exists... LLMs often make those up... otherwise the
+ * file at the revision.
+ */
+
+static srcfile_t *
+fixdiff_source(dp_t *pdp)
+{
+	char spec[sizeof(((srcfile_t *)0)->name)];
+	srcfile_t *sf;
+
+	if (!pdp->sc->git_rev)
+		return fixdiff_srcfile_get(pdp->sc, pdp->pf, &pdp->sts);
+
+	if (pdp->blob[0][0]) {
+		sf = fixdiff_srcfile_get(pdp->sc, pdp->blob[0], &pdp->sts);
+		if (sf)
+			return sf;
+	}
+
+	snprintf(spec, sizeof(spec), "%s:./%s", pdp->sc->commit, pdp->pf);
+
+	return fixdiff_srcfile_get(pdp->sc, spec, &pdp->sts);
+}
+
+/*
+ * The placement cache key covers the source's content, the stanza from where
+ * we start comparing, and the options and seeds that change where it goes
+ */
+
+static void
+fixdiff_cache_stanza_key(dp_t *pdp, srcfile_t *sf, const probe_t *pr,
+			 char *key)
+{
+	uint64_t h[2];
+	const char *p;
+	int k[7], n;
+	size_t l;
+
+	LOCK(&sf->lock);
+	if (!sf->hashed) {
+		memset(sf->ch, 0, sizeof(sf->ch));
+		fixdiff_cache_hash(sf->ch, sf->buf, sf->len);
+		sf->hashed = 1;
+	}
+	memcpy(h, sf->ch, sizeof(h));
+	UNLOCK(&sf->lock);
+
+	k[0] = 1; /* entry format */
+	k[1] = pdp->o->nearest;
+	k[2] = pdp->o->fuzz;
+	k[3] = pdp->sfirst;
+	k[4] = pr->nseed;
+	k[5] = pr->seed[0];
+	k[6] = pr->seed[1];
+	fixdiff_cache_hash(h, k, sizeof(k));
+
+	for (n = pdp->sfirst; n < pdp->st.count; n++) {
+		p = fixdiff_stanza_line(&pdp->st, n, &l);
+		fixdiff_cache_hash(h, p, l);
+	}
+
+	fixdiff_cache_key(h, key);
+}
+
+/*
+ * An entry is the placement's first and end source lines, the fuzz counts,
+ * and the stanza lines to take from the source with the source line for each.
+ * Returns 1 with those set as if the search found them, or 0 if there is no
+ * usable entry.
+ */
+
+static int
+fixdiff_cache_lookup(dp_t *pdp, const srcfile_t *sf, const char *key,
+		     int *lis, int *sl)
+{
+	int n = 0, c, k, ok = 0;
+	long a, b;
+	char *buf, *p, *e;
+	size_t len;
+
+	if (fixdiff_cache_get(pdp->o->cache, key, &buf, &len))
+		return 0;
+	buf[len] = '\0';
+
+	pdp->wsf_count = 0;
+
+	if (sscanf(buf, "fixdiff-placement %d %d %d %d %d%n", lis, sl,
+		   &pdp->fuzz_lines, &pdp->fuzz_edits, &c, &n) != 5 || !n ||
+	    *lis < 0 || *lis >= sf->lines || *sl < *lis || *sl > sf->lines ||
+	    c < 0 || c > pdp->st.count || pdp->fuzz_lines < 0 ||
+	    pdp->fuzz_lines > c)
+		goto bail;
+
+	p = buf + n;
+	for (k = 0; k < c; k++) {
+		a = strtol(p, &e, 10);
+		if (e == p || a < pdp->sfirst || a >= pdp->st.count)
+			goto bail;
+		p = e;
+		b = strtol(p, &e, 10);
+		if (e == p || b < *lis || b >= *sl)
+			goto bail;
+		p = e;
+
+		if (fixdiff_wsf_add(pdp, (int)a, (int)b))
+			goto bail;
+	}
+
+	ok = 1;
+
+bail:
+	if (!ok) {
+		pdp->wsf_count = 0;
+		pdp->fuzz_lines = 0;
+	}
+	free(buf);
+
+	return ok;
+}
+
+static void
+fixdiff_cache_store(dp_t *pdp, const char *key, int lis, int sl)
+{
+	membuf_t mb;
+	int n;
+
+	memset(&mb, 0, sizeof(mb));
+
+	fixdiff_mbprintf(&mb, "fixdiff-placement %d %d %d %d %d\n", lis, sl,
+			 pdp->fuzz_lines, pdp->fuzz_edits, pdp->wsf_count);
+	for (n = 0; n < pdp->wsf_count; n++)
+		fixdiff_mbprintf(&mb, "%d %d\n", pdp->wsf[n].line,
+				 pdp->wsf[n].sl);
+
+	if (mb.mem &&
+	    !fixdiff_cache_put(pdp->o->cache, key, mb.mem, mb.mem_len)) {
+		LOCK(&pdp->sc->lock);
+		pdp->sc->cache_put = 1;
+		UNLOCK(&pdp->sc->lock);
+	}
+
+	free(mb.mem);
+}
+
+/*
+ * Lines to try before searching, from where the earlier fix placed the same
+ * stanza, ie, one with the same ' ' and '-' lines, in the same file.  It's
+ * where that went, then lines near it in case the source moved, nearest
+ * first.  A stanza that changed gets no hints and is searched for as usual, so
+ * where it goes doesn't depend on the earlier fix.  Returns how many there are
+ * in hint.
+ */
+
+static int
+fixdiff_previous_hints(dp_t *pdp, const srcfile_t *sf, int *hint)
+{
+	const fixdiff_t *ctx = pdp->ctx;
+	int n, d, x, nh = 0;
+
+	for (n = 0; n < ctx->prev_count; n++) {
+		const prev_t *pv = &ctx->prev[n];
+
+		if (pv->seq != pdp->seq || pv->fh != pdp->seq_fh ||
+		    strcmp(pv->pf, pdp->pf))
+			continue;
+
+		for (d = 0; d <= FIXDIFF_PREV_SHIFT * 2; d++) {
+			x = pv->line + ((d & 1) ? -(d + 1) / 2 : d / 2);
+
+			if (x >= 0 && x < sf->lines &&
+			    sf->lh[x] == pdp->seq_fh) {
+				if (nh == FIXDIFF_PREV_HINTS)
+					return nh;
+				hint[nh++] = x;
+			}
+		}
+	}
+
+	return nh;
+}
+
+/*
+ * Choose the ' ' or '-' line in the stanza, from tl which is the first, that
+ * appears least in the source to find candidates by.  One that isn't there at
+ * all means there is no match, but we still want the candidates for saying
+ * how close we got, so it must appear at least once.
+ */
+
+static void
+fixdiff_anchor(dp_t *pdp, const srcfile_t *sf, int tl, anchor_t *an)
+{
+	int best, c, k = 0;
+	const char *p;
+	uint32_t h;
+	size_t l;
+
+	an->ah = an->fh;
+	an->k = 0;
+	an->x = -1;
+
+	best = fixdiff_srcfile_count(sf, an->fh);
+	if (best <= FIXDIFF_ANCHOR_COMMON)
+		return;
+
+	while (++tl < pdp->st.count && best > 1) {
+		p = fixdiff_stanza_line(&pdp->st, tl, &l);
+		if (p[0] == '+')
+			continue;
+		k++;
+
+		h = fixdiff_hash_line(p + 1, l - 1);
+		c = fixdiff_srcfile_count(sf, h);
+		if (c && c < best) {
+			best = c;
+			an->ah = h;
+			an->k = k;
+		}
+	}
+}
+
+/*
+ * The first candidate start line if lis is -1, otherwise the next one after
+ * lis.  Without --nearest they come in file order, so the first that matches
+ * is the first match in the file.
+ */
+
+static int
+fixdiff_candidate(dp_t *pdp, const srcfile_t *sf, probe_t *pr, anchor_t *an,
+		  int lis)
+{
+	if (pdp->o->nearest) {
+		do
+			lis = fixdiff_probe_next(pr, sf, an->fh);
+		while (lis >= 0 && an->k && (lis + an->k >= sf->lines ||
+					     sf->lh[lis + an->k] != an->ah));
+
+		return lis;
+	}
+
+	if (!an->k)
+		return lis < 0 ? fixdiff_srcfile_lookup(sf, an->fh) :
+				 fixdiff_srcfile_next(sf, lis);
+
+	an->x = an->x < 0 ? fixdiff_srcfile_lookup(sf, an->ah) :
+			    fixdiff_srcfile_next(sf, an->x);
+
+	while (an->x >= 0 && (an->x < an->k ||
+			      sf->lh[an->x - an->k] != an->fh))
+		an->x = fixdiff_srcfile_next(sf, an->x);
+
+	return an->x < 0 ? -1 : an->x - an->k;
+}
+
+/*
+ * With --max-mem, a source too big to load and index within it is streamed
+ * instead.  We read it from the start a chunk at a time, keeping only as many
+ * of the last lines as the biggest stanza in the pass has ' ' and '-' lines,
+ * and for each different number of them the stanzas have, a rolling hash of
+ * that many line hashes.  A stanza's lines are only compared where the one
+ * for its number of lines equals the same hash of its own.
+ *
+ * Each stanza's placement, and up to three lines after it for EOF context,
+ * are copied into its sscan_t's win, which fixdiff_find_original() then uses
+ * as the source.  Its line 0 is line base of the real one.
+ */
+
+#define FIXDIFF_STREAM_AFTER	3
+#define FIXDIFF_STREAM_CHUNK	65536
+#define FIXDIFF_STREAM_MUL	0x100000001b3ull
+
+/*
+ * The stanzas with the same number of lines to compare share a rolling hash,
+ * and are sorted by their own hash to find the ones it equals
+ */
+
+typedef struct {
+	uint64_t		hs;
+	int			m;
+	int			idx; /* in pdp->ss */
+} skey_t;
+
+typedef struct {
+	uint64_t		hr; /* of the last m lines */
+	uint64_t		bm; /* FIXDIFF_STREAM_MUL to the m */
+	int			m;
+	int			first; /* its stanzas' skey_t */
+	int			count;
+} slen_t;
+
+static int
+fixdiff_skey_cmp(const void *a, const void *b)
+{
+	const skey_t *k1 = (const skey_t *)a, *k2 = (const skey_t *)b;
+
+	if (k1->m != k2->m)
+		return k1->m < k2->m ? -1 : 1;
+	if (k1->hs != k2->hs)
+		return k1->hs < k2->hs ? -1 : 1;
+
+	return k1->idx - k2->idx;
+}
+
+static int
+fixdiff_win_add(sscan_t *s, const char *p, size_t len)
+{
+	srcfile_t *w = &s->win;
+
+	if (w->lines + 2 > s->win_lo_alloc) {
+		int na = s->win_lo_alloc ? s->win_lo_alloc * 2 : 16;
+		size_t *lo1 = realloc(w->lo, (size_t)na * sizeof(*lo1));
+
+		if (!lo1)
+			return 1;
+		w->lo = lo1;
+		s->win_lo_alloc = na;
+	}
+
+	if (w->len + len > s->win_alloc) {
+		size_t na = s->win_alloc ? s->win_alloc * 2 : 4096;
+		char *b1;
+
+		while (na < w->len + len)
+			na *= 2;
+		b1 = realloc(w->buf, na);
+		if (!b1)
+			return 1;
+		w->buf = b1;
+		s->win_alloc = na;
+	}
+
+	memcpy(w->buf + w->len, p, len);
+	w->lo[w->lines++] = w->len;
+	w->len += len;
+	w->lo[w->lines] = w->len;
+
+	return 0;
+}
+
+/*
+ * Make room for count stanzas in pdp->ss
+ */
+
+static int
+fixdiff_sscan_alloc(dp_t *pdp, int count)
+{
+	sscan_t *s1;
+
+	if (count <= pdp->ss_alloc)
+		return 0;
+
+	s1 = realloc(pdp->ss, (size_t)count * sizeof(*s1));
+	if (!s1)
+		return 1;
+
+	memset(s1 + pdp->ss_alloc, 0,
+	       (size_t)(count - pdp->ss_alloc) * sizeof(*s1));
+	pdp->ss = s1;
+	pdp->ss_alloc = count;
+
+	return 0;
+}
+
+/*
+ * Get s ready for a pass looking for st's ' ' and '-' lines from tl on, with
+ * pr the seeds for SS_BEST
+ */
+
+static int
+fixdiff_sscan_init(sscan_t *s, const stanza_t *st, int tl, ssmode_t mode,
+		   const probe_t *pr)
+{
+	const char *p;
+	size_t len;
+	int n;
+
+	s->st = st;
+	s->m = 0;
+	s->hs = 0;
+	s->hits = 0;
+	s->br = INT64_MAX;
+	s->at = -1;
+	s->base = -1;
+	s->cap = 0;
+	s->maxseed = 0;
+	s->mode = mode;
+	s->done = 0;
+	s->err = 0;
+	s->big = 0;
+	s->win.lines = 0;
+	s->win.len = 0;
+
+	if (pr) {
+		s->pr = *pr;
+		for (n = 0; n < pr->nseed; n++)
+			if (pr->seed[n] > s->maxseed)
+				s->maxseed = pr->seed[n];
+	}
+
+	for (n = tl; n < st->count; n++) {
+		p = fixdiff_stanza_line(st, n, &len);
+		if (p[0] == '+')
+			continue;
+
+		if (s->m == s->cl_alloc) {
+			int na = s->cl_alloc ? s->cl_alloc * 2 : 64;
+			int *c1 = realloc(s->cl, (size_t)na * sizeof(*c1));
+
+			if (!c1)
+				return 1;
+			s->cl = c1;
+			s->cl_alloc = na;
+		}
+
+		s->cl[s->m++] = n;
+		s->hs = s->hs * FIXDIFF_STREAM_MUL +
+			fixdiff_hash_line(p + 1, len - 1);
+	}
+
+	if (!s->m) {
+		/* anywhere will do, so the start, like when searching */
+		s->base = 0;
+		s->cap = FIXDIFF_STREAM_AFTER;
+	}
+
+	return 0;
+}
+
+static int
+fixdiff_sscan_hit(sscan_t *s, int lis)
+{
+	if (s->hits == s->hit_alloc) {
+		int na = s->hit_alloc ? s->hit_alloc * 2 : 16;
+		int *h1 = realloc(s->hit, (size_t)na * sizeof(*h1));
+
+		if (!h1)
+			return 1;
+		s->hit = h1;
+		s->hit_alloc = na;
+	}
+
+	s->hit[s->hits++] = lis;
+
+	return 0;
+}
+
+/*
+ * Do the stanza's lines match the ones in the window from lis, allowing for
+ * whitespace fuzz?
+ */
+
+static int
+fixdiff_stream_verify(dp_t *pdp, const sscan_t *s, int rn, int lis)
+{
+	line_ending_t let, les;
+	const rline_t *e;
+	const char *in_stz;
+	size_t lt;
+	int n;
+
+	for (n = 0; n < s->m; n++) {
+		in_stz = fixdiff_stanza_line(s->st, s->cl[n], &lt);
+		e = &pdp->ring[(lis + n) % rn];
+
+		pdp->sts.compared++;
+		if (fixdiff_strcmp(in_stz + 1, lt - 1, &let, pdp->sbuf + e->o,
+				   e->len, &les) &&
+		    fixdiff_wscmp(in_stz + 1, lt - 1 - (size_t)let,
+				  pdp->sbuf + e->o, e->len - (size_t)les))
+			return 0;
+	}
+
+	return 1;
+}
+
+/*
+ * It matched the window's lines from lis to x, copy them out
+ */
+
+static int
+fixdiff_stream_place(dp_t *pdp, sscan_t *s, int rn, int lis, int x)
+{
+	const rline_t *e;
+
+	s->win.lines = 0;
+	s->win.len = 0;
+	s->base = lis;
+	s->cap = FIXDIFF_STREAM_AFTER;
+
+	for (; lis <= x; lis++) {
+		e = &pdp->ring[lis % rn];
+		if (fixdiff_win_add(s, pdp->sbuf + e->o, e->len))
+			return 1;
+	}
+
+	return 0;
+}
+
+/*
+ * The placement in s->win matched allowing for whitespace fuzz, note the lines
+ * that differ for the output
+ */
+
+static int
+fixdiff_stream_wsf(dp_t *pdp, const sscan_t *s)
+{
+	line_ending_t let, les;
+	const char *in_stz;
+	size_t lt;
+	int n;
+
+	pdp->wsf_count = 0;
+
+	for (n = 0; n < s->m; n++) {
+		in_stz = fixdiff_stanza_line(&pdp->st, s->cl[n], &lt);
+		if (fixdiff_strcmp(in_stz + 1, lt - 1, &let,
+				   s->win.buf + s->win.lo[n],
+				   s->win.lo[n + 1] - s->win.lo[n], &les) &&
+		    fixdiff_wsf_add(pdp, s->cl[n], n))
+			return 1;
+	}
+
+	return 0;
+}
+
+/*
+ * With --nearest, where fixdiff_probe_next() would get to a start line, lower
+ * is sooner
+ */
+
+static int64_t
+fixdiff_stream_rank(const probe_t *pr, int x)
+{
+	int64_t r, best = INT64_MAX;
+	int k, d;
+
+	for (k = 0; k < pr->nseed; k++) {
+		d = x - pr->seed[k];
+		r = ((int64_t)(d < 0 ? -d : d) << 2) + k * 2 + (d < 0);
+		if (r < best)
+			best = r;
+	}
+
+	return best;
+}
+
+/*
+ * s's rolling hash equals that of the window's lines from lis to x, are they
+ * a placement for it?  Returns 1 if it has started copying out the lines after
+ * one, -1 if OOM, else 0.
+ */
+
+static int
+fixdiff_stream_cand(dp_t *pdp, sscan_t *s, int rn, int lis, int x)
+{
+	int64_t rank = 0;
+	int r;
+
+	if (s->done || (s->mode == SS_FIRST && s->base >= 0) ||
+	    (s->mode == SS_AT && lis != s->at))
+		return 0;
+
+	if (s->mode == SS_BEST) {
+		rank = fixdiff_stream_rank(&s->pr, lis);
+		if (s->base >= 0 && rank >= s->br)
+			return 0;
+	}
+
+	pdp->sts.candidates++;
+	if (!fixdiff_stream_verify(pdp, s, rn, lis))
+		return 0;
+
+	if (s->mode == SS_HITS)
+		return fixdiff_sscan_hit(s, lis) ? -1 : 0;
+
+	/* the best so far */
+
+	s->br = rank;
+	r = !s->cap;
+	if (fixdiff_stream_place(pdp, s, rn, lis, x))
+		return -1;
+
+	return r;
+}
+
+/*
+ * How many of the last lines the stanzas still looking need kept, which is
+ * what *idx needs, or -1 if none do
+ */
+
+static int
+fixdiff_stream_need(const dp_t *pdp, int count, int *idx)
+{
+	int i, m = 0;
+
+	*idx = -1;
+
+	for (i = 0; i < count; i++) {
+		const sscan_t *s = &pdp->ss[i];
+
+		if (!s->done && s->m > m &&
+		    (s->base < 0 || s->mode == SS_BEST)) {
+			m = s->m;
+			*idx = i;
+		}
+	}
+
+	return m;
+}
+
+/*
+ * Read the source once for the count stanzas in pdp->ss, placing each as its
+ * mode says, or with base -1 if it isn't there.  One whose lines don't fit in
+ * --max-mem is left out with big set, so it doesn't stop the others.  Returns
+ * 0, or -1 with err set in each if we couldn't look.
+ */
+
+static int
+fixdiff_stream_scan(dp_t *pdp, const srcfile_t *sf, int count)
+{
+	size_t limit = (size_t)(pdp->o->max_mem / 2), blen = 0, lstart = 0,
+	       scan = 0, keep;
+	int maxm = 0, big, nk = 0, nlen = 0, left = 0, ncap = 0, nbest = 0,
+	    rn, x = 0, n, i, k, r, lis, lo, hi, fd;
+	char path[1024], eof = 0;
+	const char *nl;
+	skey_t *sk;
+	slen_t *sln, *g;
+	sscan_t *s;
+	rline_t *e;
+	ssize_t rd;
+
+	/* the stanzas still to find, by how many lines they compare, and hash */
+
+	sk = malloc((size_t)count * (sizeof(*sk) + sizeof(*sln)));
+	if (!sk)
+		goto oom;
+	sln = (slen_t *)(sk + count);
+
+	for (i = 0; i < count; i++) {
+		s = &pdp->ss[i];
+		s->done = (char)(s->big || (s->m ? s->mode == SS_AT &&
+							   s->at < 0 : !s->cap));
+		if (s->done)
+			continue;
+
+		left++;
+		if (s->cap)
+			ncap++;
+		if (s->mode == SS_BEST)
+			nbest++;
+		if (s->m > maxm)
+			maxm = s->m;
+		if (s->m) {
+			sk[nk].hs = s->hs;
+			sk[nk].m = s->m;
+			sk[nk++].idx = i;
+		}
+	}
+
+	qsort(sk, (size_t)nk, sizeof(*sk), fixdiff_skey_cmp);
+
+	for (k = 0; k < nk; k++) {
+		if (!nlen || sln[nlen - 1].m != sk[k].m) {
+			g = &sln[nlen++];
+			g->hr = 0;
+			g->bm = 1;
+			g->m = sk[k].m;
+			g->first = k;
+			g->count = 0;
+			for (n = 0; n < g->m; n++)
+				g->bm *= FIXDIFF_STREAM_MUL;
+		}
+		sln[nlen - 1].count++;
+	}
+
+	if (!left) {
+		free(sk);
+		return 0;
+	}
+
+	/* the ring has the line hashes for every rolling hash */
+
+	rn = maxm + FIXDIFF_STREAM_AFTER;
+	if (rn > pdp->ring_alloc) {
+		rline_t *r1 = realloc(pdp->ring, (size_t)rn * sizeof(*r1));
+
+		if (!r1)
+			goto oom;
+		pdp->ring = r1;
+		pdp->ring_alloc = rn;
+	}
+
+	fixdiff_srcfile_path(sf, path, sizeof(path));
+	fd = open(path, OFLAGS(O_RDONLY));
+	pdp->sts.syscalls++;
+	if (fd < 0) {
+		elog(pdp, "%s: Unable to open: %s: %d\n", __func__, pdp->pf,
+		     errno);
+		goto fail;
+	}
+
+	while (1) {
+
+		/* deal with each line we have all of */
+
+		while (left) {
+			nl = scan < blen ? fixdiff_scan_nl(pdp->sbuf + scan,
+							   blen - scan) : NULL;
+			if (!nl) {
+				if (!eof || lstart == blen)
+					break;
+				/* like loading, the last line gets a '\n' */
+				pdp->sbuf[blen++] = '\n';
+				nl = pdp->sbuf + blen - 1;
+			}
+			scan = (size_t)(nl + 1 - pdp->sbuf);
+
+			e = &pdp->ring[x % rn];
+			e->o = lstart;
+			e->len = scan - lstart;
+			e->h = fixdiff_hash_line(pdp->sbuf + lstart, e->len);
+			lstart = scan;
+
+			/* trailing context for the placements */
+
+			for (i = 0; ncap && i < count; i++) {
+				s = &pdp->ss[i];
+				if (!s->cap)
+					continue;
+				if (fixdiff_win_add(s, pdp->sbuf + e->o, e->len))
+					goto oom_fd;
+				if (--s->cap)
+					continue;
+				ncap--;
+				if (!s->m || s->mode == SS_FIRST ||
+				    s->mode == SS_AT) {
+					s->done = 1;
+					left--;
+				}
+			}
+
+			/* the stanzas whose lines may end here */
+
+			for (n = 0; n < nlen; n++) {
+				g = &sln[n];
+				g->hr = g->hr * FIXDIFF_STREAM_MUL + e->h;
+				if (x >= g->m)
+					g->hr -= pdp->ring[(x - g->m) % rn].h *
+						 g->bm;
+
+				lis = x - g->m + 1;
+				if (lis < 0)
+					continue;
+
+				lo = g->first;
+				hi = g->first + g->count;
+				while (lo < hi) {
+					k = (lo + hi) / 2;
+					if (sk[k].hs < g->hr)
+						lo = k + 1;
+					else
+						hi = k;
+				}
+
+				for (k = lo; k < g->first + g->count &&
+					     sk[k].hs == g->hr; k++) {
+					r = fixdiff_stream_cand(pdp,
+							&pdp->ss[sk[k].idx],
+							rn, lis, x);
+					if (r < 0)
+						goto oom_fd;
+					ncap += r;
+				}
+			}
+
+			x++;
+
+			/*
+			 * Past all the seeds, later candidates are only ever
+			 * further away
+			 */
+
+			for (i = 0; nbest && i < count; i++) {
+				s = &pdp->ss[i];
+				if (s->mode == SS_BEST && !s->done &&
+				    s->base >= 0 && !s->cap &&
+				    x - s->m + 1 > s->maxseed &&
+				    fixdiff_stream_rank(&s->pr, x - s->m + 1) >
+								s->br) {
+					s->done = 1;
+					left--;
+					nbest--;
+				}
+			}
+		}
+
+		if (!left || eof)
+			break;
+
+		/* a later placement may start at x - maxm + 1, keep that on */
+
+		n = x - maxm + 1 > 0 ? x - maxm + 1 : 0;
+		keep = n < x ? pdp->ring[n % rn].o : lstart;
+		if (keep) {
+			memmove(pdp->sbuf, pdp->sbuf + keep, blen - keep);
+			blen -= keep;
+			lstart -= keep;
+			scan -= keep;
+			for (; n < x; n++)
+				pdp->ring[n % rn].o -= keep;
+		}
+
+		if (blen + 1 >= pdp->sbuf_alloc) {
+			size_t na = pdp->sbuf_alloc ? pdp->sbuf_alloc * 2 :
+						      FIXDIFF_STREAM_CHUNK;
+			char *b1;
+
+			if (na > limit)
+				na = limit;
+			if (na <= blen + 1) {
+				/*
+				 * Leave out the stanza needing the most lines
+				 * kept, or if none need any, one line is too
+				 * big and we can't go on for any of them
+				 */
+
+				fixdiff_stream_need(pdp, count, &big);
+				for (i = 0; i < count; i++) {
+					s = &pdp->ss[i];
+					if (s->done || (big >= 0 && i != big))
+						continue;
+					s->big = (char)(s->base < 0 ||
+							s->mode == SS_BEST);
+					s->done = 1;
+					left--;
+					if (s->mode == SS_BEST)
+						nbest--;
+					if (s->cap) {
+						s->cap = 0;
+						ncap--;
+					}
+				}
+				maxm = fixdiff_stream_need(pdp, count, &big);
+				continue;
+			}
+			b1 = realloc(pdp->sbuf, na);
+			if (!b1)
+				goto oom_fd;
+			pdp->sbuf = b1;
+			pdp->sbuf_alloc = na;
+		}
+
+		rd = read(fd, pdp->sbuf + blen,
+			  TO_POSLEN(pdp->sbuf_alloc - 1 - blen));
+		pdp->sts.syscalls++;
+		if (rd < 0) {
+			elog(pdp, "%s: Unable to read: %s: %d\n", __func__,
+			     pdp->pf, errno);
+			goto fail_fd;
+		}
+		if (!rd)
+			eof = 1;
+		blen += (size_t)rd;
+		pdp->sts.bytes += (uint64_t)rd;
+	}
+
+	close(fd);
+	pdp->sts.syscalls++;
+	free(sk);
+
+	return 0;
+
+oom_fd:
+	elog(pdp, "OOM\n");
+fail_fd:
+	close(fd);
+	pdp->sts.syscalls++;
+	goto fail;
+oom:
+	elog(pdp, "OOM\n");
+fail:
+	for (i = 0; i < count; i++)
+		pdp->ss[i].err = 1;
+	free(sk);
+
+	return -1;
+}
+
+/*
+ * Place the stanzas held for a streamed source, see fixdiff_hold(), with one
+ * pass over it.  With --nearest, where one goes depends on where the one
+ * before it went, so that pass notes every match, we choose from them in
+ * order like fixdiff_probe_next() would, and a second pass copies out the
+ * chosen ones.  Each is then in pdp->ss for fixdiff_find_original(), with
+ * err set if the passes failed, or big if its lines didn't fit.
+ */
+
+static void
+fixdiff_stream_group(dp_t *pdp, const srcfile_t *sf)
+{
+	int prev_end = pdp->prev_end, n, k;
+	const prec_t *r;
+	int64_t rank;
+	probe_t pr;
+	sscan_t *s;
+
+	for (n = 0; n < pdp->holds; n++) {
+		r = &pdp->hold[n];
+
+		/* the first is in the dp while it's being placed */
+
+		if (fixdiff_sscan_init(&pdp->ss[n], n ? &r->st : &pdp->st,
+				       r->sfirst, pdp->o->nearest ? SS_HITS :
+								    SS_FIRST,
+				       NULL)) {
+			elog(pdp, "OOM\n");
+			for (n = 0; n < pdp->holds; n++)
+				pdp->ss[n].err = 1;
+			return;
+		}
+	}
+
+	if (fixdiff_stream_scan(pdp, sf, pdp->holds) || !pdp->o->nearest)
+		return;
+
+	for (n = 0; n < pdp->holds; n++) {
+		r = &pdp->hold[n];
+		s = &pdp->ss[n];
+
+		if (!s->m) {
+			prev_end = 0;
+			continue;
+		}
+
+		fixdiff_probe_seeds(&pr, sf, r->osh, r->sfirst, prev_end);
+		s->mode = SS_AT;
+		for (k = 0; k < s->hits; k++) {
+			rank = fixdiff_stream_rank(&pr, s->hit[k]);
+			if (rank < s->br) {
+				s->br = rank;
+				s->at = s->hit[k];
+			}
+		}
+
+		if (s->at >= 0)
+			prev_end = s->at + s->m;
+	}
+
+	fixdiff_stream_scan(pdp, sf, pdp->holds);
+}
+
+/*
+ * The output is issued after the window has been reused for the next stanza
+ * when pipelined, so the rewritten lines are put in the stanza arena instead
+ */
+
+static int
+fixdiff_stream_bake(dp_t *pdp)
+{
+	int n;
+
+	for (n = 0; n < pdp->rw_lines; n++) {
+		const rewrite_t *r = &pdp->rw[n];
+		char c, *p;
+
+		if (!r->src)
+			continue;
+
+		c = pdp->st.buf[pdp->st.sl[n].ofs];
+		p = fixdiff_stanza_add(&pdp->st, r->len + 2);
+		if (!p)
+			return 1;
+
+		/* line n becomes the one we just added */
+
+		pdp->st.sl[n] = pdp->st.sl[--pdp->st.count];
+		p[0] = c;
+		memcpy(p + 1, r->src, r->len);
+		p[r->len + 1] = '\n';
+	}
+
+	pdp->rw_lines = 0;
+
+	return 0;
+}
+
+/*
+ * The idea is to set the starting point in the stanza for comparison in order
+ * to lose any extra lead_in (4 randomly seen with Gemini 2.5 where most are 3)
+ */
+
+static void
+fixdiff_stanza_trim(dp_t *pdp)
+{
+	while (pdp->lead_in > 3 && pdp->sfirst < pdp->st.count) {
+		pdp->sfirst++;
+		elog(pdp, "    stanza %d: removing extra lead-in\n", pdp->stanzas);
+		pdp->lead_in--;
+		pdp->lead_in_corrected++;
+		pdp->pre--;
+		pdp->post--;
+	}
+}
+
+static int
+fixdiff_find_original(dp_t *pdp, int *line_start)
+{
+	char b1[256], b2[256], f1[256], f2[256], hit = 0, cached = 0;
+	char key[FIXDIFF_CACHE_KEY], streamed = 0;
+	int hint[FIXDIFF_PREV_HINTS], nh = 0, hi = 0, resume = -2, base = 0;
+	anchor_t an;
+	probe_t pr;
+	int ret = 1, mc = 0, lmc = 0, lis = 0, lg_lis = 0, sl = 0, tl;
+	const char *in_src = NULL, *in_stz = NULL;
+	uint32_t fh = 0;
+	srcfile_t *sf;
+	size_t lt, ls;
+
+	/*
+	 * We need to confirm the correct place in the file with the unchanged
+	 * version.  Let's match ' ' and '-' lines, and skip '+' lines.
+	 */
+
+	b1[0] = '\0';
+	b2[0] = '\0';
+	f1[0] = '\0';
+	f2[0] = '\0';
+
+	fixdiff_stanza_trim(pdp);
+	if (pdp->lead_in > 3) {
+		elog(pdp, "Unable to skip stanza lines\n");
+		return 1;
+	}
+
+	sf = fixdiff_source(pdp);
+	if (!sf) {
+		if (pdp->sc->git_rev)
+			elog(pdp, "%s: Unable to get %s at %s from git: %d\n",
+			     __func__, pdp->pf, pdp->sc->git_rev, errno);
+		else
+			elog(pdp, "%s: Unable to open: %s: %d\n",
+			     __func__, pdp->pf, errno);
+		return 1;
+	}
+
+	pdp->rw_lines = 0;
+	pdp->fuzz_lines = 0;
+	pdp->seq = 0;
+	pdp->seq_fh = 0;
+
+	/*
+	 * A match can only start on a source line that hashes the same as
+	 * the first ' ' or '-' line in the stanza, so we only need to try
+	 * those.  If there are no such lines, anywhere will do, so we match
+	 * at the start like before.
+	 */
+
+	lt = 0;
+	for (tl = pdp->sfirst; tl < pdp->st.count; tl++) {
+		in_stz = fixdiff_stanza_line(&pdp->st, tl, &lt);
+		if (in_stz[0] != '+')
+			break;
+	}
+
+	/*
+	 * With --nearest, we start from where the @@ header says the stanza
+	 * is, and where the last stanza in this file ended, and work outwards
+	 * from both until we find the closest match.  Otherwise we take the
+	 * first match in the file.
+	 */
+
+	memset(&pr, 0, sizeof(pr));
+	memset(&an, 0, sizeof(an));
+	if (pdp->o->nearest)
+		fixdiff_probe_seeds(&pr, sf, pdp->osh, pdp->sfirst,
+				    pdp->prev_end);
+
+	if (tl < pdp->st.count) {
+		fh = fixdiff_hash_line(in_stz + 1, lt - 1);
+		an.fh = fh;
+		stain_copy(f1, in_stz + 1, lt - 1, sizeof(f1));
+		if (!sf->stream) {
+			fixdiff_anchor(pdp, sf, tl, &an);
+			lis = fixdiff_candidate(pdp, sf, &pr, &an, -1);
+		}
+		if (sf->lines)
+			stain_copy(f2, sf->buf + sf->lo[sf->lines - 1],
+				   sf->len - sf->lo[sf->lines - 1], sizeof(f2));
+	}
+
+	/*
+	 * The stanza is known by its ' ' and '-' lines, whitespace-normalised,
+	 * so another try at the patch that only changed '+' lines is the same
+	 */
+
+	if (tl < pdp->st.count &&
+	    (pdp->o->placements || pdp->ctx->prev_count)) {
+		uint64_t h[2] = { 0, 0 };
+		const char *p;
+		uint32_t lh;
+		size_t l;
+		int n;
+
+		for (n = tl; n < pdp->st.count; n++) {
+			p = fixdiff_stanza_line(&pdp->st, n, &l);
+			if (p[0] == '+')
+				continue;
+			lh = fixdiff_hash_line(p + 1, l - 1);
+			fixdiff_cache_hash(h, &lh, sizeof(lh));
+		}
+
+		pdp->seq = h[0];
+		pdp->seq_fh = fh;
+	}
+
+	/* a placement we found before, for the same stanza and source */
+
+	if (pdp->o->cache && !sf->stream) {
+		fixdiff_cache_stanza_key(pdp, sf, &pr, key);
+		cached = (char)fixdiff_cache_lookup(pdp, sf, key, &lis, &sl);
+		hit = cached;
+	}
+
+	/* try where it went last time first, then carry on as usual */
+
+	if (!hit && tl < pdp->st.count && pdp->ctx->prev_count && !sf->stream) {
+		nh = fixdiff_previous_hints(pdp, sf, hint);
+		if (nh) {
+			resume = lis;
+			lis = hint[hi++];
+		}
+	}
+
+	/*
+	 * A streamed source is searched in one pass, unless one shared with the
+	 * other stanzas held for it already placed this one.  What we found is
+	 * then in the sscan_t's win starting at its line 0.
+	 */
+
+	if (sf->stream) {
+		sscan_t *s = pdp->sscan;
+
+		if (pdp->apply) {
+			elog(pdp, "**** %s: can't apply to a source streamed "
+				  "for --max-mem\n", pdp->pf);
+			return 1;
+		}
+
+		if (!s) {
+			if (fixdiff_sscan_alloc(pdp, 1) ||
+			    fixdiff_sscan_init(&pdp->ss[0], &pdp->st,
+					       pdp->sfirst, pdp->o->nearest ?
+						SS_BEST : SS_FIRST, &pr)) {
+				elog(pdp, "OOM\n");
+				return -1;
+			}
+			s = &pdp->ss[0];
+			fixdiff_stream_scan(pdp, sf, 1);
+		}
+
+		if (s->big)
+			elog(pdp, "**** %s: stanza %d's lines need more than "
+				  "--max-mem allows\n", pdp->pf, pdp->stanzas);
+		if (s->err || s->big)
+			return 1;
+
+		hit = (char)(s->base >= 0);
+		if (hit && fixdiff_stream_wsf(pdp, s)) {
+			elog(pdp, "OOM\n");
+			return -1;
+		}
+
+		streamed = 1;
+		base = hit ? s->base : 0;
+		sl = s->m;
+		sf = &s->win;
+		lis = hit ? 0 : -1;
+	}
+
+	/*
+	 * Outer loop walks through each candidate line in source.
+	 * Inner loop tries to match starting from that line
+	 */
+
+	while (!hit && lis >= 0) {
+		line_ending_t let, les;
+
+		tl = pdp->sfirst;
+		pdp->wsf_count = 0;
+		pdp->sts.candidates++;
+
+		for (sl = lis; !hit; sl++) {
+			ls = 0;
+			if (sl < sf->lines) {
+				in_src = sf->buf + sf->lo[sl];
+				ls = sf->lo[sl + 1] - sf->lo[sl];
+			}
+				/*
+				 * We may be adding at end with original lines leading-in, in this
+				 * case it is normal we will not be able to fetch any more lines
+				 * from the original file before running out of diff
+				 */
+
+			do {
+				if (tl == pdp->st.count) {
+					/* ran out of stanza before mismatch / EOF */
+					hit = 1;
+					break;
+				}
+				in_stz = fixdiff_stanza_line(&pdp->st, tl++, &lt);
+
+			} while (in_stz[0] == '+');
+
+			if (hit)
+				break;
+
+			if (!ls) {
+				mc = 0;
+				break;
+			}
+
+			pdp->sts.compared++;
+			if (fixdiff_strcmp(in_stz + 1, lt - 1, &let, in_src, ls, &les)) {
+				/*
+				 * It's not a match.
+				 *
+				 * It's still possible we only differ by whitespace.
+				 * Does it match if we treat any whitespace as a single
+				 * whitespace match token?
+				 */
+
+				if (fixdiff_wscmp(in_stz + 1, lt - 1 - (size_t)let,
+						  in_src, ls - (size_t)les))
+					goto record_breakage;
+
+				/*
+				 * Just note where it is for now, most candidates
+				 * don't work out
+				 */
+
+				if (fixdiff_wsf_add(pdp, tl - 1, sl))
+					return -1;
+				goto allow_match_ws;
+
+record_breakage:
+				if (mc + 1 > lmc) {
+					stain_copy(f1, in_stz + 1, lt - 1, sizeof(f1));
+					stain_copy(f2, in_src, ls, sizeof(f2));
+				}
+				mc = 0;
+				break;
+			}
+
+allow_match_ws:
+			mc++;
+			if (mc > lmc) {
+				stain_copy(b1, in_stz + 1, lt - 1, sizeof(b1));
+				stain_copy(b2, in_src, ls, sizeof(b2));
+				lmc++;
+				lg_lis = lis;
+			}
+		}
+
+		if (hit)
+			break;
+
+		if (hi < nh)
+			lis = hint[hi++];
+		else if (resume != -2) {
+			lis = resume;
+			resume = -2;
+		} else
+			lis = fixdiff_candidate(pdp, sf, &pr, &an, lis);
+	}
+
+	/*
+	 * If we are allowed to, see what we can do with a few edits before
+	 * giving up
+	 */
+
+	if (!hit && pdp->o->fuzz && !streamed) {
+		int r = fixdiff_fuzzy_find(pdp, sf, &pr, &lis, &sl);
+
+		if (r < 0) {
+			elog(pdp, "OOM\n");
+			return -1;
+		}
+		hit = (char)r;
+	}
+
+	if (!hit && streamed)
+		elog(pdp, "**** Failed to match in %s, streamed for --max-mem: "
+		     "first line patch = '%s'\n", pdp->pf, f1);
+	else if (!hit) {
+		elog(pdp, "**** Failed to match, best chunk %d lines started at %s:%d "
+		     "(tabs shown below as >)\n",
+		     lmc, pdp->pf, lg_lis);
+		elog(pdp, "last match: patch = '%s"
+		     "',         source = '%s'\n", b1, b2);
+		elog(pdp, "divergence: patch = '%s"
+		     "',         source = '%s'\n", f1, f2);
+	}
+
+	/*
+	 * We report the 1-based line number of the match... a "match" starting
+	 * after the last line is a failure
+	 */
+
+	if (hit && lis < sf->lines) {
+		int n;
+
+		ret = 0;
+		*line_start = base + lis + 1;
+		pdp->prev_end = base + sl;
+
+		if (pdp->o->cache && !cached && !streamed)
+			fixdiff_cache_store(pdp, key, lis, sl);
+
+		if (pdp->o->check) {
+			/* nothing is emitted, so the rest is only for output */
+			pdp->sts.ws_fuzz += (uint64_t)(pdp->wsf_count -
+						       pdp->fuzz_lines);
+			return 0;
+		}
+
+		if (pdp->cx_active < 3) {
+			int a = 0;
+
+			/*
+			 * Suspected patch at EOF
+			 *
+			 * It's fine if we can't add anything at end, it
+			 * means it was already correct.  Otherwise there are
+			 * actual lines in the sources that must be added to
+			 * the stanza as ' ' lines.
+			 */
+
+			while (pdp->cx_active < 3) {
+				line_ending_t lea;
+				char *p;
+
+				if (sl >= sf->lines)
+					break;
+
+				in_src = sf->buf + sf->lo[sl];
+				ls = sf->lo[sl + 1] - sf->lo[sl];
+				sl++;
+
+				lea = fixdiff_assess_eol(in_src, ls);
+
+				p = fixdiff_stanza_add(&pdp->st, 1 + ls - lea +
+							(lea != LE_ZERO));
+				if (!p) {
+					pdp->reason = "failed to add extra stanza "
+						      "trailer";
+					return 1;
+				}
+
+				*p = ' ';
+				memcpy(p + 1, in_src, ls - lea);
+				if (lea != LE_ZERO)
+					p[1 + ls - lea] = '\n';
+
+				pdp->pre++;
+				pdp->post++;
+				pdp->cx_active++;
+				a++;
+			}
+
+			if (a)
+				elog(pdp, "    stanza %d: detected patch at EOF: "
+						  "added %d context at end\n",
+					pdp->stanzas, a);
+		}
+
+		/*
+		 * Now we know the whitespace fixes we found are the ones we
+		 * want, index them by stanza line for the output.
+		 *
+		 * We have to take care about picking up windows _TEXT CRLF,
+		 * eliminating that if present and only putting the LF, so
+		 * rewritten lines are indistinguishable
+		 */
+
+		if (pdp->st.count > pdp->rw_alloc) {
+			rewrite_t *r1 = realloc(pdp->rw, (size_t)pdp->st.count *
+							 sizeof(*r1));
+
+			if (!r1) {
+				elog(pdp, "OOM\n");
+				return -1;
+			}
+			pdp->rw = r1;
+			pdp->rw_alloc = pdp->st.count;
+		}
+
+		pdp->rw_lines = pdp->st.count;
+		memset(pdp->rw, 0, (size_t)pdp->rw_lines * sizeof(*pdp->rw));
+
+		for (n = 0; n < pdp->wsf_count; n++) {
+			const ws_fix_t *w = &pdp->wsf[n];
+
+			in_src = sf->buf + sf->lo[w->sl];
+			ls = sf->lo[w->sl + 1] - sf->lo[w->sl];
+
+			pdp->rw[w->line].src = in_src;
+			pdp->rw[w->line].len = ls - fixdiff_assess_eol(in_src, ls);
+		}
+
+		if (streamed && fixdiff_stream_bake(pdp)) {
+			elog(pdp, "OOM\n");
+			return -1;
+		}
+
+		pdp->sts.ws_fuzz += (uint64_t)(pdp->wsf_count - pdp->fuzz_lines);
+
+		if (pdp->wsf_count > pdp->fuzz_lines)
+			elog(pdp, "    stanza %d: fixed %d lines with whitespace-only fuzz\n",
+			     pdp->stanzas, pdp->wsf_count - pdp->fuzz_lines);
+		if (pdp->fuzz_lines)
+			elog(pdp, "    stanza %d: fixed %d lines with %d edits of fuzz\n",
+			     pdp->stanzas, pdp->fuzz_lines, pdp->fuzz_edits);
+	}
+
+	return ret;
+}
+
+/*
+ * Exchange the stanza's buffers between a pipeline record and a dp, and copy
+ * its state into the record, or out of it
+ */
+
+static void
+fixdiff_prec_xfer(prec_t *r, dp_t *pdp, int to_rec)
+{
+	stanza_t st = r->st;
+	membuf_t mb = r->diag;
+	rewrite_t *rw = r->rw;
+	int ra = r->rw_alloc;
+
+	r->st = pdp->st;
+	pdp->st = st;
+	r->diag = pdp->diag;
+	pdp->diag = mb;
+	r->rw = pdp->rw;
+	pdp->rw = rw;
+	r->rw_alloc = pdp->rw_alloc;
+	pdp->rw_alloc = ra;
+
+	if (to_rec) {
+		r->rw_lines		= pdp->rw_lines;
+		r->reason		= pdp->reason;
+		r->pre			= pdp->pre;
+		r->post			= pdp->post;
+		r->lead_in		= pdp->lead_in;
+		r->lead_in_corrected	= pdp->lead_in_corrected;
+		r->sfirst		= pdp->sfirst;
+		r->stanzas		= pdp->stanzas;
+		r->file			= pdp->files;
+		r->cx_active		= pdp->cx_active;
+		r->seq			= pdp->seq;
+		r->seq_fh		= pdp->seq_fh;
+		memcpy(r->osh, pdp->osh, sizeof(r->osh));
+		memcpy(r->pf, pdp->pf, sizeof(r->pf));
+		memcpy(r->blob, pdp->blob, sizeof(r->blob));
+
+		return;
+	}
+
+	pdp->rw_lines		= r->rw_lines;
+	pdp->reason		= r->reason;
+	pdp->pre		= r->pre;
+	pdp->post		= r->post;
+	pdp->lead_in		= r->lead_in;
+	pdp->lead_in_corrected	= r->lead_in_corrected;
+	pdp->sfirst		= r->sfirst;
+	pdp->stanzas		= r->stanzas;
+	pdp->cx_active		= r->cx_active;
+	pdp->seq		= r->seq;
+	pdp->seq_fh		= r->seq_fh;
+	memcpy(pdp->osh, r->osh, sizeof(pdp->osh));
+	memcpy(pdp->pf, r->pf, sizeof(pdp->pf));
+	memcpy(pdp->blob, r->blob, sizeof(pdp->blob));
+}
+
+/*
+ * Fill r with the stanza that just ended, the patch text before it from out
+ * and the diagnostics before it.  in is the line that ended it.
+ */
+
+static int
+fixdiff_prec_put(prec_t *r, dp_t *pdp, membuf_t *out, const char *in,
+		 size_t l, int last)
+{
+	membuf_t mb = r->out;
+
+	r->out = *out;
+	*out = mb;
+	out->mem_len = 0;
+
+	fixdiff_prec_xfer(r, pdp, 1);
+	pdp->diag.mem_len = 0;
+
+	r->line.mem_len = 0;
+	if (l && fixdiff_membuf_add(&r->line, in, l)) {
+		pdp->reason = "OOM";
+		return 1;
+	}
+
+	r->li = pdp->lb.li;
+	r->orig = 0;
+	r->last = (char)last;
+
+	if (pdp->o->stats) {
+		fixdiff_stats_now(pdp, &r->sts);
+		fixdiff_stats_sub(&r->sts, &pdp->sts0);
+	}
+
+	pdp->ongoing = 0;
+
+	return 0;
+}
+
+#if defined(FIXDIFF_WITH_PTHREADS)
+
+/*
+ * The parser hands on the stanza it just finished, along with the patch text
+ * and diagnostics before it, waiting for a free record if the emitter is
+ * behind.  The last record has no stanza, just what was left at the end, and
+ * the parser's result.
+ */
+
+static int
+fixdiff_pipe_put(dp_t *pdp, const char *in, size_t l, int last, int ret)
+{
+	pipe_t *pp = pdp->pipe;
+	prec_t *r;
+	int stop;
+
+	if (fixdiff_out_flush(&pdp->out)) {
+		pdp->reason = "OOM";
+		return 1;
+	}
+
+	pthread_mutex_lock(&pp->lock);
+	while (!pp->abort && pp->parsed - pp->emitted == FIXDIFF_PIPE_DEPTH)
+		pthread_cond_wait(&pp->cond, &pp->lock);
+	stop = pp->abort;
+	r = &pp->rec[pp->parsed % FIXDIFF_PIPE_DEPTH];
+	pthread_mutex_unlock(&pp->lock);
+
+	if (stop) {
+		pdp->reason = "pipeline stopped";
+		return 1;
+	}
+
+	/* nobody else looks at the record until we count it as parsed */
+
+	if (fixdiff_prec_put(r, pdp, &pdp->jout, in, l, last))
+		return 1;
+
+	r->ret = ret;
+	r->done = (char)last;
+
+	pthread_mutex_lock(&pp->lock);
+	pp->parsed++;
+	if (last)
+		pp->parse_done = 1;
+	pthread_cond_broadcast(&pp->cond);
+	pthread_mutex_unlock(&pp->lock);
+
+	return 0;
+}
+
+#endif
+
+/*
+ * Add to the patched file, starting a new line first if the last thing we
+ * added was the source's last line without an EOL
+ */
+
+static int
+fixdiff_apply_add(apply_t *a, const char *p, size_t len)
+{
+	if (a->mb.mem_len && a->mb.mem[a->mb.mem_len - 1] != '\n' &&
+	    fixdiff_membuf_add(&a->mb, "\n", 1))
+		return 1;
+
+	return fixdiff_membuf_add(&a->mb, p, len);
+}
+
+/*
+ * Copy the source lines up to, but not including, line to
+ */
+
+static int
+fixdiff_apply_src(apply_t *a, int to)
+{
+	const srcfile_t *sf = a->sf;
+
+	if (to > a->line &&
+	    fixdiff_apply_add(a, sf->buf + sf->lo[a->line],
+			      sf->lo[to] - sf->lo[a->line]))
+		return 1;
+
+	a->line = to;
+
+	return 0;
+}
+
+/*
+ * Splice the stanza we just emitted into its file, at the placement we found
+ * for it.  The ' ' lines come from the source, so any whitespace or fuzz
+ * fixes are the same as in the fixed patch.
+ */
+
+static int
+fixdiff_apply_stanza(dp_t *pdp, int orig)
+{
+	apply_t *a = pdp->ap;
+	int n, at;
+
+	if (!a || a->file != pdp->files) {
+		if (a && fixdiff_apply_src(a, a->sf->lines))
+			goto oom;
+
+		a = calloc(1, sizeof(*a));
+		if (!a)
+			goto oom;
+		a->next = pdp->ap;
+		pdp->ap = a;
+		a->file = pdp->files;
+		memcpy(a->want, pdp->blob[1], sizeof(a->want));
+		memcpy(a->pf, pdp->pf, sizeof(a->pf));
+
+		a->sf = fixdiff_source(pdp);
+		if (!a->sf) {
+			pdp->reason = "unable to load source to apply to";
+			return 1;
+		}
+	}
+
+	/* a stanza with no old lines goes after the line its header names */
+
+	at = pdp->pre ? orig - 1 : orig;
+	if (at > a->sf->lines)
+		at = a->sf->lines;
+
+	if (at < a->line) {
+		elog(pdp, "    stanza %d: overlaps the one before it\n",
+		     pdp->stanzas);
+		pdp->reason = "can't apply overlapping stanzas";
+		return 1;
+	}
+
+	if (fixdiff_apply_src(a, at))
+		goto oom;
+
+	for (n = pdp->sfirst; n < pdp->st.count; n++) {
+		size_t l;
+		const char *p = fixdiff_stanza_line(&pdp->st, n, &l);
+
+		if (p[0] == '+') {
+			if (l > 1 && fixdiff_apply_add(a, p + 1, l - 1))
+				goto oom;
+			continue;
+		}
+
+		if (a->line == a->sf->lines) {
+			pdp->reason = "stanza runs past end of source";
+			return 1;
+		}
+
+		if (p[0] == '-')
+			a->line++;
+		else
+			if (fixdiff_apply_src(a, a->line + 1))
+				goto oom;
+	}
+
+	return 0;
+
+oom:
+	pdp->reason = "OOM";
+
+	return 1;
+}
+
+/*
+ * Find where the stanza goes in the source, 1-based in *orig
+ */
+
+static int
+fixdiff_stanza_match(dp_t *pdp, int *orig)
+{
+	uint64_t t = 0;
+	int n;
+
+	*orig = 0;
+
+	if (pdp->o->stats)
+		t = fixdiff_now_ns();
+
+	n = fixdiff_find_original(pdp, orig);
+
+	if (pdp->o->stats)
+		pdp->sts.search_ns += fixdiff_now_ns() - t;
+
+	if (n) {
+		elog(pdp, "Unable to find original stanza in source\n");
+		pdp->reason = "Original stanza format problem";
+		*orig = 0;
+	}
+
+	return n;
+}
+
+/*
+ * Issue the stanza with a corrected header, given where it was placed, or
+ * fail if orig is 0 because it couldn't be
+ */
+
+static int
+fixdiff_stanza_emit(dp_t *pdp, int orig)
+{
+	uint64_t t = 0;
+	char buf[256];
+	int nope = 0, n;
+
+	if (pdp->o->stats)
+		t = fixdiff_now_ns();
+
+	if (pdp->o->check) {
+		pdp->ongoing = 0;
+
+		if (!orig) {
+			chklog(pdp->ctx, pdp, "%s: stanza %d: can't be placed\n",
+			       pdp->pf, pdp->stanzas);
+			pdp->reason = "stanza can't be placed";
+			pdp->failed++;
+			nope = !pdp->o->check_all;
+			goto done;
+		}
+
+		chklog(pdp->ctx, pdp, "%s: stanza %d: line %d\n", pdp->pf,
+		       pdp->stanzas, orig);
+		pdp->delta += pdp->post - pdp->pre;
+		goto done;
+	}
+
+	if (!orig) {
+		nope = 1;
+		goto done;
+	}
+
+	/* let's create a stanza header with our computed numbers in */
+
+	if (strlen(pdp->osh) < 8 ||
+	    pdp->osh[0] != '@' ||
+	    pdp->osh[1] != '@' ||
+	    pdp->osh[2] != ' ' ||
+	    pdp->osh[3] != '-')
+		goto probs;
+
+	/* record length of lead-out context */
+	pdp->lead_out = pdp->cx_active;
+
+	/* We don't use anything from the original header. */
+
+	snprintf(buf, sizeof(buf) - 1, "@@ -%d,%d +%d,%d @@\n",
+		 orig, pdp->pre, orig + pdp->delta, pdp->post);
+
+	/* is that what we already had? */
+
+	if (strcmp(buf, pdp->osh)) {
+		elog(pdp, "  - stanza %d: %s", pdp->stanzas, buf);
+		pdp->bad++;
+	}
+
+	if (fixdiff_out_copy(&pdp->out, buf, strlen(buf))) {
+		pdp->reason = "failed to write stanza header to stdout";
+		nope = 1;
+		goto done;
+	}
+
+	/* dump the stanza arena into stdout */
+
+	for (n = pdp->sfirst; n < pdp->st.count; n++) {
+		const char *buf;
+		size_t l;
+		int r;
+
+		buf = fixdiff_stanza_line(&pdp->st, n, &l);
+
+		if (n < pdp->rw_lines && pdp->rw[n].src)
+			/* the diff char, then the source line with just LF */
+			r = fixdiff_out_ref(&pdp->out, buf, 1) ||
+			    fixdiff_out_ref(&pdp->out, pdp->rw[n].src,
+					    pdp->rw[n].len) ||
+			    fixdiff_out_ref(&pdp->out, "\n", 1);
+		else
+			r = fixdiff_out_ref(&pdp->out, buf, l);
+
+		if (r) {
+			pdp->reason = "failed to write to stdout";
+			nope = 1;
+			break;
+		}
+
+		pdp->li_out++;
+	}
+
+	/* the batch refers to the source and the arena, so flush it now */
+
+	if (!nope && fixdiff_out_flush(&pdp->out)) {
+		pdp->reason = "failed to write to stdout";
+		nope = 1;
+	}
+
+	if (!nope && pdp->apply && fixdiff_apply_stanza(pdp, orig))
+		nope = 1;
+
+	if (!nope) {
+		/* track the effect stanza changes are having on line offsets */
+		pdp->delta += pdp->post - pdp->pre;
+
+		pdp->ongoing = 0;
+	}
+
+	goto done;
+
+probs:
+	pdp->reason = "Original stanza format problem";
+	nope = 1;
+
+done:
+	if (pdp->o->placements && !nope && orig)
+		fixdiff_mbprintf(&pdp->placed, "%016llx %08x %d %s\n",
+				 (unsigned long long)pdp->seq,
+				 (unsigned int)pdp->seq_fh, orig, pdp->pf);
+
+	if (pdp->o->stats) {
+		pdp->sts.emit_ns += fixdiff_now_ns() - t;
+		fixdiff_stats_stanza(pdp, nope ? 0 : orig);
+	}
+
+	return nope;
+}
+
+/*
+ * Without the pipeline, the stanzas for a streamed source are held until the
+ * patch moves on from the file, so that one pass over it can place them all,
+ * see fixdiff_stream_group().  The patch text and diagnostics after each are
+ * held with it, and fixdiff_release() issues it all in order.
+ */
+
+static int
+fixdiff_holding(dp_t *pdp)
+{
+	const srcfile_t *sf;
+
+	if (pdp->holds)
+		return 1;
+	if (!pdp->o->max_mem || pdp->apply)
+		return 0;
+
+	sf = fixdiff_source(pdp);
+
+	return sf && sf->stream;
+}
+
+static prec_t *
+fixdiff_hold_rec(dp_t *pdp)
+{
+	if (pdp->holds == pdp->hold_alloc) {
+		int na = pdp->hold_alloc ? pdp->hold_alloc * 2 : 8;
+		prec_t *r1 = realloc(pdp->hold, (size_t)na * sizeof(*r1));
+
+		if (!r1)
+			return NULL;
+		memset(r1 + pdp->hold_alloc, 0,
+		       (size_t)(na - pdp->hold_alloc) * sizeof(*r1));
+		pdp->hold = r1;
+		pdp->hold_alloc = na;
+	}
+
+	return &pdp->hold[pdp->holds];
+}
+
+static int
+fixdiff_hold(dp_t *pdp, const char *in, size_t l)
+{
+	membuf_t mb;
+	prec_t *r;
+
+	/* the pass must compare the lines the placing will */
+	fixdiff_stanza_trim(pdp);
+
+	if (fixdiff_out_flush(&pdp->out)) {
+		pdp->reason = "failed to write to stdout";
+		return 1;
+	}
+
+	if (!pdp->holds) {
+		/* what comes after goes with the stanzas until they're issued */
+		pdp->hold_sink = pdp->out.sink;
+		pdp->out.sink.cb = NULL;
+		pdp->out.sink.mb = &pdp->hold_out;
+		pdp->out.sink.fd = -1;
+		pdp->hold_collect = pdp->collect_diag;
+		pdp->collect_diag = 1;
+		mb = pdp->diag;
+		pdp->diag = pdp->hold_diag;
+		pdp->hold_diag = mb;
+	}
+
+	r = fixdiff_hold_rec(pdp);
+	if (!r) {
+		pdp->reason = "OOM";
+		return 1;
+	}
+	if (fixdiff_prec_put(r, pdp, &pdp->hold_out, in, l, 0))
+		return 1;
+	pdp->holds++;
+
+	return 0;
+}
+
+/*
+ * Diagnostics from before go where ours go now
+ */
+
+static int
+fixdiff_diag_add(dp_t *pdp, membuf_t *mb)
+{
+	int r = 0;
+
+	if (mb->mem_len)
+		r = pdp->collect_diag ?
+			fixdiff_membuf_add(&pdp->diag, mb->mem, mb->mem_len) :
+			fixdiff_sink_write(&pdp->ctx->diag, mb->mem,
+					   mb->mem_len);
+	mb->mem_len = 0;
+
+	return r;
+}
+
+/*
+ * Issue the held stanzas and what came after each.  If one can't be placed,
+ * the fix stops there like it would have without holding it, after saying
+ * why like fixdiff_process() would have.
+ */
+
+static int
+fixdiff_release(dp_t *pdp)
+{
+	int stanzas = pdp->stanzas, group = 0, ret, orig, n;
+	const char *reason = pdp->reason;
+	const srcfile_t *sf;
+	membuf_t mb;
+	prec_t *r;
+
+	if (!pdp->holds)
+		return 0;
+
+	/* the last record is just what came after the last stanza */
+
+	r = fixdiff_hold_rec(pdp);
+	ret = !r || fixdiff_out_flush(&pdp->out) ||
+	      fixdiff_prec_put(r, pdp, &pdp->hold_out, "", 0, 1);
+
+	pdp->out.sink = pdp->hold_sink;
+	pdp->collect_diag = pdp->hold_collect;
+	mb = pdp->diag;
+	pdp->diag = pdp->hold_diag;
+	pdp->hold_diag = mb;
+	pdp->hold_diag.mem_len = 0;
+
+	if (ret) {
+		pdp->holds = 0;
+		elog(pdp, "OOM\n");
+		return 1;
+	}
+
+	for (n = 0; n <= pdp->holds; n++) {
+		r = &pdp->hold[n];
+
+		if (fixdiff_diag_add(pdp, &r->diag) ||
+		    (r->out.mem_len &&
+		     fixdiff_out_ref(&pdp->out, r->out.mem, r->out.mem_len))) {
+			elog(pdp, "write to stdout failed: %d\n", errno);
+			ret = 1;
+			break;
+		}
+
+		if (r->last)
+			break;
+
+		fixdiff_prec_xfer(r, pdp, 0);
+		if (pdp->o->stats) {
+			/* the stanza's share so far is counted already */
+			fixdiff_stats_now(pdp, &pdp->sts0);
+			fixdiff_stats_sub(&pdp->sts0, &r->sts);
+		}
+
+		if (!n) {
+			/* they all have this one's source */
+			sf = fixdiff_source(pdp);
+			group = pdp->holds > 1 && sf && sf->stream &&
+				!fixdiff_sscan_alloc(pdp, pdp->holds);
+			if (group)
+				fixdiff_stream_group(pdp, sf);
+		}
+
+		pdp->sscan = group ? &pdp->ss[n] : NULL;
+		fixdiff_stanza_match(pdp, &orig);
+		ret = fixdiff_stanza_emit(pdp, orig);
+		pdp->sscan = NULL;
+		fixdiff_prec_xfer(r, pdp, 1);
+
+		if (fixdiff_diag_add(pdp, &r->diag)) {
+			pdp->reason = "OOM";
+			ret = 1;
+		}
+
+		if (ret) {
+			elog(pdp, "line %d: fatal exit: %s: %.*s\n", r->li,
+			     pdp->reason, (int)r->line.mem_len,
+			     r->line.mem ? r->line.mem : "");
+			break;
+		}
+	}
+
+	if (fixdiff_out_flush(&pdp->out) && !ret) {
+		elog(pdp, "write to stdout failed: %d\n", errno);
+		ret = 1;
+	}
+
+	pdp->holds = 0;
+
+	if (!ret) {
+		pdp->stanzas = stanzas;
+		pdp->reason = reason;
+	}
+
+	return ret;
+}
+
+/*
+ * in is the line that ended the stanza, or empty at EOF
+ */
+
+static int
+fixdiff_stanza_end(dp_t *pdp, const char *in, size_t l)
+{
+	int orig;
+
+	if (!pdp->ongoing)
+		return 0;
+
+	if (!pdp->have_seen_delta) {
+		pdp->ongoing = 0;
+		elog(pdp, "  - stanza %d: (filtered out due to no delta inside)\n", pdp->stanzas);
+
+		return 0;
+	}
+
+	if (pdp->pending_empty_lines)
+		elog(pdp, "    stanza %d: Dropped %d unexpected empty lines\n", pdp->stanzas, pdp->pending_empty_lines);
+
+#if defined(FIXDIFF_WITH_PTHREADS)
+	/* the pipeline's matchers and emitter do the rest */
+	if (pdp->pipe)
+		return fixdiff_pipe_put(pdp, in, l, 0, 0);
+#endif
+
+	if (fixdiff_holding(pdp))
+		return fixdiff_hold(pdp, in, l);
+
+	fixdiff_stanza_match(pdp, &orig);
+
+	return fixdiff_stanza_emit(pdp, orig);
+}
+
+/*
+ * From a git "index <old>..<new> <mode>" line, the old and new blob ids, or
+ * "" for either that isn't there, or is all zeros as for a new or deleted file
+ */
+
+static size_t
+fixdiff_index_id(char *id, const char *in, size_t l)
+{
+	size_t n = 0;
+
+	id[0] = '\0';
+
+	while (n < l && n < FIXDIFF_GIT_HEX - 1 &&
+	       strchr("0123456789abcdef", in[n]) && in[n])
+		n++;
+
+	if (n >= 4 && strspn(in, "0") < n) {
+		memcpy(id, in, n);
+		id[n] = '\0';
+	}
+
+	return n;
+}
+
+static void
+fixdiff_index_blob(char blob[2][FIXDIFF_GIT_HEX], const char *in, size_t l)
+{
+	size_t n = 6 + fixdiff_index_id(blob[0], in + 6, l - 6);
+
+	blob[1][0] = '\0';
+
+	if (n + 1 >= l || in[n] != '.' || in[n + 1] != '.') {
+		blob[0][0] = '\0';
+		return;
+	}
+
+	fixdiff_index_id(blob[1], in + n + 2, l - n - 2);
+}
+
+/*
+ * Run the diff state machine over the lines from pdp->lb until EOF
+ */
+
+static int
+fixdiff_process(dp_t *pdp)
+{
+	const char *in = "", *reason;
+	size_t l = 0;
+
+	while (1) {
+		in = fixdiff_get_line(&pdp->lb, &l);
+		pdp->sts.bytes += l;
+
+		if (!l) {
+			if (fixdiff_stanza_end(pdp, in, l))
+				goto bail;
+			if (fixdiff_release(pdp))
+				goto quit;
+			break;
+		}
+
+		switch (pdp->d) {
+		case DSS_WAIT_MMM:
+			if (l > 6 && !strncmp(in, "index ", 6))
+				fixdiff_index_blob(pdp->idx, in, l);
+			if (l < 4)
+				break;
+			if (in[0] == '-' &&
+			    in[1] == '-' &&
+			    in[2] == '-' &&
+			    in[3] == ' ')
+				pdp->d = DSS_MUST_PPP;
+			break;
+
+		case DSS_MUST_PPP:
+			if (l < 4)
+				break;
+			if (in[0] == '+' &&
+			    in[1] == '+' &&
+			    in[2] == '+' &&
+			    in[3] == ' ') {
+				size_t n = 4, pl;
+				int sl = 1;
+				char *p;
+
+				/* the last file's held stanzas go out first */
+				if (fixdiff_release(pdp))
+					goto quit;
+
+				while (sl && n < l) {
+					while (n < l && in[n] != '/')
+						n++;
+					if (n == l)
+						goto bail;
+					n++;
+					if (n == l)
+						goto bail;
+					sl--;
+				}
+
+				pl = l - n;
+				if (pl > sizeof(pdp->pf) - 1)
+					pl = sizeof(pdp->pf) - 1;
+				memcpy(pdp->pf, in + n, pl);
+				pdp->pf[pl] = '\0';
+				p = strchr(pdp->pf, '\n');
+				if (p)
+					*p = '\0';
+
+				elog(pdp, "Filepath: %s\n", pdp->pf);
+				pdp->prev_end = -1;
+				pdp->delta = 0;
+				pdp->files++;
+				memcpy(pdp->blob, pdp->idx, sizeof(pdp->blob));
+				memset(pdp->idx, 0, sizeof(pdp->idx));
+
+				pdp->d = DSS_MUST_AA;
+				break;
+			}
+
+			pdp->reason = "+++ required but not found";
+			goto bail;
+
+		case DSS_MUST_AA:
+			if (l < 3) {
+				pdp->reason = "@@ required but line too short";
+				goto bail;
+			}
+			if (in[0] == '@' &&
+			    in[1] == '@' &&
+			    in[2] == ' ') {
+				if (fixdiff_stanza_start(pdp, in, l))
+					goto bail;
+				pdp->d = DSS_PMSAD;
+				break;
+			}
+
+			pdp->reason = "@@ required but mssing";
+			goto bail; /* MUST have been AA */
+
+		case DSS_AA_OR_MMM:
+			if (l < 4)
+				break;
+			if (in[0] == '-' &&
+			    in[1] == '-' &&
+			    in[2] == '-' &&
+			    in[3] == ' ') {
+				pdp->d = DSS_MUST_PPP;
+				break;
+			}
+
+			if (in[0] == '@' &&
+			    in[1] == '@' &&
+			    in[2] == ' ') {
+				if (fixdiff_stanza_start(pdp, in, l))
+					goto bail;
+				break;
+			}
+			break;
+
+		case DSS_PMSAD:
+			if (l < 1) {
+				pdp->reason = "blank line in stanza";
+				goto bail;
+			}
+
+			/*
+			 * Blank lines before the --- of the next file are not
+			 * part of this stanza
+			 */
+
+			if (pdp->pending_empty_lines &&
+			    (in[0] == ' ' || in[0] == '-' || in[0] == '+') &&
+			    !(l > 4 && !strncmp(in, "--- ", 4))) {
+				char ctx[3];
+
+				elog(pdp, "    stanza %d: Treating %d unexpected newline(s) as context\n",
+					pdp->stanzas, pdp->pending_empty_lines);
+
+				ctx[0] = ' ';
+				ctx[1] = '\n';
+				ctx[2] = '\0';
+
+				while (pdp->pending_empty_lines > 0) {
+					pdp->pending_empty_lines--;
+					pdp->pre++;
+					pdp->post++;
+					if (pdp->lead_in_active)
+						pdp->lead_in++;
+					pdp->cx_active++;
+
+					if (fixdiff_out(pdp, ctx, 2)) {
+						elog(pdp, "write to stdout failed: %d\n", errno);
+						goto bail;
+					}
+				}
+			}
+
+			if (in[0] == ' ') { /* Space */
+				pdp->pre++;
+				pdp->post++;
+				if (pdp->lead_in_active)
+					pdp->lead_in++;
+				pdp->cx_active++;
+				break;
+			} else
+				if (in[0] == '-') { /* Minus */
+
+					if (l > 4 && in[0] == '-' &&
+						     in[1] == '-' &&
+						     in[2] == '-' &&
+						     in[3] == ' ') {
+						pdp->d = DSS_MUST_PPP;
+						if (fixdiff_stanza_end(pdp, in, l))
+							goto bail;
+						break;
+					}
+
+					pdp->pre++;
+					pdp->lead_in_active = 0;
+					pdp->cx_active = 0;
+					pdp->have_seen_delta = 1;
+					break;
+				} else
+					if (in[0] == '+') { /* Plus */
+
+						size_t l1 = 1;
+
+						/*
+						 * Since we're adding the line, let's look closely
+						 * to see if it's only whitespace, in which case we
+						 * can collapse it to just be the EOL pieces if any
+						 */
+
+						while (l1 < l) {
+							if (in[l1] != 0x20 && in[l1] != 0x09)
+								break;
+							l1++;
+						}
+
+						if (l1 == l) { /* line was only whitespace with no EOL */
+							pdp->skip_this_one =1;
+							break;
+						}
+
+						if (l1 > 1 && in[l1] == 0x0d && (l - l1) == 2 && in[l1 + 1] == 0x0a) {
+							in = "+\r\n";
+							l = 3;
+							elog(pdp, "    stanza %d: Reducing %u char whitespace-only "
+								"line to CRLF\n", pdp->stanzas, (unsigned int)l1);
+						} else
+							if (l1 > 1 && in[l1] == 0x0a && (l - l1) == 1) {
+								in = "+\n";
+								l = 2;
+								elog(pdp, "    stanza %d: Reducing %d char whitespace-only"
+									" line to LF\n", pdp->stanzas, (unsigned int)l1);
+							}
+
+						pdp->post++;
+						pdp->lead_in_active = 0;
+						pdp->cx_active = 0;
+						pdp->have_seen_delta = 1;
+						break;
+					}
+
+			if (l > 5 &&
+			    in[0] == 'd' &&
+			    in[1] == 'i' &&
+			    in[2] == 'f' &&
+			    in[3] == 'f' &&
+			    in[4] == ' ') { /* Diff */
+				if (fixdiff_stanza_end(pdp, in, l))
+					goto bail;
+				pdp->d = DSS_WAIT_MMM;
+				break;
+			}
+
+			if (l > 3 &&
+			    in[0] == '@' &&
+			    in[1] == '@' &&
+			    in[2] == ' ') { /* At */
+				if (fixdiff_stanza_end(pdp, in, l))
+					goto bail;
+				if (fixdiff_stanza_start(pdp, in, l))
+					goto bail;
+				break;
+			}
+
+			if (in[0] == 0xa) {
+				/*
+				 * We can find this blank diff line illegally generated by the LLM:
+				 *
+				 * 1) from extra lines at diff EOT, maybe the user
+				 *    picked them up from screenscraping too (tests/4)
+				 * 2) because there was an empty line there,
+				 *    but the LLM did not prepend it with a
+				 *    character indicating what action to
+				 *    take with it (tests/7)
+				 *
+				 * We can distinguish what to (for these cases anyway) by waiting
+				 * to see if there are any more lines in the stanza that have the
+				 * +/-/space, if not, just drop the CR-only line
+				 */
+
+				pdp->pending_empty_lines++;
+				continue;
+			}
+
+			elog(pdp, "'%c' (0x%x)\n", in[0], in[0]);
+			pdp->reason = "unexpected character in stanza";
+			goto bail;
+		} /* switch */
+
+		if (pdp->skip_this_one) {
+			pdp->skip_this_one = 0;
+			continue;
+		}
+
+		if (fixdiff_out(pdp, in, l)) {
+			elog(pdp, "write to stdout failed: %d\n", errno);
+			goto bail;
+		}
+	}
+
+	if (fixdiff_out_flush(&pdp->out)) {
+		elog(pdp, "write to stdout failed: %d\n", errno);
+		goto bail;
+	}
+
+	return 0;
+
+bail:
+	reason = pdp->reason;
+	if (fixdiff_release(pdp))
+		goto quit;
+	pdp->reason = reason;
+
+	fixdiff_out_flush(&pdp->out);
+	elog(pdp, "line %d: fatal exit: %s: %.*s\n", pdp->lb.li, pdp->reason,
+		  (int)l, in);
+
+	return 1;
+
+quit:
+	fixdiff_out_flush(&pdp->out);
+
+	return 1;
+}
+
+
+static void
+fixdiff_dp_init(dp_t *pdp, fixdiff_t *ctx)
+{
+	memset(pdp, 0, sizeof(*pdp));
+
+	init_lbuf(&pdp->lb, "stdin");
+	pdp->reason = "unknown";
+	pdp->d = DSS_WAIT_MMM;
+	pdp->out.sink = ctx->out;
+	pdp->li_out = 1;
+	pdp->prev_end = -1;
+	pdp->ctx = ctx;
+	pdp->sc = &ctx->sc;
+	pdp->o = &ctx->o;
+	pdp->apply = ctx->o.apply;
+}
+
+static void
+fixdiff_dp_destroy(dp_t *pdp)
+{
+	int n;
+
+	free(pdp->st.buf);
+	free(pdp->st.sl);
+	free(pdp->jout.mem);
+	free(pdp->diag.mem);
+	free(pdp->wsf);
+	free(pdp->rw);
+	free(pdp->fz);
+	free(pdp->fzs);
+	for (n = 0; n < pdp->ss_alloc; n++) {
+		free(pdp->ss[n].win.buf);
+		free(pdp->ss[n].win.lo);
+		free(pdp->ss[n].cl);
+		free(pdp->ss[n].hit);
+	}
+	free(pdp->ss);
+	free(pdp->sbuf);
+	free(pdp->ring);
+	for (n = 0; n < pdp->hold_alloc; n++) {
+		free(pdp->hold[n].st.buf);
+		free(pdp->hold[n].st.sl);
+		free(pdp->hold[n].out.mem);
+		free(pdp->hold[n].diag.mem);
+		free(pdp->hold[n].line.mem);
+		free(pdp->hold[n].rw);
+	}
+	free(pdp->hold);
+	free(pdp->hold_out.mem);
+	free(pdp->hold_diag.mem);
+	free(pdp->stats.mem);
+	free(pdp->placed.mem);
+	fixdiff_lbuf_destroy(&pdp->lb);
+
+	while (pdp->ap) {
+		apply_t *a = pdp->ap;
+
+		pdp->ap = a->next;
+		free(a->mb.mem);
+		free(a);
+	}
+}
+
+/*
+ * Move the files the dp patched onto the end of the context's list, in the
+ * order they were in the patch
+ */
+
+static void
+fixdiff_apply_collect(fixdiff_t *ctx, dp_t *pdp)
+{
+	while (pdp->ap) {
+		apply_t *a = pdp->ap;
+
+		pdp->ap = a->next;
+		a->next = *ctx->applied_tail;
+		*ctx->applied_tail = a;
+	}
+
+	while (*ctx->applied_tail)
+		ctx->applied_tail = &(*ctx->applied_tail)->next;
+}
+
+/*
+ * Add where the dp's stanzas went to what fixdiff_placements() gives
+ */
+
+static void
+fixdiff_placed_collect(fixdiff_t *ctx, const dp_t *pdp)
+{
+	if (pdp->placed.mem_len)
+		fixdiff_membuf_add(&ctx->placed_mb, pdp->placed.mem,
+				   pdp->placed.mem_len);
+}
+
+/*
+ * Fix one job's worth of the input, collecting its output and diagnostics
+ */
+
+static void
+fixdiff_job_run(job_t *job, fixdiff_t *ctx)
+{
+	dp_t *pdp = malloc(sizeof(*pdp));
+
+	job->pdp = pdp;
+	job->ret = 1;
+	if (!pdp)
+		return;
+
+	fixdiff_dp_init(pdp, ctx);
+	fixdiff_lbuf_mem(&pdp->lb, job->in, job->len);
+	pdp->lb.li = job->line_base;
+	pdp->stanzas = job->stanza_base;
+	memcpy(pdp->idx, job->idx, sizeof(pdp->idx));
+	pdp->out.sink.cb = NULL;
+	pdp->out.sink.mb = &pdp->jout;
+	pdp->out.sink.fd = -1;
+	pdp->collect_diag = 1;
+
+	job->ret = fixdiff_process(pdp);
+}
+
+#if defined(FIXDIFF_WITH_PTHREADS)
+static void *
+fixdiff_job_thread(void *arg)
+{
+	jobq_t *jq = (jobq_t *)arg;
+
+	while (1) {
+		int n;
+
+		LOCK(&jq->lock);
+		n = jq->next++;
+		UNLOCK(&jq->lock);
+
+		if (n >= jq->count)
+			break;
+
+		fixdiff_job_run(&jq->jobs[n], jq->ctx);
+	}
+
+	return NULL;
+}
+#endif
+
+/*
+ * Split the input into one job per target file, starting each job at a ---
+ * line followed by a +++ line.  Fix the jobs on a pool of threads, then issue
+ * each job's diagnostics and output in the original order.
+ */
+
+static int
+fixdiff_jobs(fixdiff_t *ctx, const char *in, size_t len, fixdiff_result_t *res)
+{
+	int n, stanzas = 0, bad = 0, failed = 0, lines = 0, ret = 0, nj;
+	size_t pos = 0, prev = 0;
+	jobq_t jq;
+
+	memset(&jq, 0, sizeof(jq));
+	jq.ctx = ctx;
+
+	while (pos < len) {
+		const char *p = in + pos, *nl = fixdiff_scan_nl(p, len - pos);
+		size_t next = nl ? (size_t)(nl - in) + 1 : len;
+
+		if (!jq.count || (next - pos > 4 && !strncmp(p, "--- ", 4) &&
+				  len - next > 4 && !strncmp(in + next, "+++ ", 4))) {
+			if (!(jq.count & 15)) {
+				job_t *j1 = realloc(jq.jobs, (size_t)(jq.count + 16) *
+								sizeof(*j1));
+				if (!j1)
+					goto oom;
+				jq.jobs = j1;
+			}
+
+			memset(&jq.jobs[jq.count], 0, sizeof(jq.jobs[0]));
+
+			/* git's index line for the file is just before it */
+
+			if (pos - prev > 6 && !strncmp(in + prev, "index ", 6))
+				fixdiff_index_blob(jq.jobs[jq.count].idx,
+						   in + prev, pos - prev);
+			jq.jobs[jq.count].in = p;
+			jq.jobs[jq.count].line_base = lines;
+			jq.jobs[jq.count++].stanza_base = stanzas;
+		}
+
+		if (next - pos > 2 && !strncmp(p, "@@ ", 3))
+			stanzas++;
+
+		jq.jobs[jq.count - 1].len += next - pos;
+		lines++;
+		prev = pos;
+		pos = next;
+	}
+
+	nj = ctx->o.jobs < jq.count ? ctx->o.jobs : jq.count;
+
+#if defined(FIXDIFF_WITH_PTHREADS)
+	{
+		pthread_t *th = calloc((size_t)nj, sizeof(*th));
+
+		if (!th)
+			goto oom;
+
+		LOCK_INIT(&jq.lock);
+
+		/* this thread also works on the queue */
+
+		for (n = 1; n < nj; n++)
+			if (pthread_create(&th[n], NULL, fixdiff_job_thread, &jq))
+				break;
+		nj = n;
+		fixdiff_job_thread(&jq);
+		for (n = 1; n < nj; n++)
+			pthread_join(th[n], NULL);
+
+		LOCK_DESTROY(&jq.lock);
+		free(th);
+	}
+#else
+	(void)nj;
+	for (n = 0; n < jq.count; n++)
+		fixdiff_job_run(&jq.jobs[n], ctx);
+#endif
+
+	stanzas = 0;
+
+	for (n = 0; n < jq.count; n++) {
+		dp_t *pdp = jq.jobs[n].pdp;
+
+		if (!pdp) {
+			ctxlog(ctx, "OOM\n");
+			ret = 1;
+			break;
+		}
+
+		if (fixdiff_sink_write(&ctx->diag, pdp->diag.mem,
+				       pdp->diag.mem_len) ||
+		    fixdiff_sink_write(&ctx->out, pdp->jout.mem,
+				       pdp->jout.mem_len)) {
+			ctxlog(ctx, "write to stdout failed: %d\n", errno);
+			ret = 1;
+			break;
+		}
+
+		stanzas = pdp->stanzas;
+		bad += pdp->bad;
+		failed += pdp->failed;
+
+		if (jq.jobs[n].ret) {
+			if (res)
+				res->reason = pdp->reason;
+			ret = 1;
+			break;
+		}
+	}
+
+	if (!ret)
+		ctxlog(ctx, "Completed: %d / %d stanza headers repaired\n",
+			bad, stanzas);
+
+	if (res) {
+		res->stanzas = stanzas;
+		res->repaired = bad;
+		res->failed = failed;
+	}
+
+	for (n = 0; n < jq.count; n++)
+		if (jq.jobs[n].pdp) {
+			if (ctx->o.stats)
+				fixdiff_stats_dp(ctx, jq.jobs[n].pdp);
+			fixdiff_apply_collect(ctx, jq.jobs[n].pdp);
+			fixdiff_placed_collect(ctx, jq.jobs[n].pdp);
+			fixdiff_dp_destroy(jq.jobs[n].pdp);
+			free(jq.jobs[n].pdp);
+		}
+	free(jq.jobs);
+
+	return ret;
+
+oom:
+	ctxlog(ctx, "OOM\n");
+	free(jq.jobs);
+
+	return 1;
+}
+
+#if defined(FIXDIFF_WITH_PTHREADS)
+
+static void *
+fixdiff_pipe_parse(void *arg)
+{
+	dp_t *pdp = (dp_t *)arg;
+
+	fixdiff_pipe_put(pdp, "", 0, 1, fixdiff_process(pdp));
+
+	return NULL;
+}
+
+/*
+ * Matchers take the parsed records in order and place them.  With --nearest,
+ * where a stanza goes depends on where the last one in the file went, so
+ * there is only one matcher then.
+ */
+
+static void *
+fixdiff_pipe_match(void *arg)
+{
+	pipe_t *pp = (pipe_t *)arg;
+	dp_t *pdp = malloc(sizeof(*pdp));
+	stats_t s0, s1;
+	prec_t *r;
+
+	if (!pdp) {
+		pthread_mutex_lock(&pp->lock);
+		pp->abort = 1;
+		pthread_cond_broadcast(&pp->cond);
+		pthread_mutex_unlock(&pp->lock);
+
+		return NULL;
+	}
+
+	fixdiff_dp_init(pdp, pp->ctx);
+	pdp->collect_diag = 1;
+
+	while (1) {
+		pthread_mutex_lock(&pp->lock);
+		while (!pp->abort && pp->matching == pp->parsed &&
+		       !pp->parse_done)
+			pthread_cond_wait(&pp->cond, &pp->lock);
+		if (pp->abort || pp->matching == pp->parsed) {
+			pthread_mutex_unlock(&pp->lock);
+			break;
+		}
+		r = &pp->rec[pp->matching++ % FIXDIFF_PIPE_DEPTH];
+		pthread_mutex_unlock(&pp->lock);
+
+		if (r->last)
+			continue;
+
+		if (r->file != pdp->files) {
+			pdp->files = r->file;
+			pdp->prev_end = -1;
+		}
+
+		fixdiff_prec_xfer(r, pdp, 0);
+		fixdiff_stats_now(pdp, &s0);
+		r->ret = fixdiff_stanza_match(pdp, &r->orig);
+		fixdiff_stats_now(pdp, &s1);
+		fixdiff_prec_xfer(r, pdp, 1);
+
+		fixdiff_stats_sub(&s1, &s0);
+		fixdiff_stats_add(&r->sts, &s1);
+
+		pthread_mutex_lock(&pp->lock);
+		r->done = 1;
+		pthread_cond_broadcast(&pp->cond);
+		pthread_mutex_unlock(&pp->lock);
+	}
+
+	fixdiff_stats_now(pdp, &s1);
+
+	pthread_mutex_lock(&pp->lock);
+	fixdiff_stats_add(&pp->sts, &s1);
+	pthread_mutex_unlock(&pp->lock);
+
+	fixdiff_dp_destroy(pdp);
+	free(pdp);
+
+	return NULL;
+}
+
+/*
+ * A parser thread turns the input into stanza records, matcher threads place
+ * them, and this thread emits them in order as they become ready, so the
+ * output starts before the input has all arrived.  If a stanza can't be
+ * fixed, we stop there like the other ways... but the parser may be waiting
+ * for more input, and we have to wait for that to arrive before we can return.
+ */
+
+static int
+fixdiff_pipeline(fixdiff_t *ctx, lbuf_t *plb, fixdiff_result_t *res)
+{
+	int n, nm = ctx->o.nearest ? 1 : ctx->o.jobs, ret = 1, stanzas = 0,
+	    parsing = 0;
+	const char *reason = "OOM";
+	dp_t *pdp = NULL, *edp = NULL;
+	pthread_t pt, *mt;
+	pipe_t *pp;
+
+	pp = calloc(1, sizeof(*pp));
+	mt = calloc((size_t)nm, sizeof(*mt));
+	pdp = malloc(sizeof(*pdp));
+	edp = malloc(sizeof(*edp));
+	if (!pp || !mt || !pdp || !edp) {
+		ctxlog(ctx, "OOM\n");
+		free(pp);
+		free(mt);
+		free(pdp);
+		free(edp);
+		res->reason = reason;
+
+		return 1;
+	}
+
+	fixdiff_dp_init(pdp, ctx);
+	pdp->lb = *plb;
+	init_lbuf(plb, plb->name); /* pdp->lb owns anything it had now */
+	pdp->out.sink.cb = NULL;
+	pdp->out.sink.mb = &pdp->jout;
+	pdp->out.sink.fd = -1;
+	pdp->collect_diag = 1;
+	pdp->pipe = pp;
+
+	/* we are the emitter */
+
+	fixdiff_dp_init(edp, ctx);
+
+	pp->ctx = ctx;
+	pthread_mutex_init(&pp->lock, NULL);
+	pthread_cond_init(&pp->cond, NULL);
+
+	for (n = 0; n < nm; n++)
+		if (pthread_create(&mt[n], NULL, fixdiff_pipe_match, pp))
+			break;
+	nm = n;
+
+	if (!nm || pthread_create(&pt, NULL, fixdiff_pipe_parse, pdp)) {
+		ctxlog(ctx, "Unable to start pipeline\n");
+		reason = "unable to start threads";
+		goto stop;
+	}
+	parsing = 1;
+
+	while (1) {
+		prec_t *r;
+		int stop;
+
+		pthread_mutex_lock(&pp->lock);
+		while (!pp->abort && (pp->emitted == pp->parsed ||
+		       !pp->rec[pp->emitted % FIXDIFF_PIPE_DEPTH].done))
+			pthread_cond_wait(&pp->cond, &pp->lock);
+		stop = pp->abort;
+		r = &pp->rec[pp->emitted % FIXDIFF_PIPE_DEPTH];
+		pthread_mutex_unlock(&pp->lock);
+
+		if (stop) {
+			/* a matcher couldn't start */
+			ctxlog(ctx, "OOM\n");
+			ret = 1;
+			break;
+		}
+
+		stanzas = r->stanzas;
+
+		if ((r->diag.mem_len &&
+		     fixdiff_sink_write(&ctx->diag, r->diag.mem,
+					r->diag.mem_len)) ||
+		    (r->out.mem_len &&
+		     fixdiff_out_ref(&edp->out, r->out.mem, r->out.mem_len))) {
+			ctxlog(ctx, "write to stdout failed: %d\n", errno);
+			reason = "failed to write to stdout";
+			ret = 1;
+			break;
+		}
+
+		if (!r->last) {
+			if (r->file != edp->files) {
+				edp->files = r->file;
+				edp->delta = 0;
+			}
+
+			fixdiff_prec_xfer(r, edp, 0);
+			if (ctx->o.stats) {
+				/* the stanza's share so far is counted already */
+				fixdiff_stats_now(edp, &edp->sts0);
+				fixdiff_stats_sub(&edp->sts0, &r->sts);
+			}
+			ret = fixdiff_stanza_emit(edp, r->ret ? 0 : r->orig);
+			reason = edp->reason;
+			fixdiff_prec_xfer(r, edp, 1);
+		} else {
+			ret = r->ret;
+			reason = r->reason;
+		}
+
+		if (fixdiff_out_flush(&edp->out)) {
+			ctxlog(ctx, "write to stdout failed: %d\n", errno);
+			reason = "failed to write to stdout";
+			ret = 1;
+			break;
+		}
+
+		if (ret && !r->last)
+			elog(edp, "line %d: fatal exit: %s: %.*s\n", r->li,
+			     reason, (int)r->line.mem_len,
+			     r->line.mem ? r->line.mem : "");
+
+		if (ret || r->last)
+			break;
+
+		pthread_mutex_lock(&pp->lock);
+		r->done = 0;
+		pp->emitted++;
+		pthread_cond_broadcast(&pp->cond);
+		pthread_mutex_unlock(&pp->lock);
+	}
+
+stop:
+	/* if we didn't get to the end, the others stop at their next wait */
+
+	pthread_mutex_lock(&pp->lock);
+	pp->abort = 1;
+	pthread_cond_broadcast(&pp->cond);
+	pthread_mutex_unlock(&pp->lock);
+
+	if (parsing)
+		pthread_join(pt, NULL);
+	for (n = 0; n < nm; n++)
+		pthread_join(mt[n], NULL);
+
+	if (!ret)
+		elog(edp, "Completed: %d / %d stanza headers repaired\n",
+		     edp->bad, stanzas);
+
+	res->stanzas = stanzas;
+	res->repaired = edp->bad;
+	res->failed = edp->failed;
+	if (ret)
+		res->reason = reason;
+
+	if (ctx->o.stats) {
+		fixdiff_stats_dp(ctx, edp);
+		fixdiff_stats_dp(ctx, pdp);
+		fixdiff_stats_add(&ctx->sts, &pp->sts);
+	}
+	fixdiff_apply_collect(ctx, edp);
+	fixdiff_placed_collect(ctx, edp);
+
+	for (n = 0; n < FIXDIFF_PIPE_DEPTH; n++) {
+		free(pp->rec[n].st.buf);
+		free(pp->rec[n].st.sl);
+		free(pp->rec[n].out.mem);
+		free(pp->rec[n].diag.mem);
+		free(pp->rec[n].line.mem);
+		free(pp->rec[n].rw);
+	}
+
+	pthread_cond_destroy(&pp->cond);
+	pthread_mutex_destroy(&pp->lock);
+	fixdiff_dp_destroy(pdp);
+	fixdiff_dp_destroy(edp);
+	free(pdp);
+	free(edp);
+	free(mt);
+	free(pp);
+
+	return ret;
+}
+
+#endif
+
+fixdiff_t *
+fixdiff_create(const fixdiff_info_t *info)
+{
+	fixdiff_t *ctx = calloc(1, sizeof(*ctx));
+
+	if (!ctx)
+		return NULL;
+
+	ctx->i = *info;
+
+	ctx->o.nearest = !!(info->flags & FIXDIFF_FLAG_NEAREST);
+	ctx->o.stats = !!(info->flags & FIXDIFF_FLAG_STATS);
+#if defined(FIXDIFF_WITH_PTHREADS)
+	ctx->o.pipeline = !!(info->flags & FIXDIFF_FLAG_PIPELINE);
+#endif
+	ctx->o.check = !!(info->flags & (FIXDIFF_FLAG_CHECK |
+					  FIXDIFF_FLAG_CHECK_ALL));
+	ctx->o.check_all = !!(info->flags & FIXDIFF_FLAG_CHECK_ALL);
+	/* a check changes nothing */
+	ctx->o.apply = !ctx->o.check && (info->flags & FIXDIFF_FLAG_APPLY);
+	ctx->o.verify = !!(info->flags & FIXDIFF_FLAG_VERIFY);
+	ctx->o.jobs = info->jobs > 1 ? info->jobs : 1;
+	ctx->o.fuzz = info->fuzz > 0 ? info->fuzz : 0;
+	ctx->o.placements = !!(info->flags & FIXDIFF_FLAG_PLACEMENTS);
+	ctx->o.max_mem = info->max_mem;
+
+	/* if we can't make the cache dir, we just don't cache */
+
+	if (info->cache_dir && !fixdiff_cache_mkdir(info->cache_dir))
+		ctx->o.cache = info->cache_dir;
+	ctx->o.cache_max = info->cache_max ? info->cache_max :
+					     FIXDIFF_CACHE_DEFAULT_MAX;
+
+	ctx->sc.root = info->root;
+	ctx->sc.git_rev = info->git_rev;
+	ctx->sc.max_mem = info->max_mem;
+	ctx->sc.keep = !!(info->flags & FIXDIFF_FLAG_KEEP_SOURCES);
+	ctx->sc.ifd = -1;
+#if defined(__linux__)
+	if (ctx->sc.keep)
+		ctx->sc.ifd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+#endif
+	LOCK_INIT(&ctx->sc.lock);
+	LOCK_INIT(&ctx->sc.git_lock);
+
+	ctx->applied_tail = &ctx->applied;
+
+	ctx->out.cb = info->out;
+	ctx->out.opaque = info->opaque;
+	ctx->out.mb = &ctx->out_mb;
+	ctx->out.fd = info->flags & FIXDIFF_FLAG_STDOUT ? 1 : -1;
+
+	ctx->diag.cb = info->diag;
+	ctx->diag.opaque = info->opaque;
+	ctx->diag.mb = &ctx->diag_mb;
+	ctx->diag.fd = info->flags & FIXDIFF_FLAG_STDERR ? 2 : -1;
+
+	return ctx;
+}
+
+void
+fixdiff_destroy(fixdiff_t **pctx)
+{
+	fixdiff_t *ctx = *pctx;
+
+	if (!ctx)
+		return;
+
+	fixdiff_srcfiles_destroy(&ctx->sc);
+	if (ctx->sc.ifd >= 0)
+		close(ctx->sc.ifd);
+	LOCK_DESTROY(&ctx->sc.lock);
+	fixdiff_git_destroy(&ctx->sc.git);
+	LOCK_DESTROY(&ctx->sc.git_lock);
+	free(ctx->out_mb.mem);
+	free(ctx->diag_mb.mem);
+	free(ctx->stats_mb.mem);
+	free(ctx->placed_mb.mem);
+	free(ctx->prev);
+	free(ctx->prev_buf);
+	free(ctx);
+
+	*pctx = NULL;
+}
+
+/*
+ * Finish the patched file and write it next to the original, in a temp file
+ */
+
+static int
+fixdiff_apply_write(fixdiff_t *ctx, apply_t *a)
+{
+	char id[41];
+	int fd, r;
+#if !defined(WIN32)
+	struct stat s;
+#endif
+
+	if (fixdiff_apply_src(a, a->sf->lines)) {
+		ctxlog(ctx, "OOM\n");
+		return 1;
+	}
+
+	if (ctx->o.verify) {
+		fixdiff_git_blob_id(a->mb.mem ? a->mb.mem : "", a->mb.mem_len,
+				    id);
+		if (!a->want[0] || strncmp(id, a->want, strlen(a->want))) {
+			ctxlog(ctx, "%s: patched blob %s, index line says %s\n",
+			       a->pf, id, a->want[0] ? a->want : "nothing");
+			return 1;
+		}
+	}
+
+	if (ctx->sc.root)
+		r = snprintf(a->path, sizeof(a->path), "%s/%s", ctx->sc.root,
+			     a->pf);
+	else
+		r = snprintf(a->path, sizeof(a->path), "%s", a->pf);
+	if (r < 0 || (size_t)r >= sizeof(a->path)) {
+		ctxlog(ctx, "%s: path too long\n", a->pf);
+		a->path[0] = '\0';
+		return 1;
+	}
+	snprintf(a->tmp, sizeof(a->tmp), "%s.fixdiff-XXXXXX", a->path);
+
+#if defined(WIN32)
+	fd = -1;
+	if (!_mktemp_s(a->tmp, strlen(a->tmp) + 1))
+		fd = open(a->tmp, OFLAGS(O_CREAT | O_EXCL | O_WRONLY), 0644);
+#else
+	fd = mkstemp(a->tmp);
+	/* keep the original's permissions */
+	if (fd >= 0 && !stat(a->path, &s))
+		fchmod(fd, s.st_mode & 07777);
+#endif
+	if (fd < 0) {
+		ctxlog(ctx, "Unable to create temp file for %s: %d\n",
+		       a->path, errno);
+		a->tmp[0] = '\0';
+		return 1;
+	}
+
+	r = fixdiff_write_all(fd, a->mb.mem, a->mb.mem_len);
+#if !defined(WIN32)
+	r = r || fsync(fd);
+#endif
+	if (close(fd))
+		r = 1;
+	if (r) {
+		ctxlog(ctx, "Unable to write %s: %d\n", a->tmp, errno);
+		remove(a->tmp);
+		a->tmp[0] = '\0';
+	}
+
+	return r;
+}
+
+/*
+ * Another name for an existing file, and moving a file over another
+ */
+
+static int
+fixdiff_hardlink(const char *from, const char *to)
+{
+#if defined(WIN32)
+	return !CreateHardLinkA(to, from, NULL);
+#else
+	return link(from, to);
+#endif
+}
+
+static int
+fixdiff_replace(const char *from, const char *to)
+{
+#if defined(WIN32)
+	return !MoveFileExA(from, to, MOVEFILE_REPLACE_EXISTING);
+#else
+	return rename(from, to);
+#endif
+}
+
+/*
+ * If the whole patch was fixed, write all the patched files to temp files,
+ * and if that worked, rename them over the originals.  Each original is hard
+ * linked beside it first, so if replacing any fails, the ones already
+ * replaced are put back and nothing is changed.  The patched files are freed
+ * either way.
+ */
+
+static int
+fixdiff_apply_commit(fixdiff_t *ctx, int ret, fixdiff_result_t *res)
+{
+	apply_t *a, *a1;
+
+	for (a = ctx->applied; a && !ret; a = a->next) {
+		for (a1 = ctx->applied; a1 != a; a1 = a1->next)
+			if (!strcmp(a1->pf, a->pf)) {
+				ctxlog(ctx, "%s is patched more than once\n",
+				       a->pf);
+				res->reason = "can't apply a file twice";
+				ret = 1;
+				break;
+			}
+
+		if (!ret && fixdiff_apply_write(ctx, a)) {
+			res->reason = "unable to write patched file";
+			ret = 1;
+		}
+	}
+
+	for (a = ctx->applied; a && !ret; a = a->next) {
+		snprintf(a->bak, sizeof(a->bak), "%s.orig", a->tmp);
+		if (fixdiff_hardlink(a->path, a->bak)) {
+			ctxlog(ctx, "Unable to keep the original %s: %d\n",
+			       a->path, errno);
+			res->reason = "unable to replace patched file";
+			a->bak[0] = '\0';
+			ret = 1;
+		}
+	}
+
+	for (a = ctx->applied; a && !ret; a = a->next) {
+		if (fixdiff_replace(a->tmp, a->path)) {
+			ctxlog(ctx, "Unable to replace %s: %d\n", a->path,
+			       errno);
+			res->reason = "unable to replace patched file";
+			ret = 1;
+			break;
+		}
+		a->tmp[0] = '\0';
+		a->replaced = 1;
+	}
+
+	for (a = ctx->applied; a; a = a->next) {
+		if (a->tmp[0])
+			remove(a->tmp);
+
+		if (ret && a->replaced) {
+			if (fixdiff_replace(a->bak, a->path)) {
+				/* the original is still there by its other name */
+				ctxlog(ctx, "Unable to restore %s, the original "
+					    "is %s: %d\n", a->path, a->bak, errno);
+				continue;
+			}
+			a->bak[0] = '\0';
+		}
+
+		if (a->bak[0])
+			remove(a->bak);
+
+		if (!ret)
+			ctxlog(ctx, "Applied: %s\n", a->path);
+	}
+
+	while (ctx->applied) {
+		a = ctx->applied;
+		ctx->applied = a->next;
+		free(a->mb.mem);
+		free(a);
+	}
+	ctx->applied_tail = &ctx->applied;
+
+	return ret;
+}
+
+/*
+ * If we added to the placement cache, keep it within its size
+ */
+
+static void
+fixdiff_cache_done(fixdiff_t *ctx)
+{
+	if (!ctx->o.cache || !ctx->sc.cache_put)
+		return;
+
+	ctx->sc.cache_put = 0;
+	fixdiff_cache_trim(ctx->o.cache, ctx->o.cache_max);
+}
+
+/*
+ * Fix whatever input the lbuf has been pointed at
+ */
+
+static int
+fixdiff_fix_lbuf(fixdiff_t *ctx, lbuf_t *plb, fixdiff_result_t *res)
+{
+	fixdiff_result_t lres;
+	dp_t *pdp;
+	int ret;
+
+	if (!res)
+		res = &lres;
+	memset(res, 0, sizeof(*res));
+
+	ctx->out_mb.mem_len = 0;
+	ctx->diag_mb.mem_len = 0;
+	if (ctx->o.stats)
+		fixdiff_stats_begin(ctx);
+	if (ctx->o.placements) {
+		ctx->placed_mb.mem_len = 0;
+		fixdiff_mbprintf(&ctx->placed_mb, "fixdiff-placements 1\n");
+	}
+
+	if (ctx->sc.git_rev && fixdiff_git_pin(ctx)) {
+		res->reason = "unable to read git revision";
+		ret = 1;
+		goto done;
+	}
+
+	if (ctx->sc.keep)
+		fixdiff_srcfiles_validate(&ctx->sc);
+
+#if defined(FIXDIFF_WITH_PTHREADS)
+	if (ctx->o.pipeline) {
+		ret = fixdiff_pipeline(ctx, plb, res);
+		goto done;
+	}
+#endif
+
+	if (ctx->o.jobs > 1) {
+		/*
+		 * We need all of the input in memory to split it into jobs...
+		 * if it's mapped we already have it, otherwise read it all
+		 */
+
+		while (!plb->eof)
+			fixdiff_lbuf_fill(plb);
+		if (plb->err) {
+			ctxlog(ctx, "Unable to read stdin: %d\n", plb->err);
+			ret = 1;
+		} else
+			ret = fixdiff_jobs(ctx, plb->p ? plb->p + plb->pos : "",
+					   plb->len - plb->pos, res);
+		goto done;
+	}
+
+	pdp = malloc(sizeof(*pdp));
+	if (!pdp) {
+		ctxlog(ctx, "OOM\n");
+		ret = 1;
+		goto done;
+	}
+
+	fixdiff_dp_init(pdp, ctx);
+	pdp->lb = *plb;
+	init_lbuf(plb, plb->name); /* pdp->lb owns anything it had now */
+
+	ret = fixdiff_process(pdp);
+	if (!ret)
+		elog(pdp, "Completed: %d / %d stanza headers repaired\n",
+			pdp->bad, pdp->stanzas);
+
+	res->stanzas = pdp->stanzas;
+	res->repaired = pdp->bad;
+	res->failed = pdp->failed;
+	if (ret)
+		res->reason = pdp->reason;
+
+	if (ctx->o.stats)
+		fixdiff_stats_dp(ctx, pdp);
+	fixdiff_apply_collect(ctx, pdp);
+	fixdiff_placed_collect(ctx, pdp);
+
+	fixdiff_dp_destroy(pdp);
+	free(pdp);
+
+done:
+	if (ctx->o.apply)
+		ret = fixdiff_apply_commit(ctx, ret, res);
+
+	if (ctx->o.check) {
+		if (!ret && res->failed) {
+			ret = 1;
+			res->reason = "stanzas that can't be placed";
+		}
+		chklog(ctx, NULL, "Check: %d / %d stanzas placed%s%s\n",
+		       res->stanzas - res->failed, res->stanzas,
+		       ret ? ", failed: " : "", ret ? res->reason : "");
+	}
+
+	res->ret = ret;
+	fixdiff_cache_done(ctx);
+	if (ctx->o.stats) {
+		/* reading it all in for the jobs */
+		ctx->sts.syscalls += plb->nsys;
+		fixdiff_stats_end(ctx, res);
+	}
+	fixdiff_lbuf_destroy(plb);
+
+	/* unless we're watching them, the sources may change before next time */
+	if (!ctx->sc.keep)
+		fixdiff_srcfiles_destroy(&ctx->sc);
+
+	return ret;
+}
+
+int
+fixdiff_fix_buf(fixdiff_t *ctx, const char *buf, size_t len,
+		fixdiff_result_t *res)
+{
+	lbuf_t lb;
+
+	init_lbuf(&lb, "input");
+	fixdiff_lbuf_mem(&lb, buf, len);
+
+	return fixdiff_fix_lbuf(ctx, &lb, res);
+}
+
+int
+fixdiff_fix_fd(fixdiff_t *ctx, int fd, fixdiff_result_t *res)
+{
+	lbuf_t lb;
+
+	init_lbuf(&lb, "stdin");
+	fixdiff_lbuf_fd(&lb, fd);
+
+	return fixdiff_fix_lbuf(ctx, &lb, res);
+}
+
+/*
+ * Batches fix a list of patch files on a pool of threads, sharing the source
+ * cache.  Each thread takes the next patch from the queue when it finishes
+ * one, and the queue has the biggest patches first, so a big one found late
+ * doesn't leave the other threads idle while it's done.
+ */
+
+typedef struct {
+	off_t			size;
+	int			idx;
+} batchent_t;
+
+typedef struct {
+	const char * const	*paths;
+	fixdiff_result_t	*res;
+	membuf_t		*diag; /* for each patch */
+	batchent_t		*order;
+	fixdiff_t		*ctx;
+	lock_t			lock;
+	int			count;
+	int			next;
+} batchq_t;
+
+static int
+fixdiff_batch_cmp(const void *a, const void *b)
+{
+	const batchent_t *e1 = (const batchent_t *)a,
+			 *e2 = (const batchent_t *)b;
+
+	if (e1->size != e2->size)
+		return e1->size < e2->size ? 1 : -1;
+
+	return e1->idx - e2->idx;
+}
+
+/*
+ * Fix paths[idx] into paths[idx].fixed
+ */
+
+static void
+fixdiff_batch_one(batchq_t *bq, int idx)
+{
+	fixdiff_result_t *res = &bq->res[idx];
+	int fd, ofd = -1;
+	char path[1024];
+	dp_t *pdp;
+
+	res->ret = 1;
+	res->reason = "OOM";
+
+	pdp = malloc(sizeof(*pdp));
+	if (!pdp)
+		return;
+
+	fixdiff_dp_init(pdp, bq->ctx);
+	pdp->collect_diag = 1;
+	pdp->apply = 0; /* batches only write the .fixed patches */
+
+	fd = open(bq->paths[idx], OFLAGS(O_RDONLY));
+	if (fd < 0) {
+		res->reason = "unable to open patch";
+		goto bail;
+	}
+
+	snprintf(path, sizeof(path), "%s.fixed", bq->paths[idx]);
+	ofd = open(path, OFLAGS(O_CREAT | O_TRUNC | O_WRONLY), 0644);
+	if (ofd < 0) {
+		res->reason = "unable to create .fixed";
+		goto bail;
+	}
+
+	fixdiff_lbuf_fd(&pdp->lb, fd);
+	pdp->out.sink.cb = NULL;
+	pdp->out.sink.fd = ofd;
+
+	res->ret = fixdiff_process(pdp);
+	res->reason = res->ret ? pdp->reason : NULL;
+	res->stanzas = pdp->stanzas;
+	res->repaired = pdp->bad;
+
+	if (res->ret) {
+		/* keep the diagnostics to issue later */
+		bq->diag[idx] = pdp->diag;
+		memset(&pdp->diag, 0, sizeof(pdp->diag));
+	}
+
+bail:
+	if (ofd >= 0)
+		close(ofd);
+	if (fd >= 0)
+		close(fd);
+	fixdiff_dp_destroy(pdp);
+	free(pdp);
+}
+
+#if defined(FIXDIFF_WITH_PTHREADS)
+static void *
+fixdiff_batch_thread(void *arg)
+{
+	batchq_t *bq = (batchq_t *)arg;
+
+	while (1) {
+		int n;
+
+		LOCK(&bq->lock);
+		n = bq->next++;
+		UNLOCK(&bq->lock);
+
+		if (n >= bq->count)
+			break;
+
+		fixdiff_batch_one(bq, bq->order[n].idx);
+	}
+
+	return NULL;
+}
+#endif
+
+int
+fixdiff_fix_files(fixdiff_t *ctx, const char * const *paths, int count,
+		  fixdiff_result_t *res)
+{
+	int n, fails = 0, nj;
+	batchq_t bq;
+
+	memset(&bq, 0, sizeof(bq));
+	memset(res, 0, (size_t)count * sizeof(*res));
+	bq.paths = paths;
+	bq.res = res;
+	bq.ctx = ctx;
+	bq.count = count;
+
+	ctx->out_mb.mem_len = 0;
+	ctx->diag_mb.mem_len = 0;
+
+	/* a check is for one patch, from fixdiff_fix_buf() or _fd() */
+
+	if (ctx->o.check || (ctx->sc.git_rev && fixdiff_git_pin(ctx))) {
+		for (n = 0; n < count; n++) {
+			res[n].ret = 1;
+			res[n].reason = ctx->o.check ? "can't check a batch" :
+					"unable to read git revision";
+		}
+
+		return count;
+	}
+
+	bq.diag = calloc((size_t)count + 1, sizeof(*bq.diag));
+	bq.order = calloc((size_t)count + 1, sizeof(*bq.order));
+	if (!bq.diag || !bq.order) {
+		ctxlog(ctx, "OOM\n");
+		free(bq.diag);
+		free(bq.order);
+		return count;
+	}
+
+	if (ctx->sc.keep)
+		fixdiff_srcfiles_validate(&ctx->sc);
+
+	for (n = 0; n < count; n++) {
+		struct stat s;
+
+		bq.order[n].idx = n;
+		if (!stat(paths[n], &s))
+			bq.order[n].size = s.st_size;
+	}
+	qsort(bq.order, (size_t)count, sizeof(*bq.order), fixdiff_batch_cmp);
+
+	nj = ctx->o.jobs < count ? ctx->o.jobs : count;
+
+#if defined(FIXDIFF_WITH_PTHREADS)
+	{
+		pthread_t *th = calloc((size_t)nj + 1, sizeof(*th));
+
+		LOCK_INIT(&bq.lock);
+
+		/* this thread also works on the queue */
+
+		for (n = 1; th && n < nj; n++)
+			if (pthread_create(&th[n], NULL, fixdiff_batch_thread, &bq))
+				break;
+		nj = th ? n : 1;
+		fixdiff_batch_thread(&bq);
+		for (n = 1; n < nj; n++)
+			pthread_join(th[n], NULL);
+
+		LOCK_DESTROY(&bq.lock);
+		free(th);
+	}
+#else
+	(void)nj;
+	for (n = 0; n < count; n++)
+		fixdiff_batch_one(&bq, bq.order[n].idx);
+#endif
+
+	/* the diagnostics for the patches that failed, in the original order */
+
+	for (n = 0; n < count; n++) {
+		if (!res[n].ret)
+			continue;
+
+		fails++;
+		ctxlog(ctx, "%s: %s\n", paths[n], res[n].reason);
+		if (bq.diag[n].mem_len)
+			fixdiff_sink_write(&ctx->diag, bq.diag[n].mem,
+					   bq.diag[n].mem_len);
+		free(bq.diag[n].mem);
+	}
+
+	free(bq.diag);
+	free(bq.order);
+	fixdiff_cache_done(ctx);
+
+	if (!ctx->sc.keep)
+		fixdiff_srcfiles_destroy(&ctx->sc);
+
+	return fails;
+}
+
+const char *
+fixdiff_output(fixdiff_t *ctx, size_t *len)
+{
+	*len = ctx->out_mb.mem_len;
+
+	return ctx->out_mb.mem ? ctx->out_mb.mem : "";
+}
+
+const char *
+fixdiff_diagnostics(fixdiff_t *ctx, size_t *len)
+{
+	*len = ctx->diag_mb.mem_len;
+
+	return ctx->diag_mb.mem ? ctx->diag_mb.mem : "";
+}
+
+const char *
+fixdiff_stats(fixdiff_t *ctx, size_t *len)
+{
+	*len = ctx->stats_mb.mem_len;
+
+	return ctx->stats_mb.mem ? ctx->stats_mb.mem : "";
+}
+
+const char *
+fixdiff_placements(fixdiff_t *ctx, size_t *len)
+{
+	*len = ctx->placed_mb.mem_len;
+
+	return ctx->placed_mb.mem ? ctx->placed_mb.mem : "";
+}
+
+/*
+ * Each line after the header is "<seq> <fh> <line> <path>", the path going to
+ * the end of the line.  We keep a copy of it all, with the paths terminated
+ * in place.
+ */
+
+int
+fixdiff_previous(fixdiff_t *ctx, const char *buf, size_t len)
+{
+	static const char hdr[] = "fixdiff-placements 1\n";
+	unsigned long long seq;
+	unsigned int fh;
+	char *p, *e, *nl;
+	int n = 0, line, c;
+
+	free(ctx->prev);
+	free(ctx->prev_buf);
+	ctx->prev = NULL;
+	ctx->prev_buf = NULL;
+	ctx->prev_count = 0;
+
+	if (!len)
+		return 0;
+
+	/* it's text, a NUL means it isn't ours */
+
+	if (len < sizeof(hdr) - 1 || memcmp(buf, hdr, sizeof(hdr) - 1) ||
+	    memchr(buf, '\0', len))
+		return 1;
+
+	ctx->prev_buf = malloc(len + 1);
+	if (!ctx->prev_buf)
+		return 1;
+	memcpy(ctx->prev_buf, buf, len);
+	ctx->prev_buf[len] = '\0';
+
+	e = ctx->prev_buf + len;
+	for (p = ctx->prev_buf; (p = memchr(p, '\n', (size_t)(e - p))); p++)
+		n++;
+
+	ctx->prev = malloc((size_t)n * sizeof(*ctx->prev));
+	if (!ctx->prev)
+		goto bail;
+
+	p = ctx->prev_buf + sizeof(hdr) - 1;
+	while (p < e) {
+		prev_t *pv = &ctx->prev[ctx->prev_count];
+
+		nl = memchr(p, '\n', (size_t)(e - p));
+		if (!nl || ctx->prev_count >= n)
+			goto bail; /* truncated */
+		*nl = '\0';
+
+		c = 0;
+		if (sscanf(p, "%16llx %8x %d %n", &seq, &fh, &line, &c) != 3 ||
+		    !c || line < 1 || !p[c])
+			goto bail;
+
+		pv->seq = (uint64_t)seq;
+		pv->fh = (uint32_t)fh;
+		pv->line = line - 1;
+		pv->pf = p + c;
+		ctx->prev_count++;
+		p = nl + 1;
+	}
+
+	return 0;
+
+bail:
+	free(ctx->prev);
+	free(ctx->prev_buf);
+	ctx->prev = NULL;
+	ctx->prev_buf = NULL;
+	ctx->prev_count = 0;
+
+	return 1;
+}
@@ -0,0 +1,305 @@
+/*
+ * fixdiff - serving fixes over a unix socket
+ *
+ * Copyright (C) 2025 Andy Green <andy@warmcat.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ *
+ * The context keeps the sources loaded and indexed between requests, so a
+ * repeat fix against the same tree costs no file access at all.
+ */
+
+#if !defined(WIN32)
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/time.h>
+
+#include "serve.h"
+
+/*
+ * Clients are served one at a time, so one that stops sending or reading is
+ * dropped after this long, and one that sends too much is dropped too
+ */
+
+#define FIXDIFF_SERVE_TIMEOUT_S		30
+#define FIXDIFF_SERVE_MAX_REQUEST	(256 * 1024 * 1024)
+
+static volatile sig_atomic_t interrupted;
+
+static void
+sigterm(int sig)
+{
+	(void)sig;
+	interrupted = 1;
+}
+
+static int
+write_all(int fd, const char *buf, size_t len)
+{
+	while (len) {
+		ssize_t w = write(fd, buf, len);
+
+		if (w < 0) {
+			if (errno == EINTR)
+				continue;
+			return 1;
+		}
+		buf += w;
+		len -= (size_t)w;
+	}
+
+	return 0;
+}
+
+/*
+ * Read fd until EOF into a heap buffer, failing with EFBIG if there is more
+ * than max, if max is nonzero
+ */
+
+static char *
+read_all(int fd, size_t max, size_t *len)
+{
+	size_t alloc = 65536;
+	char *buf = malloc(alloc), *b1;
+
+	*len = 0;
+	if (!buf)
+		return NULL;
+
+	while (1) {
+		ssize_t r;
+
+		if (max && *len > max) {
+			errno = EFBIG;
+			goto bail;
+		}
+
+		if (*len == alloc) {
+			alloc *= 2;
+			if (max && alloc > max + 1)
+				alloc = max + 1;
+			b1 = realloc(buf, alloc);
+			if (!b1)
+				goto bail;
+			buf = b1;
+		}
+
+		r = read(fd, buf + *len, alloc - *len);
+		if (r < 0) {
+			if (errno == EINTR && !interrupted)
+				continue;
+			goto bail;
+		}
+		if (!r)
+			return buf;
+		*len += (size_t)r;
+	}
+
+bail:
+	free(buf);
+
+	return NULL;
+}
+
+static int
+sockaddr_set(struct sockaddr_un *sa, const char *path)
+{
+	memset(sa, 0, sizeof(*sa));
+	sa->sun_family = AF_UNIX;
+	if (strlen(path) >= sizeof(sa->sun_path)) {
+		fprintf(stderr, "socket path too long: %s\n", path);
+		return 1;
+	}
+	strcpy(sa->sun_path, path);
+
+	return 0;
+}
+
+int
+fixdiff_serve(fixdiff_t *ctx, const char *path)
+{
+	struct sockaddr_un sa;
+	struct sigaction sac;
+	struct stat s;
+	int fd;
+
+	if (sockaddr_set(&sa, path))
+		return 1;
+
+	/* a socket left by an earlier server is replaced, anything else isn't */
+
+	if (!lstat(path, &s)) {
+		if (!S_ISSOCK(s.st_mode)) {
+			fprintf(stderr, "%s exists and isn't a socket\n", path);
+			return 1;
+		}
+		unlink(path);
+	}
+
+	fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (fd < 0) {
+		fprintf(stderr, "socket failed: %d\n", errno);
+		return 1;
+	}
+
+	/* don't leak the sockets into anything we spawn, like git */
+	fcntl(fd, F_SETFD, FD_CLOEXEC);
+
+	if (bind(fd, (struct sockaddr *)&sa, sizeof(sa)) || listen(fd, 16)) {
+		fprintf(stderr, "unable to listen on %s: %d\n", path, errno);
+		close(fd);
+		return 1;
+	}
+
+	/* no SA_RESTART, so we drop out of accept() when told to stop */
+
+	memset(&sac, 0, sizeof(sac));
+	sac.sa_handler = sigterm;
+	sigaction(SIGINT, &sac, NULL);
+	sigaction(SIGTERM, &sac, NULL);
+	signal(SIGPIPE, SIG_IGN);
+
+	fprintf(stderr, "Serving on %s\n", path);
+
+	while (!interrupted) {
+		struct timeval tv = { FIXDIFF_SERVE_TIMEOUT_S, 0 };
+		const char *out, *diag;
+		size_t len, olen, dlen;
+		char hdr[64], *in;
+		int c, ret;
+
+		c = accept(fd, NULL, NULL);
+		if (c < 0) {
+			if (errno == EINTR || errno == ECONNABORTED)
+				continue;
+			fprintf(stderr, "accept failed: %d\n", errno);
+			break;
+		}
+		fcntl(c, F_SETFD, FD_CLOEXEC);
+		setsockopt(c, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+		setsockopt(c, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+
+		in = read_all(c, FIXDIFF_SERVE_MAX_REQUEST, &len);
+		if (!in) {
+			if (errno == EFBIG)
+				fprintf(stderr, "dropped a request over %dMB\n",
+					FIXDIFF_SERVE_MAX_REQUEST / (1024 * 1024));
+			else if (errno == EAGAIN || errno == EWOULDBLOCK)
+				fprintf(stderr, "dropped a stalled client\n");
+			close(c);
+			continue;
+		}
+
+		ret = fixdiff_fix_buf(ctx, in, len, NULL);
+		free(in);
+
+		out = fixdiff_output(ctx, &olen);
+		diag = fixdiff_diagnostics(ctx, &dlen);
+
+		snprintf(hdr, sizeof(hdr), "%d %lu %lu\n", ret,
+			 (unsigned long)olen, (unsigned long)dlen);
+
+		/* if the client went away, there's nothing to do about it */
+
+		if (!write_all(c, hdr, strlen(hdr)) &&
+		    !write_all(c, out, olen))
+			write_all(c, diag, dlen);
+
+		close(c);
+	}
+
+	close(fd);
+	unlink(path);
+
+	return 0;
+}
+
+int
+fixdiff_connect(const char *path)
+{
+	unsigned long olen, dlen;
+	struct sockaddr_un sa;
+	size_t len, hl = 0;
+	char *in, *p;
+	int fd, ret;
+
+	if (sockaddr_set(&sa, path))
+		return 1;
+
+	in = read_all(0, 0, &len);
+	if (!in) {
+		fprintf(stderr, "Unable to read stdin: %d\n", errno);
+		return 1;
+	}
+
+	signal(SIGPIPE, SIG_IGN);
+
+	fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (fd < 0 || connect(fd, (struct sockaddr *)&sa, sizeof(sa))) {
+		fprintf(stderr, "unable to connect to %s: %d\n", path, errno);
+		goto bail;
+	}
+
+	if (write_all(fd, in, len) || shutdown(fd, SHUT_WR)) {
+		fprintf(stderr, "unable to send to %s: %d\n", path, errno);
+		goto bail;
+	}
+	free(in);
+
+	in = read_all(fd, 0, &len);
+	close(fd);
+	fd = -1;
+
+	if (in) {
+		p = memchr(in, '\n', len);
+		if (p)
+			hl = (size_t)(p - in) + 1;
+	}
+	if (!hl || sscanf(in, "%d %lu %lu", &ret, &olen, &dlen) != 3 ||
+	    hl + olen + dlen != len) {
+		fprintf(stderr, "bad response from %s\n", path);
+		goto bail;
+	}
+
+	if (write_all(1, in + hl, olen) || write_all(2, in + hl + olen, dlen))
+		ret = 1;
+
+	free(in);
+
+	return ret;
+
+bail:
+	if (fd >= 0)
+		close(fd);
+	free(in);
+
+	return 1;
+}
+
+#endif
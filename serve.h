@@ -0,0 +1,53 @@
+/*
+ * fixdiff - serving fixes over a unix socket
+ *
+ * Copyright (C) 2025 Andy Green <andy@warmcat.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ *
+ * Each connection is one request.  The client sends the patch and shuts down
+ * its side for writing, the server replies with a line
+ *
+ *   <result> <output length> <diagnostics length>\n
+ *
+ * followed by the fixed patch and then the diagnostics, and closes.  result
+ * is 0 if the patch was fixed OK.
+ *
+ * A client that stalls for 30s, or sends over 256MB, is dropped without one.
+ */
+
+#if !defined(__FIXDIFF_SERVE_H__)
+#define __FIXDIFF_SERVE_H__
+
+#include "fixdiff.h"
+
+/*
+ * Serve fixes with ctx on a unix socket at path until SIGINT or SIGTERM
+ */
+int
+fixdiff_serve(fixdiff_t *ctx, const char *path);
+
+/*
+ * Send the patch on stdin to the server at path, and write what comes back to
+ * stdout and stderr.  Returns the server's result.
+ */
+int
+fixdiff_connect(const char *path);
+
+#endif
@@ -0,0 +1,380 @@
+/*
+ * fixdiff - line compare and newline scan kernels
+ *
+ * Copyright (C) 2025 Andy Green <andy@warmcat.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ *
+ * The SIMD versions are only built for x86 with gcc or clang, where we can
+ * select them at runtime according to what the cpu supports.  Everywhere else
+ * just uses the scalar versions.
+ */
+
+#include <string.h>
+#include <stdint.h>
+
+#include "simd.h"
+
+#if (defined(__x86_64__) || defined(__i386__)) && \
+    (defined(__GNUC__) || defined(__clang__))
+#define FIXDIFF_X86_SIMD
+#include <immintrin.h>
+#endif
+
+static size_t
+mismatch_scalar(const char *a, const char *b, size_t len)
+{
+	size_t n = 0;
+
+	while (n < len && a[n] == b[n])
+		n++;
+
+	return n;
+}
+
+static const char *
+scan_nl_scalar(const char *p, size_t len)
+{
+	return memchr(p, '\n', len);
+}
+
+#if defined(FIXDIFF_X86_SIMD)
+
+__attribute__((target("sse2")))
+static size_t
+mismatch_sse2(const char *a, const char *b, size_t len)
+{
+	size_t n = 0;
+
+	while (n + 16 <= len) {
+		__m128i x = _mm_loadu_si128((const __m128i *)(a + n)),
+			y = _mm_loadu_si128((const __m128i *)(b + n));
+		unsigned int m = (unsigned int)_mm_movemask_epi8(
+						_mm_cmpeq_epi8(x, y)) ^ 0xffffu;
+
+		if (m)
+			return n + (size_t)__builtin_ctz(m);
+		n += 16;
+	}
+
+	return n + mismatch_scalar(a + n, b + n, len - n);
+}
+
+__attribute__((target("sse2")))
+static const char *
+scan_nl_sse2(const char *p, size_t len)
+{
+	__m128i nl = _mm_set1_epi8('\n');
+	size_t n = 0;
+
+	while (n + 16 <= len) {
+		unsigned int m = (unsigned int)_mm_movemask_epi8(_mm_cmpeq_epi8(
+			_mm_loadu_si128((const __m128i *)(p + n)), nl));
+
+		if (m)
+			return p + n + __builtin_ctz(m);
+		n += 16;
+	}
+
+	return scan_nl_scalar(p + n, len - n);
+}
+
+__attribute__((target("avx2")))
+static size_t
+mismatch_avx2(const char *a, const char *b, size_t len)
+{
+	size_t n = 0;
+
+	while (n + 32 <= len) {
+		__m256i x = _mm256_loadu_si256((const __m256i *)(a + n)),
+			y = _mm256_loadu_si256((const __m256i *)(b + n));
+		unsigned int m = ~(unsigned int)_mm256_movemask_epi8(
+						_mm256_cmpeq_epi8(x, y));
+
+		if (m)
+			return n + (size_t)__builtin_ctz(m);
+		n += 32;
+	}
+
+	return n + mismatch_sse2(a + n, b + n, len - n);
+}
+
+__attribute__((target("avx2")))
+static const char *
+scan_nl_avx2(const char *p, size_t len)
+{
+	__m256i nl = _mm256_set1_epi8('\n');
+	size_t n = 0;
+
+	while (n + 32 <= len) {
+		unsigned int m = (unsigned int)_mm256_movemask_epi8(
+			_mm256_cmpeq_epi8(_mm256_loadu_si256(
+					(const __m256i *)(p + n)), nl));
+
+		if (m)
+			return p + n + __builtin_ctz(m);
+		n += 32;
+	}
+
+	return scan_nl_sse2(p + n, len - n);
+}
+
+const fixdiff_mismatch_t fixdiff_mismatch_impl[3] = {
+	mismatch_scalar, mismatch_sse2, mismatch_avx2
+};
+const fixdiff_scan_nl_t fixdiff_scan_nl_impl[3] = {
+	scan_nl_scalar, scan_nl_sse2, scan_nl_avx2
+};
+
+#else
+
+const fixdiff_mismatch_t fixdiff_mismatch_impl[3] = { mismatch_scalar };
+const fixdiff_scan_nl_t fixdiff_scan_nl_impl[3] = { scan_nl_scalar };
+
+#endif
+
+const char * const fixdiff_simd_impl_names[3] = { "scalar", "sse2", "avx2" };
+
+fixdiff_mismatch_t fixdiff_mismatch = mismatch_scalar;
+fixdiff_scan_nl_t fixdiff_scan_nl = scan_nl_scalar;
+
+int
+fixdiff_simd_impl_usable(int n)
+{
+	if (n < 0 || n > 2 || !fixdiff_mismatch_impl[n])
+		return 0;
+
+#if defined(FIXDIFF_X86_SIMD)
+	__builtin_cpu_init();
+
+	if (n == 1)
+		return __builtin_cpu_supports("sse2");
+	if (n == 2)
+		return __builtin_cpu_supports("avx2");
+#endif
+
+	return 1;
+}
+
+/*
+ * This runs once when we are loaded, so contexts on different threads never
+ * race to set the selected kernels
+ */
+
+#if defined(FIXDIFF_X86_SIMD)
+__attribute__((constructor))
+#endif
+void
+fixdiff_simd_init(void)
+{
+	int n = 2;
+
+	while (n && !fixdiff_simd_impl_usable(n))
+		n--;
+
+	fixdiff_mismatch = fixdiff_mismatch_impl[n];
+	fixdiff_scan_nl = fixdiff_scan_nl_impl[n];
+}
+
+/*
+ * This is the reference whitespace-fuzz compare the matcher has always used
+ */
+
+int
+fixdiff_wscmp_scalar(const char *p1, size_t l1, const char *p2, size_t l2)
+{
+	const char *p1_end = p1 + l1, *p2_end = p2 + l2;
+
+	/*
+	 * Let's trim back any trailing whitespace so that either source or
+	 * patch with it and the other not doesn't trigger a mismatch
+	 */
+
+	while (p1_end > p1 && (p1_end[-1] == ' ' || p1_end[-1] == '\t'))
+		p1_end--;
+	while (p2_end > p2 && (p2_end[-1] == ' ' || p2_end[-1] == '\t'))
+		p2_end--;
+
+	while (p1 < p1_end && p2 < p2_end) {
+		char wst1 = 0, wst2 = 0;
+
+		while (p1 < p1_end && (*p1 == ' ' || *p1 == '\t')) {
+			p1++;
+			wst1 = 1;
+		}
+		while (p2 < p2_end && (*p2 == ' ' || *p2 == '\t')) {
+			p2++;
+			wst2 = 1;
+		}
+
+		if (wst1 != wst2)
+			return 1;
+
+		if (*p1 != *p2)
+			return 1;
+
+		p1++;
+		p2++;
+	}
+
+	return (p1 < p1_end) != (p2 < p2_end);
+}
+
+/*
+ * Same result as the scalar version, but once both sides are at the start of
+ * a token, we skip whatever they have in common with the mismatch kernel.  We
+ * back off to before any whitespace run the common part ends in, because the
+ * other side may continue that run differently.
+ */
+
+int
+fixdiff_wscmp(const char *p1, size_t l1, const char *p2, size_t l2)
+{
+	const char *p1_end = p1 + l1, *p2_end = p2 + l2;
+
+	while (p1_end > p1 && (p1_end[-1] == ' ' || p1_end[-1] == '\t'))
+		p1_end--;
+	while (p2_end > p2 && (p2_end[-1] == ' ' || p2_end[-1] == '\t'))
+		p2_end--;
+
+	while (p1 < p1_end && p2 < p2_end) {
+		char wst1 = 0, wst2 = 0;
+		size_t m;
+
+		while (p1 < p1_end && (*p1 == ' ' || *p1 == '\t')) {
+			p1++;
+			wst1 = 1;
+		}
+		while (p2 < p2_end && (*p2 == ' ' || *p2 == '\t')) {
+			p2++;
+			wst2 = 1;
+		}
+
+		if (wst1 != wst2)
+			return 1;
+
+		m = (size_t)(p1_end - p1);
+		if ((size_t)(p2_end - p2) < m)
+			m = (size_t)(p2_end - p2);
+
+		m = fixdiff_mismatch(p1, p2, m);
+		while (m && (p1[m - 1] == ' ' || p1[m - 1] == '\t'))
+			m--;
+
+		if (!m)
+			return 1; /* *p1 != *p2 */
+
+		p1 += m;
+		p2 += m;
+	}
+
+	return (p1 < p1_end) != (p2 < p2_end);
+}
+
+/*
+ * Myers' bit-parallel edit distance, in Hyyrö's blocked form for patterns
+ * longer than 64 chars.  The shorter line is the pattern, each bit of the
+ * column deltas Pv / Mv is one of its chars, and we walk the longer line a
+ * char at a time tracking the distance at the bottom row.
+ */
+
+int
+fixdiff_edit_distance(const char *a, size_t la, const char *b, size_t lb,
+		      int max, uint64_t *scratch)
+{
+	uint64_t *peq = scratch, *pv, *mv, last;
+	size_t nb, i, j, blk;
+	int score;
+
+	if (la > lb) {
+		const char *t = a;
+		size_t tl = la;
+
+		a = b;
+		la = lb;
+		b = t;
+		lb = tl;
+	}
+
+	if (lb - la > (size_t)max)
+		return max + 1;
+	if (!la)
+		return (int)lb;
+
+	nb = (la + 63) / 64;
+	pv = peq + nb * 256;
+	mv = pv + nb;
+
+	for (i = 0; i < la; i++)
+		peq[(i >> 6) * 256 + (uint8_t)a[i]] |= 1ull << (i & 63);
+	for (blk = 0; blk < nb; blk++) {
+		pv[blk] = ~0ull;
+		mv[blk] = 0;
+	}
+
+	last = 1ull << ((la - 1) & 63);
+	score = (int)la;
+
+	for (j = 0; j < lb; j++) {
+		const uint64_t *eqc = peq + (uint8_t)b[j];
+		int hin = 1; /* row 0 is the distance from the empty pattern */
+
+		for (blk = 0; blk < nb; blk++) {
+			uint64_t eq = eqc[blk * 256], xv, xh, ph, mh,
+				 hb = blk == nb - 1 ? last : 1ull << 63;
+			int hout = 0;
+
+			xv = eq | mv[blk];
+			if (hin < 0)
+				eq |= 1;
+			xh = (((eq & pv[blk]) + pv[blk]) ^ pv[blk]) | eq;
+			ph = mv[blk] | ~(xh | pv[blk]);
+			mh = pv[blk] & xh;
+
+			if (ph & hb)
+				hout = 1;
+			if (mh & hb)
+				hout = -1;
+
+			ph <<= 1;
+			mh <<= 1;
+			if (hin < 0)
+				mh |= 1;
+			else if (hin > 0)
+				ph |= 1;
+
+			pv[blk] = mh | ~(xv | ph);
+			mv[blk] = ph & xv;
+			hin = hout;
+		}
+
+		score += hin;
+
+		/* each remaining char can take at most one off the distance */
+
+		if (score - (int)(lb - j - 1) > max)
+			break;
+	}
+
+	for (i = 0; i < la; i++)
+		peq[(i >> 6) * 256 + (uint8_t)a[i]] = 0;
+	memset(pv, 0, nb * 2 * sizeof(*pv));
+
+	return score <= max && j >= lb ? score : max + 1;
+}
@@ -0,0 +1,87 @@
+/*
+ * fixdiff - line compare and newline scan kernels
+ *
+ * Copyright (C) 2025 Andy Green <andy@warmcat.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+#if !defined(__FIXDIFF_SIMD_H__)
+#define __FIXDIFF_SIMD_H__
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Returns the index of the first byte that differs between a and b, or len
+ * if they are the same
+ */
+typedef size_t (*fixdiff_mismatch_t)(const char *a, const char *b, size_t len);
+
+/*
+ * Returns a pointer to the first '\n' in p, or NULL if none
+ */
+typedef const char *(*fixdiff_scan_nl_t)(const char *p, size_t len);
+
+/*
+ * The best implementations for this cpu, selected by fixdiff_simd_init() when
+ * we are loaded... until then, they point to the scalar versions
+ */
+extern fixdiff_mismatch_t fixdiff_mismatch;
+extern fixdiff_scan_nl_t fixdiff_scan_nl;
+
+void
+fixdiff_simd_init(void);
+
+/*
+ * Compare two lines without their EOL, ignoring trailing whitespace and
+ * treating any run of spaces and tabs as a single whitespace token.
+ * Returns 0 if they match.
+ */
+int
+fixdiff_wscmp(const char *p1, size_t l1, const char *p2, size_t l2);
+
+/*
+ * The edit distance between two lines, or max + 1 if it is more than max.
+ * scratch must be zeroed and hold FIXDIFF_EDIT_SCRATCH(shorter length) words,
+ * it is left zeroed again afterwards.
+ */
+#define FIXDIFF_EDIT_SCRATCH(_l) ((((_l) + 63) / 64) * 258)
+
+int
+fixdiff_edit_distance(const char *a, size_t la, const char *b, size_t lb,
+		      int max, uint64_t *scratch);
+
+/*
+ * The individual implementations, scalar, SSE2 and AVX2, so the selftest can
+ * check them against the scalar ones.  The SIMD ones are NULL if not built in,
+ * fixdiff_simd_impl_usable() says if the cpu can run them.
+ */
+
+extern const fixdiff_mismatch_t fixdiff_mismatch_impl[3];
+extern const fixdiff_scan_nl_t fixdiff_scan_nl_impl[3];
+extern const char * const fixdiff_simd_impl_names[3];
+
+int
+fixdiff_simd_impl_usable(int n);
+
+int
+fixdiff_wscmp_scalar(const char *p1, size_t l1, const char *p2, size_t l2);
+
+#endif
@@ -0,0 +1,451 @@
+/*
+ * fixdiff - synthetic scaling benchmark
+ *
+ * Copyright (C) 2025 Andy Green <andy@warmcat.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ *
+ * Generates source files of 1k to 1M lines, and for each, patches broken the
+ * ways LLMs break them, then times fixing them through the library.  The
+ * generator is seeded the same every time, so the numbers can be compared
+ * across commits.  Results go to stdout as JSON.
+ *
+ * Every stanza changes a distinct line, so we know where it belongs, and a
+ * scenario only counts as ok if every stanza was placed there.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdarg.h>
+#include <time.h>
+#include <errno.h>
+#include <sys/stat.h>
+
+#include "../fixdiff.h"
+
+typedef enum {
+	SC_CLEAN,	/* correct patch */
+	SC_HEADERS,	/* wrong @@ header numbers */
+	SC_WS,		/* whitespace drift in the context */
+	SC_LEADIN,	/* 4 lines of lead-in context */
+	SC_EOF,		/* last stanza missing its context at EOF */
+	SC_BLANK,	/* blank context lines without their space, extra LFs */
+	SC_MIXED,	/* a random one of the above per stanza */
+
+	SC_COUNT
+} scenario_t;
+
+static const char * const sc_names[] = {
+	"clean", "headers", "ws", "leadin", "eof", "blank", "mixed"
+};
+
+static const int sizes[] = { 1000, 10000, 100000, 1000000 };
+
+typedef struct {
+	char		*buf;
+	size_t		len;
+	size_t		alloc;
+} gbuf_t;
+
+typedef struct {
+	char		*buf;
+	size_t		*lo; /* line offsets, lines + 1 of them */
+	int		lines;
+} src_t;
+
+static uint32_t seed;
+
+static uint32_t
+rnd(void)
+{
+	seed ^= seed << 13;
+	seed ^= seed >> 17;
+	seed ^= seed << 5;
+
+	return seed;
+}
+
+static void
+gadd(gbuf_t *g, const char *p, size_t len)
+{
+	if (g->len + len > g->alloc) {
+		size_t na = (g->alloc ? g->alloc * 2 : 65536) + len;
+		char *b = realloc(g->buf, na);
+
+		if (!b) {
+			fprintf(stderr, "OOM\n");
+			exit(1);
+		}
+		g->buf = b;
+		g->alloc = na;
+	}
+
+	memcpy(g->buf + g->len, p, len);
+	g->len += len;
+}
+
+static void
+gprintf(gbuf_t *g, const char *fmt, ...)
+{
+	char b[256];
+	va_list ap;
+	int n;
+
+	va_start(ap, fmt);
+	n = vsnprintf(b, sizeof(b), fmt, ap);
+	va_end(ap);
+
+	gadd(g, b, (size_t)n);
+}
+
+/*
+ * Mostly distinct statements, with the blank lines, closing braces and
+ * returns that make real sources repetitive
+ */
+
+static int
+gen_source(src_t *s, int lines, const char *path)
+{
+	gbuf_t g;
+	FILE *f;
+	int n;
+
+	memset(&g, 0, sizeof(g));
+	s->lo = malloc(((size_t)lines + 1) * sizeof(*s->lo));
+	if (!s->lo)
+		return 1;
+
+	seed = 0x5eed0000u ^ (uint32_t)lines;
+
+	for (n = 0; n < lines; n++) {
+		uint32_t r = rnd() % 100;
+
+		s->lo[n] = g.len;
+		if (r < 12)
+			gadd(&g, "\n", 1);
+		else if (r < 20)
+			gadd(&g, "\t}\n", 3);
+		else if (r < 25)
+			gadd(&g, "\treturn 0;\n", 11);
+		else
+			gprintf(&g, "\tstmt_%d(a, b, %u);\n", n, rnd() % 1000);
+	}
+	s->lo[lines] = g.len;
+	s->buf = g.buf;
+	s->lines = lines;
+
+	f = fopen(path, "wb");
+	if (!f)
+		return 1;
+	n = fwrite(g.buf, 1, g.len, f) != g.len;
+
+	return fclose(f) || n;
+}
+
+static int
+is_stmt(const src_t *s, int n)
+{
+	return s->buf[s->lo[n] + 1] == 's';
+}
+
+/* a source line as a stanza line starting with c, broken as sc says */
+
+static void
+emit_line(gbuf_t *g, const src_t *s, int n, char c, scenario_t sc)
+{
+	const char *p = s->buf + s->lo[n];
+	size_t len = s->lo[n + 1] - s->lo[n];
+
+	if (sc == SC_BLANK && c == ' ' && len == 1) {
+		/* LLMs often lose the space, or indent blank lines */
+		if (rnd() & 1)
+			gadd(g, "\n", 1);
+		else
+			gadd(g, "    \n", 5);
+		return;
+	}
+
+	gadd(g, &c, 1);
+
+	if (sc == SC_WS && c == ' ' && *p == '\t' && (rnd() & 1)) {
+		/* tab to spaces, and trailing whitespace */
+		gadd(g, "    ", 4);
+		gadd(g, p + 1, len - 2);
+		gadd(g, "  \n", 3);
+		return;
+	}
+
+	gadd(g, p, len);
+}
+
+/*
+ * A patch with nst stanzas evenly through the file, each removing one or two
+ * distinct lines and adding a few, with 3 lines of context either side.
+ * exp[] gets the 1-based source line each stanza should be placed at.
+ */
+
+static int
+gen_patch(gbuf_t *g, const src_t *s, const char *name, scenario_t sc,
+	  int nst, int *exp, int *patch_lines)
+{
+	int k, delta = 0, spacing = (s->lines - 16) / nst;
+
+	seed = 0xb0000000u ^ (uint32_t)s->lines ^ ((uint32_t)sc << 20);
+	g->len = 0;
+
+	gprintf(g, "--- a/%s\n+++ b/%s\n", name, name);
+
+	for (k = 0; k < nst; k++) {
+		int p = 4 + k * spacing + (int)(rnd() % (uint32_t)(spacing / 4 + 1)),
+		    nd = 1 + (int)(rnd() % 2), na = 1 + (int)(rnd() % 3),
+		    lead = 3, trail = 3, n, os, oc, ns, nc;
+		scenario_t ss = sc;
+
+		if (sc == SC_MIXED)
+			ss = (scenario_t)(1 + rnd() % (SC_MIXED - 1));
+
+		/* the last stanza sits right at EOF */
+
+		if (k == nst - 1 && ss == SC_EOF) {
+			p = s->lines - 3 - nd - 3;
+			trail = 1;
+		}
+
+		/* the first removed line must be one only found here */
+
+		while (!is_stmt(s, p + 3))
+			if (trail == 1) {
+				if (--p < 1)
+					return 1;
+			} else
+				if (++p + 3 + nd + 3 >= s->lines)
+					return 1;
+		exp[k] = p + 1;
+
+		if (ss == SC_LEADIN)
+			lead = 4;
+
+		os = p + 1;
+		oc = 3 + nd + 3;
+		ns = os + delta;
+		nc = 3 + na + 3;
+		delta += na - nd;
+
+		if (ss == SC_HEADERS) {
+			os = 1 + (int)(rnd() % (uint32_t)s->lines);
+			ns = os + (int)(rnd() % 20);
+			oc += (int)(rnd() % 5);
+			nc -= (int)(rnd() % 3);
+		}
+
+		gprintf(g, "@@ -%d,%d +%d,%d @@\n", os, oc, ns, nc);
+
+		for (n = p + 3 - lead; n < p + 3; n++)
+			emit_line(g, s, n, ' ', ss);
+		for (n = 0; n < nd; n++)
+			emit_line(g, s, p + 3 + n, '-', ss);
+		for (n = 0; n < na; n++)
+			gprintf(g, "+\tadded_%d_%d();\n", k, n);
+		for (n = 0; n < trail; n++)
+			emit_line(g, s, p + 3 + nd + n, ' ', ss);
+
+		if (ss == SC_BLANK)
+			gadd(g, "\n", 1); /* between stanzas */
+	}
+
+	for (k = 0; k < (int)g->len; k++)
+		*patch_lines += g->buf[k] == '\n';
+
+	return 0;
+}
+
+/* how many of the fixed stanza headers are at the expected place */
+
+static int
+placed(const char *o, size_t len, const int *exp, int nst)
+{
+	const char *end = o + len;
+	int k = 0, good = 0;
+
+	while (o < end && k < nst) {
+		const char *nl = memchr(o, '\n', (size_t)(end - o));
+
+		if (!nl)
+			nl = end;
+		if (nl - o > 4 && !strncmp(o, "@@ -", 4))
+			good += atoi(o + 4) == exp[k++];
+		o = nl + 1;
+	}
+
+	return good;
+}
+
+static double
+now_ms(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (double)ts.tv_sec * 1000.0 + (double)ts.tv_nsec / 1000000.0;
+}
+
+int
+main(int argc, char *argv[])
+{
+	int max_lines = 1000000, repeat = 3, n, k, first = 1, fails = 0;
+	const char *dir = "bench";
+	fixdiff_info_t info;
+	gbuf_t g;
+
+	memset(&info, 0, sizeof(info));
+	memset(&g, 0, sizeof(g));
+
+	for (n = 1; n < argc; n++) {
+		if (!strcmp(argv[n], "--nearest")) {
+			info.flags |= FIXDIFF_FLAG_NEAREST;
+			continue;
+		}
+		if (!strcmp(argv[n], "--pipeline")) {
+			info.flags |= FIXDIFF_FLAG_PIPELINE;
+			continue;
+		}
+		if (n + 1 < argc && !strcmp(argv[n], "--fuzzy")) {
+			info.fuzz = atoi(argv[++n]);
+			continue;
+		}
+		if (n + 1 < argc && !strcmp(argv[n], "-j")) {
+			info.jobs = atoi(argv[++n]);
+			continue;
+		}
+		if (n + 1 < argc && !strcmp(argv[n], "--max-lines")) {
+			max_lines = atoi(argv[++n]);
+			continue;
+		}
+		if (n + 1 < argc && !strcmp(argv[n], "--repeat")) {
+			repeat = atoi(argv[++n]);
+			if (repeat < 1)
+				repeat = 1;
+			continue;
+		}
+		if (n + 1 < argc && !strcmp(argv[n], "--dir")) {
+			dir = argv[++n];
+			continue;
+		}
+
+		fprintf(stderr, "Usage: %s [--max-lines n] [--repeat n] "
+				"[--dir dir] [--nearest] [--fuzzy edits] "
+				"[-j threads] [--pipeline]\n", argv[0]);
+		return 1;
+	}
+
+	if (mkdir(dir, 0755) && errno != EEXIST) {
+		fprintf(stderr, "Unable to create %s\n", dir);
+		return 1;
+	}
+	info.root = dir;
+
+	printf("{\n \"options\": { \"nearest\": %s, \"fuzzy\": %d, "
+	       "\"jobs\": %d, \"pipeline\": %s, \"repeat\": %d },\n"
+	       " \"results\": [",
+	       info.flags & FIXDIFF_FLAG_NEAREST ? "true" : "false",
+	       info.fuzz, info.jobs ? info.jobs : 1,
+	       info.flags & FIXDIFF_FLAG_PIPELINE ? "true" : "false", repeat);
+
+	for (n = 0; n < (int)(sizeof(sizes) / sizeof(sizes[0])) &&
+		    sizes[n] <= max_lines; n++) {
+		int nst = sizes[n] / 200, *exp;
+		char name[32], path[512];
+		src_t s;
+
+		if (nst < 5)
+			nst = 5;
+		if (nst > 1000)
+			nst = 1000;
+
+		snprintf(name, sizeof(name), "bench-%d.c", sizes[n]);
+		snprintf(path, sizeof(path), "%s/%s", dir, name);
+
+		exp = malloc((size_t)nst * sizeof(*exp));
+		if (!exp || gen_source(&s, sizes[n], path)) {
+			fprintf(stderr, "Unable to generate %s\n", path);
+			return 1;
+		}
+
+		for (k = 0; k < SC_COUNT; k++) {
+			double best = 0, t;
+			int r, pl = 0, good = 0, ret = 0;
+
+			if (gen_patch(&g, &s, name, (scenario_t)k, nst, exp,
+				      &pl)) {
+				fprintf(stderr, "Unable to generate patch\n");
+				return 1;
+			}
+
+			for (r = 0; r < repeat; r++) {
+				fixdiff_result_t res;
+				fixdiff_t *ctx = fixdiff_create(&info);
+				const char *o;
+				size_t len;
+
+				if (!ctx) {
+					fprintf(stderr, "OOM\n");
+					return 1;
+				}
+
+				t = now_ms();
+				ret |= fixdiff_fix_buf(ctx, g.buf, g.len, &res);
+				t = now_ms() - t;
+				if (!r || t < best)
+					best = t;
+
+				o = fixdiff_output(ctx, &len);
+				good = placed(o, len, exp, nst);
+				fixdiff_destroy(&ctx);
+			}
+
+			if (ret || good != nst)
+				fails++;
+
+			printf("%s\n  { \"lines\": %d, \"scenario\": \"%s\", "
+			       "\"stanzas\": %d, \"patch_lines\": %d, "
+			       "\"placed\": %d, \"ok\": %s, \"wall_ms\": %.3f, "
+			       "\"lines_per_sec\": %.0f, "
+			       "\"stanzas_per_sec\": %.0f }",
+			       first ? "" : ",", sizes[n], sc_names[k], nst, pl,
+			       good, !ret && good == nst ? "true" : "false",
+			       best, (double)sizes[n] * 1000.0 / best,
+			       (double)nst * 1000.0 / best);
+			first = 0;
+			fflush(stdout);
+		}
+
+		free(exp);
+		free(s.buf);
+		free(s.lo);
+		remove(path);
+	}
+
+	printf("\n ]\n}\n");
+	free(g.buf);
+
+	return !!fails;
+}
@@ -0,0 +1,72 @@
+# Applies tests/2 with --apply, alone, on jobs and pipelined, and checks the
+# files... then applies test1 with an index line giving the right result blob
+# id and --verify-sha, and again with a wrong one, which must fail and leave
+# the source alone.
+
+set(WORK ${CMAKE_CURRENT_BINARY_DIR}/apply)
+
+function(fresh t)
+	file(REMOVE_RECURSE ${WORK})
+	file(MAKE_DIRECTORY ${WORK}/a)
+	foreach(f ${ARGN})
+		file(COPY_FILE ${TESTS}/${t}/${f}-orig ${WORK}/a/${f})
+	endforeach()
+endfunction()
+
+function(check f sha)
+	file(SHA256 ${WORK}/a/${f} RESULT_SHA256)
+	if (NOT "${RESULT_SHA256}" STREQUAL "${sha}")
+		message(FATAL_ERROR "${f} SHA256 differs: ${RESULT_SHA256}")
+	endif()
+endfunction()
+
+foreach(args "" "-j 2" "--pipeline -j 2")
+	fresh(2 ${SRC} ${SRC1})
+
+	separate_arguments(CMD_ARGS UNIX_COMMAND "${args}")
+	execute_process(COMMAND ${CMD} ${CMD_ARGS} --apply --root a
+			INPUT_FILE ${TESTS}/2/gemini.patch
+			OUTPUT_VARIABLE OUT
+			WORKING_DIRECTORY ${WORK}
+			RESULT_VARIABLE CMD_RESULT)
+	if (CMD_RESULT OR NOT "${OUT}" STREQUAL "")
+		message(FATAL_ERROR "Error running ${CMD} ${args} --apply")
+	endif()
+
+	check(${SRC} ${EXPSHA})
+	check(${SRC1} ${EXPSHA1})
+
+	file(GLOB LEFT ${WORK}/a/*)
+	list(LENGTH LEFT N)
+	if (NOT N EQUAL 2)
+		message(FATAL_ERROR "${args}: left ${LEFT}")
+	endif()
+endforeach()
+
+file(READ ${TESTS}/1/gemini.patch P)
+
+foreach(t "${BLOB};0" "1234567;1")
+	list(GET t 0 ID)
+	list(GET t 1 FAILS)
+
+	fresh(1 ${SRC2})
+	file(WRITE ${WORK}/index.patch "index bd79f1a..${ID} 100644\n${P}")
+
+	execute_process(COMMAND ${CMD} --apply --verify-sha --root a -j 2
+			INPUT_FILE ${WORK}/index.patch
+			WORKING_DIRECTORY ${WORK}
+			RESULT_VARIABLE CMD_RESULT)
+
+	if (FAILS)
+		if (NOT CMD_RESULT)
+			message(FATAL_ERROR "--verify-sha accepted ${ID}")
+		endif()
+		file(SHA256 ${TESTS}/1/${SRC2}-orig ORIG_SHA256)
+		check(${SRC2} ${ORIG_SHA256})
+	else()
+		if (CMD_RESULT)
+			message(FATAL_ERROR "--verify-sha rejected ${ID}")
+		endif()
+		check(${SRC2} ${EXPSHA2})
+	endif()
+endforeach()
@@ -0,0 +1,45 @@
+# Fixes tests/2, 3 and 4 in one --batch run against a shared root, then
+# applies each .fixed patch to fresh copies of the sources and checks them
+
+set(WORK ${CMAKE_CURRENT_BINARY_DIR}/batch)
+file(REMOVE_RECURSE ${WORK})
+file(MAKE_DIRECTORY ${WORK}/src ${WORK}/p)
+
+foreach(f ${SRC} ${SRC1})
+	file(COPY_FILE ${TESTS}/2/${f}-orig ${WORK}/src/${f})
+endforeach()
+
+foreach(t 2 3 4)
+	file(COPY_FILE ${TESTS}/${t}/gemini.patch ${WORK}/p/${t}.patch)
+endforeach()
+
+execute_process(COMMAND ${CMD} --batch p --root src -j 2
+		WORKING_DIRECTORY ${WORK}
+		RESULT_VARIABLE CMD_RESULT)
+if (CMD_RESULT)
+	message(FATAL_ERROR "Error running ${CMD} --batch")
+endif()
+
+foreach(t 2 3 4)
+	file(REMOVE_RECURSE ${WORK}/a${t})
+	file(MAKE_DIRECTORY ${WORK}/a${t})
+	foreach(f ${SRC} ${SRC1})
+		file(COPY_FILE ${TESTS}/2/${f}-orig ${WORK}/a${t}/${f})
+	endforeach()
+
+	execute_process(COMMAND patch -p1 -i ${WORK}/p/${t}.patch.fixed
+			WORKING_DIRECTORY ${WORK}/a${t}
+			RESULT_VARIABLE CMD_RESULT)
+	if (CMD_RESULT)
+		message(FATAL_ERROR "${t}.patch.fixed didn't apply")
+	endif()
+
+	file(SHA256 ${WORK}/a${t}/${SRC} RESULT_SHA256)
+	if (NOT "${RESULT_SHA256}" STREQUAL "${EXPSHA}")
+		message(FATAL_ERROR "${t}: ${SRC} SHA256 differs: ${RESULT_SHA256}")
+	endif()
+	file(SHA256 ${WORK}/a${t}/${SRC1} RESULT_SHA256)
+	if (NOT "${RESULT_SHA256}" STREQUAL "${EXPSHA1}")
+		message(FATAL_ERROR "${t}: ${SRC1} SHA256 differs: ${RESULT_SHA256}")
+	endif()
+endforeach()
@@ -0,0 +1,54 @@
+# Fixes tests/2 twice with --cache, where the second run must find every
+# placement in the cache without searching and give the same fixed patch...
+# then changes a source, where the stale entries must not be used
+
+set(WORK ${CMAKE_CURRENT_BINARY_DIR}/cache)
+file(REMOVE_RECURSE ${WORK})
+file(MAKE_DIRECTORY ${WORK})
+
+foreach(f ${SRC} ${SRC1})
+	file(COPY_FILE ${TESTS}/${f}-orig ${WORK}/${f})
+endforeach()
+
+function(fix n)
+	execute_process(COMMAND ${CMD} --cache=${WORK}/c --stats=${WORK}/${n}.json
+			INPUT_FILE ${TESTS}/${PATCH}
+			OUTPUT_FILE ${WORK}/${n}.patch
+			WORKING_DIRECTORY ${WORK}
+			RESULT_VARIABLE CMD_RESULT)
+	if (CMD_RESULT)
+		message(FATAL_ERROR "Error running ${CMD} --cache (${n})")
+	endif()
+	file(READ ${WORK}/${n}.json J)
+	string(REGEX MATCHALL "\"candidates\": [1-9]" S "${J}")
+	list(LENGTH S NS)
+	set(SEARCHED ${NS} PARENT_SCOPE)
+endfunction()
+
+fix(1)
+if (SEARCHED EQUAL 0)
+	message(FATAL_ERROR "first run didn't search")
+endif()
+
+file(GLOB ENTRIES ${WORK}/c/*)
+list(LENGTH ENTRIES N)
+if (NOT N EQUAL 6)
+	message(FATAL_ERROR "${N} cache entries, expected 6")
+endif()
+
+fix(2)
+if (NOT SEARCHED EQUAL 0)
+	message(FATAL_ERROR "second run searched for ${SEARCHED} stanzas")
+endif()
+
+file(SHA256 ${WORK}/1.patch S1)
+file(SHA256 ${WORK}/2.patch S2)
+if (NOT S1 STREQUAL S2)
+	message(FATAL_ERROR "fixed patch from the cache differs")
+endif()
+
+file(APPEND ${WORK}/${SRC1} "/* changed */\n")
+fix(3)
+if (SEARCHED EQUAL 0)
+	message(FATAL_ERROR "changed source used the stale cache")
+endif()
@@ -0,0 +1,45 @@
+# Checks tests/2 with --check, which must place every stanza and output
+# nothing, then again with a context line of the second stanza broken, where
+# --check stops there and --check-all lists the other five as placed
+
+set(WORK ${CMAKE_CURRENT_BINARY_DIR}/check)
+file(REMOVE_RECURSE ${WORK})
+file(MAKE_DIRECTORY ${WORK})
+
+foreach(f ${SRC} ${SRC1})
+	file(COPY_FILE ${TESTS}/${f}-orig ${WORK}/${f})
+endforeach()
+
+file(READ ${TESTS}/${PATCH} P)
+file(WRITE ${WORK}/good.patch "${P}")
+string(REPLACE "lws_end_foreach_llp(ppss, pss_list);\n \n"
+	       "lws_end_foreach_llp(ppss, pss_list);\n broken\n" P "${P}")
+file(WRITE ${WORK}/bad.patch "${P}")
+
+foreach(t "good;--check;0;6;0" "bad;--check;1;1;1" "bad;--check-all;1;5;1"
+	  "bad;--check-all -j 2;1;5;1")
+	list(GET t 0 IN)
+	list(GET t 1 ARGS)
+	list(GET t 2 FAILS)
+	list(GET t 3 PLACED)
+	list(GET t 4 UNPLACED)
+
+	separate_arguments(CMD_ARGS UNIX_COMMAND "${ARGS}")
+	execute_process(COMMAND ${CMD} ${CMD_ARGS}
+			INPUT_FILE ${WORK}/${IN}.patch
+			OUTPUT_VARIABLE OUT
+			ERROR_VARIABLE ERR
+			WORKING_DIRECTORY ${WORK}
+			RESULT_VARIABLE CMD_RESULT)
+
+	string(REGEX MATCHALL "stanza [0-9]+: line" L "${ERR}")
+	list(LENGTH L NL)
+	string(REGEX MATCHALL "stanza [0-9]+: can't" U "${ERR}")
+	list(LENGTH U NU)
+
+	if ((FAILS AND NOT CMD_RESULT) OR (NOT FAILS AND CMD_RESULT) OR
+	    NOT "${OUT}" STREQUAL "" OR NOT NL EQUAL PLACED OR
+	    NOT NU EQUAL UNPLACED)
+		message(FATAL_ERROR "${IN} ${ARGS}: ${CMD_RESULT}\n${ERR}")
+	endif()
+endforeach()
@@ -0,0 +1,65 @@
+# Makes a git repo whose older commit has the original source, with garbage
+# at HEAD and in the worktree, then fixes the patch with --git-rev against the
+# older commit, and again against HEAD with an index line naming the
+# original's blob.  Each result is applied to a fresh copy of the original.
+
+set(WORK ${CMAKE_CURRENT_BINARY_DIR}/git)
+file(REMOVE_RECURSE ${WORK})
+file(MAKE_DIRECTORY ${WORK}/repo)
+
+function(git)
+	execute_process(COMMAND ${GIT} -c user.name=fixdiff -c user.email=fixdiff
+				${ARGN}
+			WORKING_DIRECTORY ${WORK}/repo
+			OUTPUT_VARIABLE OUT
+			OUTPUT_STRIP_TRAILING_WHITESPACE
+			RESULT_VARIABLE CMD_RESULT)
+	if (CMD_RESULT)
+		message(FATAL_ERROR "git ${ARGN} failed")
+	endif()
+	set(OUT "${OUT}" PARENT_SCOPE)
+endfunction()
+
+file(COPY_FILE ${TESTS}/${SRC}-orig ${WORK}/repo/${SRC})
+git(init -q)
+git(add ${SRC})
+git(commit -q -m orig)
+git(hash-object ${SRC})
+string(SUBSTRING "${OUT}" 0 10 BLOB)
+file(WRITE ${WORK}/repo/${SRC} "garbage\n")
+git(commit -q -a -m garbage)
+file(WRITE ${WORK}/repo/${SRC} "worktree\n")
+
+file(READ ${TESTS}/${PATCH} P)
+file(WRITE ${WORK}/index.patch "diff --git a/${SRC} b/${SRC}\n"
+	"index ${BLOB}..1234567 100644\n${P}")
+
+foreach(t "HEAD~1;${TESTS}/${PATCH}" "HEAD;${WORK}/index.patch")
+	list(GET t 0 REV)
+	list(GET t 1 IN)
+
+	execute_process(COMMAND ${CMD} --git-rev ${REV} --root repo
+			INPUT_FILE ${IN}
+			OUTPUT_FILE ${WORK}/fixed.patch
+			WORKING_DIRECTORY ${WORK}
+			RESULT_VARIABLE CMD_RESULT)
+	if (CMD_RESULT)
+		message(FATAL_ERROR "Error running ${CMD} --git-rev ${REV}")
+	endif()
+
+	file(REMOVE_RECURSE ${WORK}/a)
+	file(MAKE_DIRECTORY ${WORK}/a)
+	file(COPY_FILE ${TESTS}/${SRC}-orig ${WORK}/a/${SRC})
+
+	execute_process(COMMAND patch -p1 -i ${WORK}/fixed.patch
+			WORKING_DIRECTORY ${WORK}/a
+			RESULT_VARIABLE CMD_RESULT)
+	if (CMD_RESULT)
+		message(FATAL_ERROR "${REV}: fixed patch didn't apply")
+	endif()
+
+	file(SHA256 ${WORK}/a/${SRC} RESULT_SHA256)
+	if (NOT "${RESULT_SHA256}" STREQUAL "${EXPSHA}")
+		message(FATAL_ERROR "${REV}: ${SRC} SHA256 differs: ${RESULT_SHA256}")
+	endif()
+endforeach()
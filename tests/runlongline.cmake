@@ -0,0 +1,42 @@
+# Fixes a patch against two sources with 1MB lines, one a minified line in the
+# context of a stanza, the other a file that is just that line, changed by a
+# stanza that is the last thing in the patch with no EOL... once with the
+# patch mapped, and once with it read from a pipe
+
+set(WORK ${CMAKE_CURRENT_BINARY_DIR}/longline)
+file(REMOVE_RECURSE ${WORK})
+file(MAKE_DIRECTORY ${WORK})
+
+string(REPEAT "var a=1;" 131072 L)
+
+file(WRITE ${WORK}/min.js "// header\n${L}\nfunction f() {\n\treturn 1;\n}\n")
+file(WRITE ${WORK}/one.js "${L}\n")
+
+file(WRITE ${WORK}/p.patch "--- a/min.js\n+++ b/min.js\n@@ -10,4 +10,4 @@\n"
+			   " ${L}\n function f() {\n-\treturn 1;\n"
+			   "+\treturn 2;\n }\n"
+			   "--- a/one.js\n+++ b/one.js\n@@ -5 +5 @@\n"
+			   "-${L}\n+${L}x")
+
+string(CONCAT EXP "--- a/min.js\n+++ b/min.js\n@@ -2,4 +2,4 @@\n"
+		  " ${L}\n function f() {\n-\treturn 1;\n+\treturn 2;\n }\n"
+		  "--- a/one.js\n+++ b/one.js\n@@ -1,1 +1,1 @@\n-${L}\n+${L}x\n")
+
+execute_process(COMMAND ${CMD}
+		INPUT_FILE ${WORK}/p.patch
+		OUTPUT_VARIABLE OUT1
+		WORKING_DIRECTORY ${WORK}
+		RESULT_VARIABLE R1)
+
+execute_process(COMMAND ${CMAKE_COMMAND} -E cat ${WORK}/p.patch
+		COMMAND ${CMD}
+		OUTPUT_VARIABLE OUT2
+		WORKING_DIRECTORY ${WORK}
+		RESULTS_VARIABLE R2)
+
+if (R1 OR NOT "${OUT1}" STREQUAL "${EXP}")
+	message(FATAL_ERROR "mapped patch: ${R1}")
+endif()
+if (NOT "${R2}" STREQUAL "0;0" OR NOT "${OUT2}" STREQUAL "${EXP}")
+	message(FATAL_ERROR "piped patch: ${R2}")
+endif()
@@ -0,0 +1,86 @@
+# Fixes tests/2 with --previous-result, then a second try at the patch with a
+# '+' line changed in one stanza and a context line dropped from another,
+# where every stanza must be placed at the first line tried, the same as
+# fixing the second try from scratch.  A stanza that changed so its context is
+# also found before where it went last time must go there, the same as without
+# the placements.  A placements file with a NUL in it is ignored.
+
+set(WORK ${CMAKE_CURRENT_BINARY_DIR}/previous)
+file(REMOVE_RECURSE ${WORK})
+file(MAKE_DIRECTORY ${WORK})
+
+foreach(f ${SRC} ${SRC1})
+	file(COPY_FILE ${TESTS}/${f}-orig ${WORK}/${f})
+endforeach()
+
+file(READ ${TESTS}/${PATCH} P)
+file(WRITE ${WORK}/1.patch "${P}")
+string(REPLACE "+	while ((de = readdir(dir))) {"
+	       "+	while ((de = readdir(dir)) != NULL) {" P "${P}")
+string(REPLACE " 		wp = strchr((const char *)fname, '\"');\n" "" P "${P}")
+file(WRITE ${WORK}/2.patch "${P}")
+
+function(fix n out)
+	execute_process(COMMAND ${CMD} ${ARGN}
+			INPUT_FILE ${WORK}/${n}.patch
+			OUTPUT_FILE ${WORK}/${out}
+			WORKING_DIRECTORY ${WORK}
+			RESULT_VARIABLE CMD_RESULT)
+	if (CMD_RESULT)
+		message(FATAL_ERROR "Error running ${CMD} ${ARGN} on ${n}.patch")
+	endif()
+endfunction()
+
+fix(1 1.out --previous-result ${WORK}/p)
+file(STRINGS ${WORK}/p L)
+list(LENGTH L N)
+if (NOT N EQUAL 7)
+	message(FATAL_ERROR "${N} lines of placements, expected 7")
+endif()
+
+fix(2 2.out --previous-result ${WORK}/p --stats=${WORK}/2.json)
+fix(2 2-scratch.out)
+
+file(READ ${WORK}/2.json J)
+string(REGEX MATCHALL "\"placed\": [0-9]+, \"candidates\": 1," C "${J}")
+list(LENGTH C N)
+if (NOT N EQUAL 6)
+	message(FATAL_ERROR "searched on the second try:\n${J}")
+endif()
+
+file(SHA256 ${WORK}/2.out S1)
+file(SHA256 ${WORK}/2-scratch.out S2)
+if (NOT S1 STREQUAL S2)
+	message(FATAL_ERROR "second try differs from fixing it from scratch")
+endif()
+
+file(WRITE ${WORK}/dup.c "static int\none(void)\n{\n\tint n = 0;\n\n"
+			 "\treturn n;\n}\n\nstatic int\ntwo(void)\n{\n"
+			 "\tint n = 0;\n\n\treturn n + 1;\n}\n")
+file(WRITE ${WORK}/3.patch "--- a/dup.c\n+++ b/dup.c\n@@ -12,3 +12,4 @@\n"
+			   " \tint n = 0;\n \n+\tn++;\n \treturn n + 1;\n")
+file(WRITE ${WORK}/4.patch "--- a/dup.c\n+++ b/dup.c\n@@ -12,2 +12,3 @@\n"
+			   " \tint n = 0;\n \n+\tn++;\n")
+fix(3 3.out --previous-result ${WORK}/p)
+fix(4 4.out --previous-result ${WORK}/p)
+fix(4 4-scratch.out)
+file(SHA256 ${WORK}/4.out S1)
+file(SHA256 ${WORK}/4-scratch.out S2)
+if (NOT S1 STREQUAL S2)
+	file(READ ${WORK}/4.out O)
+	message(FATAL_ERROR "changed stanza placed by the earlier fix:\n${O}")
+endif()
+
+file(COPY_FILE ${NUL} ${WORK}/nul)
+execute_process(COMMAND ${CMD} --previous-result ${WORK}/nul
+		INPUT_FILE ${WORK}/1.patch
+		OUTPUT_FILE ${WORK}/nul.out
+		ERROR_VARIABLE E
+		WORKING_DIRECTORY ${WORK}
+		RESULT_VARIABLE CMD_RESULT)
+file(SHA256 ${WORK}/1.out S1)
+file(SHA256 ${WORK}/nul.out S2)
+if (CMD_RESULT OR NOT E MATCHES "Ignoring unusable" OR
+    NOT S1 STREQUAL S2)
+	message(FATAL_ERROR "placements with a NUL: ${CMD_RESULT}\n${E}")
+endif()
@@ -0,0 +1,95 @@
+# Fixes patches against 1.8MB and 2.7MB sources, once loaded and once streamed
+# with a 1MB --max-mem, which must give the same output... one stanza has
+# whitespace fuzz, the other is at the end of the file, which has no EOL.
+# Applying to a streamed source must fail without changing it.
+
+set(WORK ${CMAKE_CURRENT_BINARY_DIR}/stream)
+file(REMOVE_RECURSE ${WORK})
+file(MAKE_DIRECTORY ${WORK})
+
+string(REPEAT "\tx++;\n" 150000 L)
+
+string(CONCAT SRC "int f(void)\n{\n${L}\tmark_one(a, b);\n\tmark_two();\n"
+		  "\tmark_three();\n${L}\ttail_one();\n\ttail_two();")
+file(WRITE ${WORK}/big.c "${SRC}")
+
+file(WRITE ${WORK}/p.patch "--- a/big.c\n+++ b/big.c\n@@ -10,4 +10,4 @@\n"
+			   " \tx++;\n \tmark_one(a,  b);\n-\tmark_two();\n"
+			   "+\tmark_2();\n \tmark_three();\n"
+			   "@@ -20,3 +20,3 @@\n \tx++;\n \tx++;\n"
+			   "-\ttail_one();\n+\ttail_1();\n")
+
+foreach(ARGS "" "--nearest;--pipeline")
+	execute_process(COMMAND ${CMD} ${ARGS}
+			INPUT_FILE ${WORK}/p.patch
+			OUTPUT_VARIABLE OUT1
+			WORKING_DIRECTORY ${WORK}
+			RESULT_VARIABLE R1)
+	execute_process(COMMAND ${CMD} ${ARGS} --max-mem 1
+			INPUT_FILE ${WORK}/p.patch
+			OUTPUT_VARIABLE OUT2
+			WORKING_DIRECTORY ${WORK}
+			RESULT_VARIABLE R2)
+
+	if (R1 OR R2 OR NOT "${OUT1}" STREQUAL "${OUT2}")
+		message(FATAL_ERROR "${ARGS}: ${R1} ${R2}\n${OUT1}\n${OUT2}")
+	endif()
+	if (NOT OUT2 MATCHES "\n \ttail_two\\(\\);\n$")
+		message(FATAL_ERROR "${ARGS}: no EOF context\n${OUT2}")
+	endif()
+endforeach()
+
+# Several stanzas of differing lengths for one streamed file, out of file
+# order... the last one's context is there twice, so --nearest picks the
+# second copy and otherwise it takes the first.
+
+string(CONCAT MANY "int g(void)\n{\n\tstep_a();\n\tstep_b();\n${L}"
+		   "\tstep_c();\n\tstep_d();\n\tstep_e();\n\tstep_f();\n${L}"
+		   "\tstep_a();\n\tstep_b();\n${L}\tstep_g();\n}\n")
+file(WRITE ${WORK}/many.c "${MANY}")
+
+file(WRITE ${WORK}/many.patch "--- a/many.c\n+++ b/many.c\n"
+			      "@@ -450010,3 +450010,3 @@\n \tx++;\n"
+			      "-\tstep_g();\n+\tstep_7();\n }\n"
+			      "@@ -150004,6 +150004,6 @@\n \tx++;\n"
+			      " \tstep_c();\n \tstep_d();\n-\tstep_e();\n"
+			      "+\tstep_5();\n \tstep_f();\n \tx++;\n"
+			      "@@ -300010,3 +300010,3 @@\n \tstep_a();\n"
+			      "-\tstep_b();\n+\tstep_2();\n \tx++;\n")
+
+foreach(ARGS "" "--nearest" "--pipeline" "--nearest;--pipeline")
+	execute_process(COMMAND ${CMD} ${ARGS}
+			INPUT_FILE ${WORK}/many.patch
+			OUTPUT_VARIABLE OUT1
+			WORKING_DIRECTORY ${WORK}
+			RESULT_VARIABLE R1)
+	execute_process(COMMAND ${CMD} ${ARGS} --max-mem 1
+			INPUT_FILE ${WORK}/many.patch
+			OUTPUT_VARIABLE OUT2
+			WORKING_DIRECTORY ${WORK}
+			RESULT_VARIABLE R2)
+
+	if (R1 OR R2 OR NOT "${OUT1}" STREQUAL "${OUT2}")
+		message(FATAL_ERROR "many ${ARGS}: ${R1} ${R2}\n${OUT1}\n${OUT2}")
+	endif()
+	if (ARGS MATCHES "nearest")
+		set(AT "\n@@ -300009,")
+	else()
+		set(AT "\n@@ -3,")
+	endif()
+	if (NOT OUT2 MATCHES "\n@@ -150004,.*${AT}")
+		message(FATAL_ERROR "many ${ARGS}: misplaced\n${OUT2}")
+	endif()
+endforeach()
+
+execute_process(COMMAND ${CMD} --apply --max-mem 1
+		INPUT_FILE ${WORK}/p.patch
+		OUTPUT_QUIET
+		ERROR_QUIET
+		WORKING_DIRECTORY ${WORK}
+		RESULT_VARIABLE R3)
+file(READ ${WORK}/big.c AFTER)
+
+if (NOT R3 OR NOT "${AFTER}" STREQUAL "${SRC}")
+	message(FATAL_ERROR "applied to a streamed source: ${R3}")
+endif()
@@ -6,8 +6,10 @@ function(patch_check CMD SRC SRC1 PATCH EXPSHA EXPSHA1 EXPSHA_WIN EXPSHA1_WIN)
 		file(COPY_FILE ${SRC1}-orig ${SRC1})
 	endif()
 
+	separate_arguments(CMD_ARGS UNIX_COMMAND "${ARGS}")
+
 	execute_process(COMMAND cat ${PATCH}
-			COMMAND ${CMD}
+			COMMAND ${CMD} ${CMD_ARGS}
 			COMMAND patch -p1
 			RESULT_VARIABLE CMD_RESULT)
 	if (CMD_RESULT)
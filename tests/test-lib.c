@@ -0,0 +1,183 @@
+/*
+ * fixdiff - selftest for the library api
+ *
+ * Copyright (C) 2025 Andy Green <andy@warmcat.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ *
+ * Writes a small source file in the cwd, then fixes a patch against it with
+ * a wrong header from several threads at once, each with its own context,
+ * using both the callback and collected output, and sometimes stats.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(FIXDIFF_WITH_PTHREADS)
+#include <pthread.h>
+#endif
+
+#include "../fixdiff.h"
+
+#define THREADS 8
+#define ITERATIONS 50
+
+static const char *patch =
+	"--- a/test-lib-src.c\n"
+	"+++ b/test-lib-src.c\n"
+	"@@ -1,3 +1,4 @@\n"
+	" line 5\n"
+	" line\t6\n"
+	"+added\n"
+	" line 7\n"
+	" line 8\n"
+	" line 9\n",
+		  *expected =
+	"--- a/test-lib-src.c\n"
+	"+++ b/test-lib-src.c\n"
+	"@@ -5,5 +5,6 @@\n"
+	" line 5\n"
+	" line 6\n"
+	"+added\n"
+	" line 7\n"
+	" line 8\n"
+	" line 9\n";
+
+typedef struct {
+	char		out[1024];
+	size_t		len;
+	int		fails;
+} result_t;
+
+static int
+out_cb(void *opaque, const char *buf, size_t len)
+{
+	result_t *r = (result_t *)opaque;
+
+	if (r->len + len > sizeof(r->out))
+		return 1;
+
+	memcpy(r->out + r->len, buf, len);
+	r->len += len;
+
+	return 0;
+}
+
+static void *
+worker(void *arg)
+{
+	result_t *r = (result_t *)arg;
+	int n;
+
+	for (n = 0; n < ITERATIONS; n++) {
+		fixdiff_info_t info;
+		fixdiff_result_t res;
+		const char *o;
+		fixdiff_t *ctx;
+		size_t len;
+
+		memset(&info, 0, sizeof(info));
+		if (n & 1) {
+			info.out = out_cb;
+			info.opaque = r;
+		}
+		if (!(n & 3))
+			info.flags |= FIXDIFF_FLAG_STATS;
+		r->len = 0;
+
+		ctx = fixdiff_create(&info);
+		if (!ctx) {
+			r->fails++;
+			continue;
+		}
+
+		if (fixdiff_fix_buf(ctx, patch, strlen(patch), &res)) {
+			o = fixdiff_diagnostics(ctx, &len);
+			fprintf(stderr, "fix failed: %.*s\n", (int)len, o);
+			r->fails++;
+		} else {
+			if (n & 1) {
+				o = r->out;
+				len = r->len;
+			} else
+				o = fixdiff_output(ctx, &len);
+
+			if (len != strlen(expected) || memcmp(o, expected, len) ||
+			    res.stanzas != 1 || res.repaired != 1) {
+				fprintf(stderr, "unexpected result: %.*s\n",
+					(int)len, o);
+				r->fails++;
+			}
+
+			o = fixdiff_stats(ctx, &len);
+			if ((info.flags & FIXDIFF_FLAG_STATS) &&
+			    (!strstr(o, "\"placed\": 5,") ||
+			     !strstr(o, "\"ret\": 0, \"stanzas\": 1, "
+					"\"repaired\": 1,"))) {
+				fprintf(stderr, "unexpected stats: %.*s\n",
+					(int)len, o);
+				r->fails++;
+			}
+		}
+
+		fixdiff_destroy(&ctx);
+	}
+
+	return NULL;
+}
+
+int
+main(void)
+{
+	result_t r[THREADS];
+	int n, fails = 0;
+	FILE *f;
+
+	f = fopen("test-lib-src.c", "wb");
+	if (!f)
+		return 1;
+	for (n = 1; n <= 20; n++)
+		fprintf(f, "line %d\n", n);
+	fclose(f);
+
+	memset(r, 0, sizeof(r));
+
+#if defined(FIXDIFF_WITH_PTHREADS)
+	{
+		pthread_t th[THREADS];
+
+		for (n = 0; n < THREADS; n++)
+			if (pthread_create(&th[n], NULL, worker, &r[n]))
+				return 1;
+		for (n = 0; n < THREADS; n++)
+			pthread_join(th[n], NULL);
+	}
+#else
+	for (n = 0; n < THREADS; n++)
+		worker(&r[n]);
+#endif
+
+	for (n = 0; n < THREADS; n++)
+		fails += r[n].fails;
+
+	printf("%d fails\n", fails);
+
+	return !!fails;
+}
@@ -0,0 +1,200 @@
+/*
+ * fixdiff - selftest for --serve
+ *
+ * Copyright (C) 2025 Andy Green <andy@warmcat.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ *
+ * Starts fixdiff --serve in the cwd, fixes a patch through it, then changes
+ * the source on disk both in place and by renaming over it, and checks the
+ * server noticed each time.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#define SOCK "test-serve.sock"
+
+static const char *patch =
+	"--- a/test-serve-src.c\n"
+	"+++ b/test-serve-src.c\n"
+	"@@ -1,3 +1,4 @@\n"
+	" line 5\n"
+	" line 6\n"
+	"+added\n"
+	" line 7\n"
+	" line 8\n"
+	" line 9\n";
+
+static int
+write_src(const char *name, int lead)
+{
+	FILE *f = fopen(name, "wb");
+	int n;
+
+	if (!f)
+		return 1;
+	while (lead--)
+		fprintf(f, "new\n");
+	for (n = 1; n <= 20; n++)
+		fprintf(f, "line %d\n", n);
+
+	return fclose(f);
+}
+
+/*
+ * Send the patch and check the response has the header we expect
+ */
+
+static int
+request(const char *hdr)
+{
+	struct sockaddr_un sa;
+	char buf[4096], exp[64];
+	size_t len = 0;
+	int fd, tries;
+	ssize_t r;
+
+	memset(&sa, 0, sizeof(sa));
+	sa.sun_family = AF_UNIX;
+	strcpy(sa.sun_path, SOCK);
+
+	/* the server may still be starting */
+
+	for (tries = 0; tries < 100; tries++) {
+		fd = socket(AF_UNIX, SOCK_STREAM, 0);
+		if (fd < 0)
+			return 1;
+		if (!connect(fd, (struct sockaddr *)&sa, sizeof(sa)))
+			break;
+		close(fd);
+		fd = -1;
+		usleep(50000);
+	}
+	if (fd < 0) {
+		fprintf(stderr, "unable to connect\n");
+		return 1;
+	}
+
+	if (write(fd, patch, strlen(patch)) != (ssize_t)strlen(patch) ||
+	    shutdown(fd, SHUT_WR)) {
+		close(fd);
+		return 1;
+	}
+
+	while (len < sizeof(buf) - 1 &&
+	       (r = read(fd, buf + len, sizeof(buf) - 1 - len)) > 0)
+		len += (size_t)r;
+	close(fd);
+	buf[len] = '\0';
+
+	snprintf(exp, sizeof(exp), "\n%s\n", hdr);
+	if (strncmp(buf, "0 ", 2) || !strstr(buf, exp)) {
+		fprintf(stderr, "expected %s, got: %s\n", hdr, buf);
+		return 1;
+	}
+
+	return 0;
+}
+
+int
+main(int argc, char *argv[])
+{
+	int fails = 0, status, tries;
+	pid_t pid;
+
+	if (argc < 2)
+		return 1;
+
+	if (write_src("test-serve-src.c", 0))
+		return 1;
+
+	/* it won't serve on, or delete, something that isn't a socket */
+
+	if (write_src("test-serve-file", 0))
+		return 1;
+	pid = fork();
+	if (pid < 0)
+		return 1;
+	if (!pid) {
+		execl(argv[1], argv[1], "--serve", "test-serve-file",
+		      (char *)NULL);
+		_exit(1);
+	}
+	for (tries = 0; tries < 100 && !waitpid(pid, &status, WNOHANG);
+	     tries++)
+		usleep(50000);
+	if (tries == 100) {
+		/* it's serving on where the file was */
+		kill(pid, SIGTERM);
+		waitpid(pid, &status, 0);
+	}
+	if (tries == 100 || !WIFEXITED(status) || !WEXITSTATUS(status) ||
+	    access("test-serve-file", F_OK)) {
+		fprintf(stderr, "served on a file\n");
+		fails++;
+	}
+
+	pid = fork();
+	if (pid < 0)
+		return 1;
+	if (!pid) {
+		execl(argv[1], argv[1], "--serve", SOCK, "--root", ".",
+		      (char *)NULL);
+		_exit(1);
+	}
+
+	fails += request("@@ -5,5 +5,6 @@");
+	fails += request("@@ -5,5 +5,6 @@");
+
+	/* changed in place */
+
+	fails += write_src("test-serve-src.c", 2);
+	fails += request("@@ -7,5 +7,6 @@");
+
+	/* replaced, the way editors do it */
+
+	fails += write_src("test-serve-src.c.tmp", 1);
+	fails += rename("test-serve-src.c.tmp", "test-serve-src.c");
+	fails += request("@@ -6,5 +6,6 @@");
+
+	kill(pid, SIGTERM);
+	if (waitpid(pid, &status, 0) != pid || !WIFEXITED(status) ||
+	    WEXITSTATUS(status)) {
+		fprintf(stderr, "server didn't exit cleanly\n");
+		fails++;
+	}
+
+	if (!access(SOCK, F_OK)) {
+		fprintf(stderr, "socket left behind\n");
+		fails++;
+	}
+
+	printf("%d fails\n", fails);
+
+	return !!fails;
+}
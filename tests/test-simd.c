@@ -0,0 +1,218 @@
+/*
+ * fixdiff - selftest for the line compare and newline scan kernels
+ *
+ * Copyright (C) 2025 Andy Green <andy@warmcat.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ *
+ * Checks every SIMD implementation the cpu can run gives the same answers as
+ * the scalar one, on random lines made mostly of whitespace and a couple of
+ * different characters, so the interesting cases come up often.  The bit-
+ * parallel edit distance is checked against the textbook dynamic programme.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+
+#include "../simd.h"
+
+static uint32_t seed = 0x12345678;
+
+static uint32_t
+rnd(void)
+{
+	seed ^= seed << 13;
+	seed ^= seed >> 17;
+	seed ^= seed << 5;
+
+	return seed;
+}
+
+static void
+fill(char *p, size_t len)
+{
+	static const char alpha[] = "  \t\tab\n";
+	size_t n;
+
+	for (n = 0; n < len; n++)
+		p[n] = alpha[rnd() % (sizeof(alpha) - 1)];
+}
+
+/* a copy of a with a few random whitespace-only edits */
+
+static size_t
+mutate(char *b, const char *a, size_t alen, size_t max)
+{
+	size_t n = 0, m = 0;
+
+	while (n < alen && m < max) {
+		switch (rnd() % 16) {
+		case 0: /* drop one */
+			n++;
+			break;
+		case 1: /* insert whitespace */
+			b[m++] = (rnd() & 1) ? ' ' : '\t';
+			break;
+		case 2: /* swap space and tab */
+			if (a[n] == ' ' || a[n] == '\t') {
+				b[m++] = a[n++] == ' ' ? '\t' : ' ';
+				break;
+			}
+			/* fallthru */
+		default:
+			b[m++] = a[n++];
+			break;
+		}
+	}
+
+	return m;
+}
+
+static int
+edit_distance_dp(const char *a, size_t la, const char *b, size_t lb)
+{
+	int row[201], i, j;
+
+	for (j = 0; j <= (int)lb; j++)
+		row[j] = j;
+
+	for (i = 1; i <= (int)la; i++) {
+		int diag = row[0];
+
+		row[0] = i;
+		for (j = 1; j <= (int)lb; j++) {
+			int up = row[j], v = diag + (a[i - 1] != b[j - 1]);
+
+			if (up + 1 < v)
+				v = up + 1;
+			if (row[j - 1] + 1 < v)
+				v = row[j - 1] + 1;
+			diag = up;
+			row[j] = v;
+		}
+	}
+
+	return row[lb];
+}
+
+static int
+test_edit_distance(void)
+{
+	static uint64_t scratch[FIXDIFF_EDIT_SCRATCH(200)];
+	char a[200], b[200];
+	int fails = 0, iter;
+	size_t n;
+
+	for (iter = 0; iter < 10000 && fails < 10; iter++) {
+		size_t al = rnd() % sizeof(a), bl;
+		int max = (int)(rnd() % 40), d, ref;
+
+		fill(a, al);
+		bl = mutate(b, a, al, sizeof(b));
+		if (bl && (rnd() & 1))
+			b[rnd() % bl] = 'b';
+
+		d = fixdiff_edit_distance(a, al, b, bl, max, scratch);
+		ref = edit_distance_dp(a, al, b, bl);
+		if (ref > max)
+			ref = max + 1;
+
+		if (d != ref) {
+			fprintf(stderr, "edit distance %d, expected %d, "
+				"max %d: '%.*s' '%.*s'\n", d, ref, max,
+				(int)al, a, (int)bl, b);
+			fails++;
+		}
+
+		for (n = 0; n < sizeof(scratch) / sizeof(scratch[0]); n++)
+			if (scratch[n]) {
+				fprintf(stderr, "edit distance scratch dirty\n");
+				return fails + 1;
+			}
+	}
+
+	if (!fails)
+		printf("edit distance: OK\n");
+
+	return fails;
+}
+
+int
+main(void)
+{
+	char a[200], b[200];
+	int fails = 0, i, n;
+
+	for (i = 0; i < 3; i++) {
+		int iter;
+
+		if (!fixdiff_simd_impl_usable(i))
+			continue;
+
+		fixdiff_mismatch = fixdiff_mismatch_impl[i];
+		fixdiff_scan_nl = fixdiff_scan_nl_impl[i];
+
+		for (iter = 0; iter < 200000; iter++) {
+			size_t al = rnd() % sizeof(a), bl, off;
+
+			fill(a, al);
+			if (rnd() & 1) {
+				memcpy(b, a, al);
+				bl = al;
+				if (al && (rnd() & 1))
+					b[rnd() % al] = 'b';
+			} else
+				bl = mutate(b, a, al, sizeof(b));
+
+			n = (int)(al < bl ? al : bl);
+			if (fixdiff_mismatch(a, b, (size_t)n) !=
+			    fixdiff_mismatch_impl[0](a, b, (size_t)n)) {
+				fprintf(stderr, "%s: mismatch differs\n",
+					fixdiff_simd_impl_names[i]);
+				fails++;
+			}
+
+			off = al ? rnd() % al : 0;
+			if (fixdiff_scan_nl(a + off, al - off) !=
+			    fixdiff_scan_nl_impl[0](a + off, al - off)) {
+				fprintf(stderr, "%s: scan_nl differs\n",
+					fixdiff_simd_impl_names[i]);
+				fails++;
+			}
+
+			if (!fixdiff_wscmp(a, al, b, bl) !=
+			    !fixdiff_wscmp_scalar(a, al, b, bl)) {
+				fprintf(stderr, "%s: wscmp differs '%.*s' '%.*s'\n",
+					fixdiff_simd_impl_names[i],
+					(int)al, a, (int)bl, b);
+				fails++;
+			}
+
+			if (fails > 10)
+				return 1;
+		}
+
+		printf("%s: OK\n", fixdiff_simd_impl_names[i]);
+	}
+
+	fails += test_edit_distance();
+
+	return !!fails;
+}